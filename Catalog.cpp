@@ -0,0 +1,489 @@
+#include <cassert>
+#include <algorithm>
+#include <cstring>
+
+#include "Catalog.h"
+#include "sthread.h"
+
+using namespace std;
+
+static const char* layoutNames[NUM_ITEM_LAYOUTS] = { "packed", "padded", "soa" };
+
+const char*
+item_layout_name(ItemLayout layout)
+{
+    return layoutNames[layout];
+}
+
+bool
+item_layout_parse(const char* name, ItemLayout* layout)
+{
+    for (int i = 0; i < NUM_ITEM_LAYOUTS; i++)
+    {
+        if (strcmp(name, layoutNames[i]) == 0)
+        {
+            *layout = (ItemLayout)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * publish --
+ *
+ *      Make the item available with the given stock, price and
+ *      discount, as a new incarnation. The item must not currently
+ *      be valid. The quantity stops at STOCK_QUANTITY_MAX.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Item::
+publish(int quantity, double newPrice, double newDiscount)
+{
+    uint64_t word = stock.load(memory_order_relaxed);
+    assert(!stock_valid(word));
+
+    price.store(newPrice, memory_order_relaxed);
+    discount.store(newDiscount, memory_order_relaxed);
+    // nobody takes stock from an invalid item, so a plain store is enough
+    word = stock_next(word, STOCK_INCARNATION_ONE, STOCK_INCARNATION_MASK);
+    stock.store(stock_plus(STOCK_VALID | (word & STOCK_VERSION_MASK), quantity),
+                memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * retire --
+ *
+ *      Stop carrying the item. Buyers that priced it earlier will
+ *      fail their CAS. The CAS loop is needed because lock-free
+ *      buyers may lower the quantity at the same time.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Item::
+retire()
+{
+    uint64_t word = stock.load(memory_order_relaxed);
+    uint64_t next;
+    do
+    {
+        next = stock_next(word, STOCK_INCARNATION_ONE, STOCK_INCARNATION_MASK) & ~STOCK_VALID;
+    } while (!stock.compare_exchange_weak(word, next, memory_order_release, memory_order_relaxed));
+}
+
+// move the revision on by one, whatever buyers do to the quantity meanwhile
+void Item::
+bumpRevision(memory_order order)
+{
+    uint64_t word = stock.load(memory_order_relaxed);
+    while (!stock.compare_exchange_weak(word, stock_next(word, STOCK_REVISION_ONE, STOCK_REVISION_MASK),
+                                        order, memory_order_relaxed))
+        ;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setPrice, setDiscount --
+ *
+ *      The seqlock write: bump the revision to odd, which snapshot
+ *      and takeAt refuse to price at, store the new value, then
+ *      bump it to even again. The release fence orders the first
+ *      bump before the store, so a reader that sees the new value
+ *      also sees the revision move; the release CAS orders the
+ *      store before the second bump.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Item::
+setPrice(double newPrice)
+{
+    bumpRevision(memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    price.store(newPrice, memory_order_relaxed);
+    bumpRevision(memory_order_release);
+}
+
+void Item::
+setDiscount(double newDiscount)
+{
+    bumpRevision(memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    discount.store(newDiscount, memory_order_relaxed);
+    bumpRevision(memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * addQuantity --
+ *
+ *      Add count (never negative) units. The quantity stops at
+ *      STOCK_QUANTITY_MAX (see stock_plus), so a huge count cannot
+ *      carry into the revision and incarnation above it. The CAS loop is
+ *      needed because lock-free buyers may lower the quantity at
+ *      the same time.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Item::
+addQuantity(int count)
+{
+    assert(count >= 0);
+    uint64_t word = stock.load(memory_order_relaxed);
+    while (!stock.compare_exchange_weak(word, stock_plus(word, count), memory_order_release,
+                                        memory_order_relaxed))
+        ;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * takeOne --
+ *
+ *      Remove one unit from stock if the item is valid and in
+ *      stock, whatever its version.
+ *
+ * Results:
+ *      true if a unit was taken, false otherwise.
+ *
+ * ------------------------------------------------------------------
+ */
+bool Item::
+takeOne()
+{
+    uint64_t word = stock.load(memory_order_acquire);
+    do
+    {
+        if (!stock_valid(word) || stock_quantity(word) == 0)
+        {
+            return false;
+        }
+    } while (!stock.compare_exchange_weak(word, word - 1, memory_order_acq_rel, memory_order_acquire));
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * snapshot --
+ *
+ *      Seqlock read of the item: the stock word and the unit price
+ *      (price times 1 - discount) as of one version. Retries while
+ *      a writer is changing the price or discount, i.e. while the
+ *      revision is odd or moves during the read.
+ *
+ * Results:
+ *      The unit price. *word is set to the stock word it belongs to.
+ *
+ * ------------------------------------------------------------------
+ */
+double Item::
+snapshot(uint64_t* word) const
+{
+    for (;;)
+    {
+        uint64_t before = stock.load(memory_order_acquire);
+        if (stock_writing(before))
+        {
+            continue;
+        }
+        double unit = unitPrice();
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t after = stock.load(memory_order_relaxed);
+        if (stock_same_version(before, after))
+        {
+            *word = after;
+            return unit;
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * takeAt --
+ *
+ *      Take count units, but only while the item is still at the
+ *      version of "word" (as returned by snapshot). Concurrent
+ *      quantity changes are retried; version changes are not, and
+ *      neither is a price or discount change under way.
+ *
+ * Results:
+ *      TAKE_OK, TAKE_UNAVAILABLE if the item is invalid or short
+ *      of stock at that version, or TAKE_CHANGED if the item was
+ *      repriced, removed or re-added.
+ *
+ * ------------------------------------------------------------------
+ */
+TakeResult Item::
+takeAt(uint64_t word, int count)
+{
+    assert(!stock_writing(word));
+    uint64_t current = stock.load(memory_order_acquire);
+    do
+    {
+        if (!stock_same_version(current, word))
+        {
+            return TAKE_CHANGED;
+        }
+        if (!stock_valid(current) || stock_quantity(current) < count)
+        {
+            return TAKE_UNAVAILABLE;
+        }
+    } while (!stock.compare_exchange_weak(current, current - count, memory_order_acq_rel, memory_order_acquire));
+    return TAKE_OK;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * returnTo --
+ *
+ *      Give back count units taken at the version of "word". The
+ *      units are dropped if the item has been removed (or removed
+ *      and re-added) since, because they belonged to the old
+ *      incarnation. Like addQuantity, the quantity stops at
+ *      STOCK_QUANTITY_MAX.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Item::
+returnTo(uint64_t word, int count)
+{
+    uint64_t current = stock.load(memory_order_relaxed);
+    while (stock_same_incarnation(current, word))
+    {
+        if (stock.compare_exchange_weak(current, stock_plus(current, count), memory_order_release,
+                                        memory_order_relaxed))
+        {
+            return;
+        }
+    }
+}
+
+Shard::
+Shard()
+    : numItems(0), numStripes(0), layout(LAYOUT_PACKED),
+      records(NULL), cells(NULL), stocks(NULL), prices(NULL), discounts(NULL), stripes(NULL)
+{ }
+
+Shard::
+~Shard()
+{
+    for (int i = 0; i < numStripes; i++)
+    {
+        smutex_destroy((smutex_t*)(lockBase + i * lockStride));
+    }
+    delete[] records;
+    delete[] cells;
+    delete[] stocks;
+    delete[] prices;
+    delete[] discounts;
+    delete[] stripes;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * init --
+ *
+ *      Allocate count (initially invalid) items in the requested
+ *      layout, and their locks, of the given kind. Outside the
+ *      padded layout there is never more than one stripe per item.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Shard::
+init(int count, int stripesPerShard, ItemLayout itemLayout, LockKind lockKind)
+{
+    numItems = count;
+    layout = itemLayout;
+
+    switch (layout)
+    {
+        case LAYOUT_PACKED:
+            records = new ItemRecord[numItems];
+            stockBase = (char*)&records[0].stock;
+            priceBase = (char*)&records[0].price;
+            discountBase = (char*)&records[0].discount;
+            fieldStride = sizeof(ItemRecord);
+            break;
+        case LAYOUT_PADDED:
+            cells = new PaddedItem[numItems];
+            stockBase = (char*)&cells[0].record.stock;
+            priceBase = (char*)&cells[0].record.price;
+            discountBase = (char*)&cells[0].record.discount;
+            fieldStride = sizeof(PaddedItem);
+            break;
+        case LAYOUT_SOA:
+            stocks = new std::atomic<uint64_t>[numItems]();
+            prices = new std::atomic<double>[numItems]();
+            discounts = new std::atomic<double>[numItems]();
+            stockBase = (char*)stocks;
+            priceBase = (char*)prices;
+            discountBase = (char*)discounts;
+            fieldStride = sizeof(double);
+            assert(sizeof(std::atomic<uint64_t>) == fieldStride);
+            break;
+        default:
+            assert(false);
+    }
+
+    if (layout == LAYOUT_PADDED)
+    {
+        numStripes = numItems;
+        lockBase = (char*)&cells[0].lock;
+        lockStride = sizeof(PaddedItem);
+    }
+    else
+    {
+        numStripes = max(1, min(stripesPerShard, numItems));
+        stripes = new smutex_t[numStripes];
+        lockBase = (char*)stripes;
+        lockStride = sizeof(smutex_t);
+    }
+    for (int i = 0; i < numStripes; i++)
+    {
+        smutex_init_kind((smutex_t*)(lockBase + i * lockStride), lockKind);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * memoryUsage --
+ *
+ *      Return the number of bytes used by this shard's items and
+ *      locks.
+ *
+ * Results:
+ *      The memory footprint of the shard in bytes.
+ *
+ * ------------------------------------------------------------------
+ */
+size_t Shard::
+memoryUsage() const
+{
+    switch (layout)
+    {
+        case LAYOUT_PADDED:
+            return sizeof(PaddedItem) * numItems;
+        case LAYOUT_SOA:
+            return (sizeof(std::atomic<uint64_t>) + 2 * sizeof(std::atomic<double>)) * numItems
+                + sizeof(smutex_t) * numStripes;
+        default:
+            return sizeof(ItemRecord) * numItems + sizeof(smutex_t) * numStripes;
+    }
+}
+
+
+// what a placement thread needs to initialize one shard
+struct ShardInit {
+    Shard* shard;
+    int count;
+    int stripesPerShard;
+    ItemLayout layout;
+    LockKind lockKind;
+};
+
+void* Catalog::
+initShardMain(void* arg)
+{
+    ShardInit* init = (ShardInit*)arg;
+    init->shard->init(init->count, init->stripesPerShard, init->layout, init->lockKind);
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * Catalog --
+ *
+ *      Allocate every shard. With options.shardCpus each shard is
+ *      initialized on a thread pinned to its CPU (see
+ *      CatalogOptions), all shards at once; Linux places a page on
+ *      the node of the thread that first touches it, and init
+ *      touches every item and lock it allocates.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+Catalog::
+Catalog(const CatalogOptions& options)
+    : numItems(options.inventorySize), numShards(options.numShards), itemLayout(options.layout)
+{
+    assert(numItems > 0 && numShards > 0 && options.stripesPerShard > 0);
+    shards = new Shard[numShards];
+    vector<ShardInit> inits(numShards);
+    for (int i = 0; i < numShards; i++)
+    {
+        // shard i holds ids i, i + numShards, i + 2 * numShards, ...
+        inits[i].shard = &shards[i];
+        inits[i].count = numItems / numShards + (i < numItems % numShards ? 1 : 0);
+        inits[i].stripesPerShard = options.stripesPerShard;
+        inits[i].layout = itemLayout;
+        inits[i].lockKind = options.itemLocks;
+    }
+
+    if (options.shardCpus.empty())
+    {
+        for (int i = 0; i < numShards; i++)
+        {
+            initShardMain(&inits[i]);
+        }
+        return;
+    }
+    vector<sthread_t> threads(numShards);
+    for (int i = 0; i < numShards; i++)
+    {
+        sthread_create_on(&threads[i], initShardMain, &inits[i],
+                          options.shardCpus[i % options.shardCpus.size()]);
+    }
+    for (int i = 0; i < numShards; i++)
+    {
+        sthread_join(threads[i]);
+    }
+}
+
+Catalog::
+~Catalog()
+{
+    delete[] shards;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * memoryUsage --
+ *
+ *      Return the number of bytes used by items and locks.
+ *
+ * Results:
+ *      The memory footprint of the catalog in bytes.
+ *
+ * ------------------------------------------------------------------
+ */
+size_t Catalog::
+memoryUsage() const
+{
+    size_t bytes = sizeof(Shard) * numShards;
+    for (int i = 0; i < numShards; i++)
+    {
+        bytes += shards[i].memoryUsage();
+    }
+    return bytes;
+}
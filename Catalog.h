@@ -0,0 +1,348 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Request.h"
+#include "sthread.h"
+
+/*
+ * An item's stock word packs its validity, a version and the number
+ * of units in stock into one atomic 64-bit value:
+ *
+ *      bit 63       valid
+ *      bits 48-62   incarnation, bumped when the item is added or
+ *                   removed
+ *      bits 24-47   revision, bumped twice when the item is repriced
+ *                   or rediscounted: to an odd value before the new
+ *                   value is stored, and to an even one after
+ *      bits 0-23    quantity, at most STOCK_QUANTITY_MAX
+ *
+ * Together the incarnation and revision form the item's version.
+ * The price and discount act as a seqlock guarded by the version:
+ * a reader that sees the same even revision before and after reading
+ * them has a consistent pair. Purchases take stock with a CAS that only
+ * succeeds at the version the buyer priced the item at.
+ *
+ * Both counters wrap, so a version only tells a buyer the item is
+ * unchanged if fewer than 2^23 reprices (two revision bumps each),
+ * or 2^14 removals and re-adds, happened since the buyer read it.
+ * The revision is widened at the quantity's expense to push the
+ * first bound far past anything one buyer sleeps through.
+ */
+#define STOCK_VALID             (1ULL << 63)
+#define STOCK_INCARNATION_ONE   (1ULL << 48)
+#define STOCK_INCARNATION_MASK  (0x7fffULL << 48)
+#define STOCK_REVISION_ONE      (1ULL << 24)
+#define STOCK_REVISION_MASK     (0xffffffULL << 24)
+#define STOCK_VERSION_MASK      (STOCK_INCARNATION_MASK | STOCK_REVISION_MASK)
+#define STOCK_QUANTITY_MASK     0xffffffULL
+#define STOCK_QUANTITY_MAX      ((int)STOCK_QUANTITY_MASK)
+
+static inline bool
+stock_valid(uint64_t word)
+{
+    return (word & STOCK_VALID) != 0;
+}
+
+static inline int
+stock_quantity(uint64_t word)
+{
+    return (int)(word & STOCK_QUANTITY_MASK);
+}
+
+// a price or discount change is under way; the version is not one to price at
+static inline bool
+stock_writing(uint64_t word)
+{
+    return (word & STOCK_REVISION_ONE) != 0;
+}
+
+// same validity and version, quantity ignored
+static inline bool
+stock_same_version(uint64_t a, uint64_t b)
+{
+    return ((a ^ b) & (STOCK_VALID | STOCK_VERSION_MASK)) == 0;
+}
+
+// same incarnation, i.e. not removed or re-added in between
+static inline bool
+stock_same_incarnation(uint64_t a, uint64_t b)
+{
+    return ((a ^ b) & (STOCK_VALID | STOCK_INCARNATION_MASK)) == 0;
+}
+
+static inline uint64_t
+stock_next(uint64_t word, uint64_t one, uint64_t mask)
+{
+    return (word & ~mask) | ((word + one) & mask);
+}
+
+/*
+ * The word with count more units, version kept. The quantity stops
+ * at STOCK_QUANTITY_MAX, so it never carries into the revision.
+ */
+static inline uint64_t
+stock_plus(uint64_t word, int count)
+{
+    assert(count >= 0);
+    uint64_t quantity = (word & STOCK_QUANTITY_MASK) + (uint64_t)count;
+    if (quantity > STOCK_QUANTITY_MASK)
+    {
+        quantity = STOCK_QUANTITY_MASK;
+    }
+    return (word & ~STOCK_QUANTITY_MASK) | quantity;
+}
+
+// result of trying to take stock at a given version
+enum TakeResult {
+    TAKE_OK = 0,
+    TAKE_UNAVAILABLE,       // invalid or out of stock at that version
+    TAKE_CHANGED            // the version moved on; reprice and retry
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * ItemLayout --
+ *
+ *      How item fields and locks are laid out in memory.
+ *
+ *      LAYOUT_PACKED   array of ItemRecord (24 bytes each); lock
+ *                      stripes in a separate dense array.
+ *      LAYOUT_PADDED   one cache line per item holding its fields
+ *                      and its own lock, so workers on different
+ *                      items never share a line. Only the lock's
+ *                      kind, which is never written after init,
+ *                      spills onto a second line. Stripes are not
+ *                      used: every item has a lock.
+ *      LAYOUT_SOA      separate stock, price and discount arrays,
+ *                      for scans that touch one field (the valid
+ *                      bit and quantity share the stock word, so
+ *                      they stay together). Lock stripes as in
+ *                      LAYOUT_PACKED.
+ *
+ * ------------------------------------------------------------------
+ */
+enum ItemLayout {
+    LAYOUT_PACKED = 0,
+    LAYOUT_PADDED,
+    LAYOUT_SOA,
+    NUM_ITEM_LAYOUTS
+};
+
+const char* item_layout_name(ItemLayout layout);
+bool item_layout_parse(const char* name, ItemLayout* layout);
+
+
+/*
+ * ------------------------------------------------------------------
+ * CatalogOptions --
+ *
+ *      Construction parameters of a Catalog. If shardCpus is not
+ *      empty, shard i is allocated and initialized by a thread
+ *      pinned to CPU shardCpus[i % n], so that on a NUMA system
+ *      its pages (first touched there) live on that CPU's node.
+ *      itemLocks is the LockKind of the item locks (stripes, or
+ *      the per-item locks of LAYOUT_PADDED).
+ *
+ * ------------------------------------------------------------------
+ */
+struct CatalogOptions {
+    int inventorySize;
+    int numShards;
+    int stripesPerShard;
+    ItemLayout layout;
+    LockKind itemLocks;
+    std::vector<int> shardCpus;
+
+    CatalogOptions()
+        : inventorySize(DEFAULT_INVENTORY_SIZE), numShards(DEFAULT_NUM_SHARDS),
+          stripesPerShard(DEFAULT_LOCK_STRIPES), layout(LAYOUT_PACKED), itemLocks(LOCK_BLOCKING)
+    { }
+};
+
+
+// the fields of one item, stored together in the packed and padded layouts
+struct ItemRecord {
+    std::atomic<uint64_t> stock;
+    std::atomic<double> price;
+    std::atomic<double> discount;
+
+    ItemRecord() : stock(0), price(0), discount(0) { }
+};
+
+struct alignas(CACHE_LINE_SIZE) PaddedItem {
+    ItemRecord record;
+    smutex_t lock;
+};
+
+static_assert(sizeof(ItemRecord) + sizeof(pthread_mutex_t) == CACHE_LINE_SIZE,
+              "an item and its lock must share one line");
+
+
+/*
+ * ------------------------------------------------------------------
+ * Item --
+ *
+ *      This class represents a type of item in the inventory of the
+ *      estore.  It keeps track of the number of units in stock, the
+ *      price of each unit, etc.
+ *
+ *      The current price of an individual item is defined as the
+ *      normal price of the item (i.e. the price field of Item) times
+ *      1 - the current discount (i.e. the discount field of Item).
+ *      When a customer tries to buy an item, the current price of
+ *      the item should be used to determine the cost of the overall
+ *      purchase.
+ *
+ *      If the particular item is not being offered by the store,
+ *      then the valid bit of the item's stock word will be clear.
+ *
+ *      Writers (publish, retire, setPrice, setDiscount,
+ *      addQuantity) must hold the item's lock. snapshot, takeOne,
+ *      takeAt and returnTo may be called without it.
+ *
+ *      An Item is a handle onto the item's fields wherever the
+ *      catalog layout keeps them; Catalog::item returns one by
+ *      value.
+ *
+ * ------------------------------------------------------------------
+ */
+class Item {
+    public:
+    std::atomic<uint64_t>& stock;
+    std::atomic<double>& price;
+    std::atomic<double>& discount;
+
+    Item(std::atomic<uint64_t>& stockField, std::atomic<double>& priceField,
+         std::atomic<double>& discountField)
+        : stock(stockField), price(priceField), discount(discountField)
+    { }
+
+    bool valid() const { return stock_valid(stock.load(std::memory_order_acquire)); }
+    int quantity() const { return stock_quantity(stock.load(std::memory_order_acquire)); }
+
+    double unitPrice() const
+    {
+        return price.load(std::memory_order_relaxed)
+            * (1 - discount.load(std::memory_order_relaxed));
+    }
+
+    void publish(int quantity, double newPrice, double newDiscount);
+    void retire();
+    void setPrice(double newPrice);
+    void setDiscount(double newDiscount);
+    void addQuantity(int count);
+    bool takeOne();
+
+    double snapshot(uint64_t* word) const;
+    TakeResult takeAt(uint64_t word, int count);
+    void returnTo(uint64_t word, int count);
+
+    private:
+    void bumpRevision(std::memory_order order);
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * Shard --
+ *
+ *      A slice of the catalog. A shard owns the items whose id is
+ *      congruent to its index modulo the number of shards, and the
+ *      locks that those items hash onto.
+ *
+ *      Whatever the layout, field f of slot i lives at
+ *      fBase + i * fieldStride, and the lock of slot i is lock
+ *      (i % numStripes) at lockBase + k * lockStride.
+ *
+ * ------------------------------------------------------------------
+ */
+class Shard {
+    public:
+    int numItems;
+    int numStripes;
+    ItemLayout layout;
+
+    char* stockBase;
+    char* priceBase;
+    char* discountBase;
+    size_t fieldStride;
+    char* lockBase;
+    size_t lockStride;
+
+    Shard();
+    ~Shard();
+
+    Shard(const Shard&) = delete;
+    Shard& operator=(const Shard &) = delete;
+
+    void init(int count, int stripesPerShard, ItemLayout itemLayout, LockKind lockKind);
+    size_t memoryUsage() const;
+
+    private:
+    ItemRecord* records;
+    PaddedItem* cells;
+    std::atomic<uint64_t>* stocks;
+    std::atomic<double>* prices;
+    std::atomic<double>* discounts;
+    smutex_t* stripes;
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * Catalog --
+ *
+ *      The inventory of the estore, sized at construction and split
+ *      into shards. Item id i lives in shard (i % numShards) at slot
+ *      (i / numShards), and is protected by lock
+ *      (slot % stripesPerShard) of that shard. Several items can
+ *      share a lock, so callers that lock more than one item must
+ *      lock each distinct lock once, in a fixed global order.
+ *
+ * ------------------------------------------------------------------
+ */
+class Catalog {
+    private:
+    int numItems;
+    int numShards;
+    ItemLayout itemLayout;
+    Shard* shards;
+
+    static void* initShardMain(void* arg);
+
+    public:
+    explicit Catalog(const CatalogOptions& options);
+    ~Catalog();
+
+    Catalog(const Catalog&) = delete;
+    Catalog& operator=(const Catalog &) = delete;
+
+    int size() const { return numItems; }
+    int shardCount() const { return numShards; }
+    ItemLayout layout() const { return itemLayout; }
+
+    Item item(int item_id)
+    {
+        assert(item_id >= 0 && item_id < numItems);
+        Shard& shard = shards[item_id % numShards];
+        size_t offset = (size_t)(item_id / numShards) * shard.fieldStride;
+        return Item(*(std::atomic<uint64_t>*)(shard.stockBase + offset),
+                    *(std::atomic<double>*)(shard.priceBase + offset),
+                    *(std::atomic<double>*)(shard.discountBase + offset));
+    }
+
+    smutex_t* lockFor(int item_id)
+    {
+        Shard& shard = shards[item_id % numShards];
+        size_t lock = (item_id / numShards) % shard.numStripes;
+        return (smutex_t*)(shard.lockBase + lock * shard.lockStride);
+    }
+
+    size_t memoryUsage() const;
+};
@@ -0,0 +1,41 @@
+#include <atomic>
+#include <coroutine>
+#include <new>
+
+#include "Coroutine.h"
+
+using namespace std;
+
+static atomic<long> liveFrames(0);
+static atomic<long> liveBytes(0);
+
+void* DetachedCoroutine::promise_type::
+operator new(size_t size)
+{
+    liveFrames.fetch_add(1, memory_order_relaxed);
+    liveBytes.fetch_add(size, memory_order_relaxed);
+    return ::operator new(size);
+}
+
+void DetachedCoroutine::promise_type::
+operator delete(void* frame, size_t size)
+{
+    liveFrames.fetch_sub(1, memory_order_relaxed);
+    liveBytes.fetch_sub(size, memory_order_relaxed);
+    ::operator delete(frame);
+}
+
+CoroutineStats
+coroutine_stats()
+{
+    CoroutineStats stats;
+    stats.frames = liveFrames.load(memory_order_relaxed);
+    stats.bytes = liveBytes.load(memory_order_relaxed);
+    return stats;
+}
+
+void
+resume_coroutine(void* args)
+{
+    coroutine_handle<>::from_address(args).resume();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+
+// coroutine frames currently allocated, and their total size in bytes
+struct CoroutineStats {
+    long frames;
+    long bytes;
+};
+
+CoroutineStats coroutine_stats();
+
+/*
+ * ------------------------------------------------------------------
+ * DetachedCoroutine --
+ *
+ *      The return type of a coroutine that nobody awaits: it runs
+ *      as soon as it is called, up to its first suspension, and
+ *      frees its own frame when its body returns. Whoever resumes
+ *      it owns it until it suspends again or finishes, and it
+ *      hands its result back through a callback of its own.
+ *
+ *      Frames are counted (see coroutine_stats) so that the cost
+ *      of many suspended coroutines can be reported.
+ *
+ * ------------------------------------------------------------------
+ */
+struct DetachedCoroutine {
+    struct promise_type {
+        DetachedCoroutine get_return_object() { return DetachedCoroutine(); }
+        std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() { }
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new(size_t size);
+        static void operator delete(void* frame, size_t size);
+    };
+};
+
+// the handler of a task that resumes a suspended coroutine (arg is its address)
+void resume_coroutine(void* args);
@@ -1,49 +1,152 @@
 #include <cassert>
 
 #include "EStore.h"
+#include "Epoch.h"
+#include "TaskQueue.h"
 #include "sthread.h"
 #include <algorithm>
+#include <climits>
+#include <cstdint>
 #include <cstdio>
 #include <vector>
 
 using namespace std;
 
-Item::
-Item() : valid(false)
-{ }
-
-Item::
-~Item()
-{ }
-
-
 EStore::
-EStore(bool enableFineMode)
-    : fineMode(enableFineMode)
+EStore(bool enableFineMode, const CatalogOptions& options, const StoreLocks& locks)
+    : catalog(options), fineMode(enableFineMode), ownedItems(false)
 {
-    smutex_init(&mutex);
-    scond_init(&cond);
-    for (int i = 0; i < INVENTORY_SIZE; i++)
+    smutex_init_kind(&mutex, locks.store);
+    smutex_init_kind(&pricingLock, locks.pricing);
+    StorePricing* initial = new StorePricing();
+    initial->storeDiscount = 0;
+    initial->shippingCost = 3.0;
+    initial->version = 0;
+    pricing.store(initial, memory_order_release);
+    stats = WakeupStats();
+    scond_init(&timerCond);
+    timerRunning = false;
+    timerStop = false;
+    asyncPurchases.store(0, memory_order_relaxed);
+
+    smutex_init(&reservationLock);
+    scond_init(&sweeperCond);
+    nextReservation = 1;
+    reservationCounts = ReservationStats();
+    settlementsPending.store(0, memory_order_relaxed);
+    sweeperRunning = false;
+    sweeperStop = false;
+
+    cartWaits = new CartWaitShard[CART_WAIT_SHARDS];
+    for (int i = 0; i < CART_WAIT_SHARDS; i++)
     {
-        smutex_init(&fineMutexes[i]);
+        smutex_init(&cartWaits[i].lock);
     }
-    smutex_init(&shippingLock);
-    smutex_init(&discountLock);
-    storeDiscount = 0;
-    shippingCost = 3.0;
+    cartsParked.store(0, memory_order_relaxed);
+    cartWakeups.store(0, memory_order_relaxed);
+    cartTimeouts.store(0, memory_order_relaxed);
 }
 
 EStore::
 ~EStore()
 {
+    smutex_lock(&reservationLock);
+    sweeperStop = true;
+    scond_signal(&sweeperCond, &reservationLock);
+    smutex_unlock(&reservationLock);
+    if (sweeperRunning)
+    {
+        sthread_join(sweeper);
+    }
+    // their callers would never hear back
+    assert(settlements.empty());
+    smutex_destroy(&reservationLock);
+    scond_destroy(&sweeperCond);
+
+    smutex_lock(&mutex);
+    timerStop = true;
+    scond_signal(&timerCond, &mutex);
+    smutex_unlock(&mutex);
+    if (timerRunning)
+    {
+        sthread_join(timer);
+    }
+    scond_destroy(&timerCond);
+
+    for (int i = 0; i < CART_WAIT_SHARDS; i++)
+    {
+        smutex_destroy(&cartWaits[i].lock);
+    }
+    delete[] cartWaits;
+
     smutex_destroy(&mutex);
-    scond_destroy(&cond);
-    for (int i = 0; i < INVENTORY_SIZE; i++)
+    smutex_destroy(&pricingLock);
+    // no readers are left, so the current pricing can go right away
+    delete pricing.load(memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setItemOwnership --
+ *
+ *      Turn per-item write locking off (owned) or back on. Only in
+ *      fine mode, and only while no request is running: with
+ *      ownership on, each item must from then on be changed by a
+ *      single thread, e.g. the ShardedPool worker that owns it.
+ *      buyManyItems and the reservation calls are lock-free and may
+ *      still run anywhere.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+setItemOwnership(bool owned)
+{
+    assert(fineModeEnabled());
+    ownedItems = owned;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * mayUnblock --
+ *
+ *      Guess whether a supplier mutation could let a waiting buyer
+ *      through: it adds an item or stock, lowers an item's price or
+ *      raises its discount. Reads the item without its lock, so the
+ *      answer is only a hint, for schedulers (see TaskPriority).
+ *      Removals only wake buyers to fail them, and store-wide
+ *      changes are not judged, so both count as not unblocking.
+ *
+ * Results:
+ *      true if the mutation looks like it could unblock a buyer.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+mayUnblock(const SupplierMutation& mutation)
+{
+    switch (mutation.type)
     {
-        smutex_destroy(&fineMutexes[i]);
+        case ADD_ITEM:
+        case ADD_STOCK:
+            return true;
+        case CHANGE_ITEM_PRICE:
+            return mutation.price < catalog.item(mutation.item_id).price.load(memory_order_relaxed);
+        case CHANGE_ITEM_DISCOUNT:
+            return mutation.discount > catalog.item(mutation.item_id).discount.load(memory_order_relaxed);
+        default:
+            return false;
     }
-    smutex_destroy(&shippingLock);
-    smutex_destroy(&discountLock);
+}
+
+// the item is carried, and is still the incarnation a buyer first saw
+static bool
+stillCarried(const Item& item, uint64_t carried)
+{
+    uint64_t word = item.stock.load(memory_order_relaxed);
+    return stock_valid(word) && stock_same_incarnation(word, carried);
 }
 
 /*
@@ -62,68 +165,378 @@ EStore::
  *      do nothing. Do not attempt to buy the item.
  *
  *      If the store *does* carry the item, but it is not in stock
- *      or its cost is over budget, block until both conditions are
- *      met (at which point the item should be bought) or the store
- *      removes the item from sale (at which point this method
- *      returns).
+ *      or its cost is over budget, the policy decides:
+ *          - PURCHASE_FAIL_FAST returns without buying.
+ *          - PURCHASE_BLOCK blocks until both conditions are met
+ *            (at which point the item should be bought) or the
+ *            store removes the item from sale (at which point this
+ *            method returns, even if the item is added again before
+ *            the buyer gets to run).
+ *          - PURCHASE_DEADLINE blocks the same way, but returns
+ *            once the deadline passes. The buyer then unlinks
+ *            itself from the item's waiter list.
  *
  *      The overall cost of a purchase for a single item is defined
  *      as the current cost of the item times 1 - the store
  *      discount, plus the flat overall store shipping fee.
  *
  * Results:
- *      None.
+ *      PURCHASE_OK if the item was bought, PURCHASE_TIMED_OUT if
+ *      the deadline passed, PURCHASE_REJECTED otherwise.
  *
  * ------------------------------------------------------------------
  */
-void EStore::
-buyItem(int item_id, double budget)
+PurchaseResult EStore::
+buyItem(int item_id, double budget, PurchasePolicy policy, double deadline)
 {
     assert(!fineModeEnabled());
     
     // only allow one thread to buy an item at a time
     smutex_lock(&mutex);
     // check for valid
-    if (!inventory[item_id].valid)
+    if (!catalog.item(item_id).valid())
     {
         // return when not valid
         smutex_unlock(&mutex);
-        return;
+        return PURCHASE_REJECTED;
+    }
+    // wait until quantity is not zero and cost does not exceed budget (make sure still carried)
+    uint64_t carried = catalog.item(item_id).stock.load(memory_order_relaxed);
+    BuyWaiter waiter;
+    waiter.budget = budget;
+    waiter.resumer = NULL;
+    scond_init(&waiter.cond);
+    ItemWaiters* entry = NULL;
+    PurchaseResult result = PURCHASE_OK;
+    while (stillCarried(catalog.item(item_id), carried)
+           && (catalog.item(item_id).quantity() == 0 || itemCost(item_id) > budget))
+    {
+        if (policy == PURCHASE_FAIL_FAST)
+        {
+            result = PURCHASE_REJECTED;
+            break;
+        }
+        // park in the item's budget-ordered list until a mutation picks us
+        if (entry == NULL)
+        {
+            entry = &waiters[item_id];
+        }
+        waiter.signaled = false;
+        WaitList::iterator slot = entry->list.insert(make_pair(budget, &waiter));
+        stats.parked++;
+        bool timedOut = false;
+        while (!waiter.signaled && !timedOut)
+        {
+            if (policy == PURCHASE_DEADLINE)
+            {
+                timedOut = !scond_timedwait(&waiter.cond, &mutex, deadline);
+            }
+            else
+            {
+                scond_wait(&waiter.cond, &mutex);
+            }
+            stats.wakeups++;
+        }
+        stats.parked--;
+        if (!waiter.signaled)
+        {
+            // still linked, since only signalEligible unlinks waiters
+            entry->list.erase(slot);
+            result = PURCHASE_TIMED_OUT;
+            break;
+        }
+        entry->pending--;
     }
-    // wait until quantity is not zero and cost does not exceed budget (make sure still valid)
-    while (inventory[item_id].valid && (inventory[item_id].quantity == 0 || (inventory[item_id].price * (1 - inventory[item_id].discount) 
-        * (1 - storeDiscount) + shippingCost) > budget))
+    scond_destroy(&waiter.cond);
+
+    // drop the item's waiter entry once nobody is using it
+    if (entry != NULL && entry->list.empty() && entry->pending == 0)
     {
-        scond_wait(&cond, &mutex);
+        waiters.erase(item_id);
     }
 
-    // check for valid
-    if (!inventory[item_id].valid)
+    // check for valid, and whether we gave up
+    if (result == PURCHASE_OK && !stillCarried(catalog.item(item_id), carried))
     {
-        smutex_unlock(&mutex);
-        return;
+        result = PURCHASE_REJECTED;
     }
-    else
+    if (result != PURCHASE_OK)
     {
-        // buy the item
-        inventory[item_id].quantity -= 1;
         smutex_unlock(&mutex);
+        return result;
     }
+
+    // buy the item
+    catalog.item(item_id).takeOne();
+    smutex_unlock(&mutex);
+    return result;
+}
+
+// suspends a buyer coroutine, then lets go of the store mutex it parked under
+struct ParkBuyer {
+    smutex_t* lock;
+    BuyWaiter* waiter;
+
+    bool await_ready() const { return false; }
+
+    void await_suspend(coroutine_handle<> handle)
+    {
+        // once unlocked, a mutation may resume us on another thread
+        waiter->coroutine = handle;
+        smutex_unlock(lock);
+    }
+
+    void await_resume() { smutex_lock(lock); }
+};
+
+/*
+ * ------------------------------------------------------------------
+ * buyItemAsync --
+ *
+ *      The purchase of buyItem, without blocking the calling
+ *      thread. Where buyItem would wait, the purchase suspends onto
+ *      the item's budget-ordered waiter list instead, and the
+ *      thread returns to whatever called it. The mutation that
+ *      makes the buyer eligible (or removes the item) hands the
+ *      purchase back to resumer as a task, and it carries on from
+ *      there on one of resumer's threads. A PURCHASE_DEADLINE
+ *      purchase is handed back by the store's timer thread if its
+ *      deadline comes first.
+ *
+ *      done is called with the outcome exactly once, on the thread
+ *      that finishes the purchase, which may be the caller. After
+ *      it returns the purchase counts in asyncPurchasesDone, so an
+ *      executor can be stopped once all it started are done.
+ *
+ *      The resume tasks are control tasks (never rejected or
+ *      dropped) and are enqueued with the store mutex held, so
+ *      resumer must not block on a full queue.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+buyItemAsync(int item_id, double budget, PurchasePolicy policy, double deadline,
+             TaskSink* resumer, purchase_done_t done, void* arg)
+{
+    assert(!fineModeEnabled());
+    assert(resumer != NULL);
+    buyItemCoroutine(item_id, budget, policy, deadline, resumer, done, arg);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyItemCoroutine --
+ *
+ *      The body of buyItemAsync: buyItem's loop, with the wait on
+ *      the buyer's condition variable replaced by a suspension.
+ *      The waiter lives in the coroutine frame, which is all a
+ *      waiting purchase costs.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+DetachedCoroutine EStore::
+buyItemCoroutine(int item_id, double budget, PurchasePolicy policy, double deadline,
+                 TaskSink* resumer, purchase_done_t done, void* arg)
+{
+    smutex_lock(&mutex);
+    PurchaseResult result = PURCHASE_OK;
+    uint64_t carried = catalog.item(item_id).stock.load(memory_order_relaxed);
+    BuyWaiter waiter;
+    waiter.budget = budget;
+    waiter.resumer = resumer;
+    waiter.item_id = item_id;
+    waiter.expires = false;
+    ItemWaiters* entry = NULL;
+    while (stillCarried(catalog.item(item_id), carried)
+           && (catalog.item(item_id).quantity() == 0 || itemCost(item_id) > budget))
+    {
+        if (policy == PURCHASE_FAIL_FAST)
+        {
+            result = PURCHASE_REJECTED;
+            break;
+        }
+        if (policy == PURCHASE_DEADLINE && sutil_now() >= deadline)
+        {
+            result = PURCHASE_TIMED_OUT;
+            break;
+        }
+        if (entry == NULL)
+        {
+            entry = &waiters[item_id];
+        }
+        waiter.signaled = false;
+        waiter.slot = entry->list.insert(make_pair(budget, &waiter));
+        if (policy == PURCHASE_DEADLINE)
+        {
+            // the timer is only needed once a coroutine can expire
+            if (!timerRunning)
+            {
+                timerRunning = true;
+                sthread_create(&timer, timerMain, this);
+            }
+            waiter.expires = true;
+            waiter.expiry = buyDeadlines.insert(make_pair(deadline, &waiter));
+            if (waiter.expiry == buyDeadlines.begin())
+            {
+                scond_signal(&timerCond, &mutex);
+            }
+        }
+        stats.parked++;
+
+        co_await ParkBuyer{ &mutex, &waiter };
+
+        stats.wakeups++;
+        stats.parked--;
+        if (!waiter.signaled)
+        {
+            // the timer has unlinked us already, and may have dropped the entry
+            entry = NULL;
+            result = PURCHASE_TIMED_OUT;
+            break;
+        }
+        entry->pending--;
+    }
+
+    // drop the item's waiter entry once nobody is using it
+    if (entry != NULL && entry->list.empty() && entry->pending == 0)
+    {
+        waiters.erase(item_id);
+    }
+    if (result == PURCHASE_OK && !stillCarried(catalog.item(item_id), carried))
+    {
+        result = PURCHASE_REJECTED;
+    }
+    if (result == PURCHASE_OK)
+    {
+        catalog.item(item_id).takeOne();
+    }
+    smutex_unlock(&mutex);
+
+    done(arg, item_id, budget, result);
+    asyncPurchases.fetch_add(1, memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * resumeBuyer --
+ *
+ *      Hand a suspended buyer coroutine back to its executor, and
+ *      cancel its deadline. Must be called with mutex held, after
+ *      the buyer was unlinked from its item's list.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+resumeBuyer(BuyWaiter* waiter)
+{
+    if (waiter->expires)
+    {
+        buyDeadlines.erase(waiter->expiry);
+        waiter->expires = false;
+    }
+    Task task = call_task(resume_coroutine, waiter->coroutine.address());
+    task.kind = TASK_CONTROL;
+    task.affinity = waiter->item_id;
+    // the buyer has been picked to complete; let it ahead of new purchases
+    task.priority = PRIORITY_UNBLOCK;
+    waiter->resumer->enqueue(task);
+}
+
+void* EStore::
+timerMain(void* arg)
+{
+    ((EStore*)arg)->expireBuyers();
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * expireBuyers --
+ *
+ *      The body of the timer thread. Sleep until the earliest
+ *      deadline of a suspended buyer (or until woken by a new
+ *      earlier one), then unlink every buyer whose deadline has
+ *      passed and resume it unsignaled, which it takes as a time
+ *      out. Runs until the store is destroyed.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+expireBuyers()
+{
+    smutex_lock(&mutex);
+    while (!timerStop)
+    {
+        if (buyDeadlines.empty())
+        {
+            scond_wait(&timerCond, &mutex);
+            continue;
+        }
+        double now = sutil_now();
+        if (buyDeadlines.begin()->first > now)
+        {
+            scond_timedwait(&timerCond, &mutex, buyDeadlines.begin()->first);
+            continue;
+        }
+
+        while (!buyDeadlines.empty() && buyDeadlines.begin()->first <= now)
+        {
+            BuyWaiter* waiter = buyDeadlines.begin()->second;
+            ItemWaiters& entry = waiters[waiter->item_id];
+            entry.list.erase(waiter->slot);
+            if (entry.list.empty() && entry.pending == 0)
+            {
+                waiters.erase(waiter->item_id);
+            }
+            resumeBuyer(waiter);
+        }
+    }
+    smutex_unlock(&mutex);
+}
+
+// the wake callback of a cart whose thread is blocked in buyManyItems
+static void
+wakeBlockedCart(CartWaiter* waiter)
+{
+    smutex_lock(&waiter->lock);
+    waiter->notified = true;
+    scond_signal(&waiter->cond, &waiter->lock);
+    smutex_unlock(&waiter->lock);
 }
 
 /*
  * ------------------------------------------------------------------
  * buyManyItem --
  *
- *      Attempt to buy all of the specified items at once. If the
- *      order cannot be bought, give up and return without buying
- *      anything. Otherwise buy the entire order at once.
+ *      Attempt to buy all of the specified cart lines at once, each
+ *      line being some quantity of one item. If the order cannot be
+ *      bought, give up and return without buying anything.
+ *      Otherwise buy the entire order at once.
  *
  *      The entire order can be bought if:
  *          - The store carries all items.
- *          - All items are in stock.
+ *          - Every line's quantity is in stock.
  *          - The cost of the the entire order (cost of items plus
- *            shipping for each item) is no more than the budget.
+ *            shipping for each unit) is no more than the budget.
+ *
+ *      If the order cannot be bought only because of stock or
+ *      budget, PURCHASE_BLOCK and PURCHASE_DEADLINE link the cart
+ *      into the wait list of each of its items and try again each
+ *      time one of them changes, until the purchase completes, an
+ *      item is removed, or the deadline passes. A cart holding an
+ *      item the store does not carry is always rejected at once.
  *
  *      If multiple customers are attempting to buy at the same
  *      time and their orders are mutually exclusive (i.e., the
@@ -135,64 +548,670 @@ buyItem(int item_id, double budget)
  *      cost of an individual item is covered above in the
  *      description of buyItem.
  *
+ *      No lock is taken (see takeCart). The store-wide pricing is
+ *      read from its current published snapshot, and each item from
+ *      a consistent snapshot of its version (see Item::snapshot), so
+ *      carts that are unavailable or over budget are rejected
+ *      without ever touching a mutex. An affordable cart is
+ *      committed by taking each line with a CAS at the version it
+ *      was priced at; if
+ *      any item was repriced, removed or re-added in the meantime
+ *      the units already taken are returned and the cart is priced
+ *      again.
+ *
  * Results:
- *      None.
+ *      PURCHASE_OK if the cart was bought, PURCHASE_TIMED_OUT if
+ *      the deadline passed, PURCHASE_REJECTED otherwise.
  *
  * ------------------------------------------------------------------
  */
-void EStore::
-buyManyItems(vector<int>* item_ids, double budget)
+PurchaseResult EStore::
+buyManyItems(span<const CartLine> lines, double budget, PurchasePolicy policy, double deadline)
 {
     assert(fineModeEnabled());
+    // a generated cart's words fit on the stack (see CartLines)
+    uint64_t inlineWords[MAX_BUY_ITEM];
+    vector<uint64_t> heapWords;
+    span<uint64_t> words;
+    if (lines.size() <= MAX_BUY_ITEM)
+    {
+        words = span<uint64_t>(inlineWords, lines.size());
+    }
+    else
+    {
+        heapWords.resize(lines.size());
+        words = heapWords;
+    }
+    double cost;
+
+    CartResult result = takeCart(lines, budget, words, &cost);
+    if (result == CART_TAKEN)
+    {
+        return PURCHASE_OK;
+    }
+    if (result == CART_NOT_CARRIED || policy == PURCHASE_FAIL_FAST)
+    {
+        return PURCHASE_REJECTED;
+    }
+
+    CartWaiter waiter;
+    waiter.wake = wakeBlockedCart;
+    smutex_init(&waiter.lock);
+    scond_init(&waiter.cond);
+    parkCart(&waiter, lines);
+
+    // linked before each try, so no change after the try can be missed
+    PurchaseResult outcome = PURCHASE_TIMED_OUT;
+    for (;;)
+    {
+        smutex_lock(&waiter.lock);
+        waiter.notified = false;
+        smutex_unlock(&waiter.lock);
+
+        result = takeCart(lines, budget, words, &cost);
+        if (result != CART_SHORT)
+        {
+            outcome = result == CART_TAKEN ? PURCHASE_OK : PURCHASE_REJECTED;
+            break;
+        }
+
+        bool timedOut = false;
+        smutex_lock(&waiter.lock);
+        while (!waiter.notified && !timedOut)
+        {
+            if (policy == PURCHASE_DEADLINE)
+            {
+                timedOut = !scond_timedwait(&waiter.cond, &waiter.lock, deadline);
+            }
+            else
+            {
+                scond_wait(&waiter.cond, &waiter.lock);
+            }
+        }
+        smutex_unlock(&waiter.lock);
+        if (timedOut)
+        {
+            cartTimeouts.fetch_add(1, memory_order_relaxed);
+            break;
+        }
+        cartWakeups.fetch_add(1, memory_order_relaxed);
+    }
+
+    unparkCart(&waiter);
+    smutex_destroy(&waiter.lock);
+    scond_destroy(&waiter.cond);
+    return outcome;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * takeCart --
+ *
+ *      The lock-free purchase described in buyManyItems: price the
+ *      cart from a StorePricing and per-item snapshots, then take
+ *      each line's units with a CAS at the version it was priced
+ *      at, returning the units already taken and pricing again if
+ *      an item changed in between. A line of quantity n costs n
+ *      times the item's unit price plus n times shipping. words
+ *      must have one entry per line.
+ *
+ * Results:
+ *      CART_TAKEN if the cart's stock was taken, in which case
+ *      words holds the stock word of each line and *cost the price
+ *      paid. CART_NOT_CARRIED if the cart is empty, has an empty
+ *      line or holds an item that is not carried. CART_SHORT if it
+ *      is out of stock or over budget.
+ *
+ * ------------------------------------------------------------------
+ */
+CartResult EStore::
+takeCart(span<const CartLine> lines, double budget, span<uint64_t> words, double* cost)
+{
     // check if there are no items and return if so
-    if (item_ids -> empty())
+    if (lines.empty())
     {
-    	return;
+        return CART_NOT_CARRIED;
     }
-    // sort the items in ascending order to avoid deadlock buy locking in a specified order
-    sort(item_ids->begin(), item_ids->end(), greater<int>());
 
-    // keep track of total cost for all items
-    double totalCost = 0.0;
-    for (int i = 0; (size_t)i < item_ids->size(); i++)
+    size_t count = lines.size();
+    assert(words.size() == count);
+
+    // one consistent view of shipping cost and store discount
+    epoch_enter();
+    StorePricing global = *pricing.load(memory_order_acquire);
+    epoch_exit();
+
+    for (;;)
     {
-        // attempt to lock every item
-        smutex_lock(&fineMutexes[(*item_ids)[i]]);
-        // check for valid and quantity above 0
-        if (!inventory[(*item_ids)[i]].valid || inventory[(*item_ids)[i]].quantity == 0)
+        // price the cart from per-item snapshots
+        double itemsCost = 0.0;
+        long units = 0;
+        for (size_t i = 0; i < count; i++)
         {
-            // unlock all previous locks if not valid or out of stock
-            for (; i >= 0; i--)
+            double unit = catalog.item(lines[i].item_id).snapshot(&words[i]);
+            // check for valid and enough quantity for the line
+            if (lines[i].quantity <= 0 || !stock_valid(words[i]))
             {
-                smutex_unlock(&fineMutexes[(*item_ids)[i]]);
+                return CART_NOT_CARRIED;
+            }
+            if (stock_quantity(words[i]) < lines[i].quantity)
+            {
+                return CART_SHORT;
+            }
+            itemsCost += unit * lines[i].quantity;
+            units += lines[i].quantity;
+        }
+        *cost = itemsCost * (1 - global.storeDiscount) + global.shippingCost * units;
+        if (*cost > budget)
+        {
+            return CART_SHORT;
+        }
+
+        // commit: take every line at the version it was priced at
+        size_t taken = 0;
+        TakeResult result = TAKE_OK;
+        while (taken < count && result == TAKE_OK)
+        {
+            result = catalog.item(lines[taken].item_id).takeAt(words[taken], lines[taken].quantity);
+            if (result == TAKE_OK)
+            {
+                taken++;
             }
-            return;
         }
-        // update total cost if valid or not out of stock
+        if (result == TAKE_OK)
+        {
+            return CART_TAKEN;
+        }
+        releaseCart(lines, words, taken);
+        if (result == TAKE_UNAVAILABLE)
+        {
+            // short of stock, or removed since the snapshot
+            return catalog.item(lines[taken].item_id).valid() ? CART_SHORT : CART_NOT_CARRIED;
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * releaseCart --
+ *
+ *      Give back the units of the first count lines of a cart taken
+ *      by takeCart, and wake the carts waiting on those items.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+releaseCart(span<const CartLine> lines, span<const uint64_t> words, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        catalog.item(lines[i].item_id).returnTo(words[i], lines[i].quantity);
+        notifyCartWaiters(lines[i].item_id);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * parkCart --
+ *
+ *      Link the waiter into the cart wait list of every item in
+ *      lines. The parked count is raised first: mutators that see
+ *      it at zero skip the wait lists altogether.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+parkCart(CartWaiter* waiter, span<const CartLine> lines)
+{
+    cartsParked.fetch_add(1, memory_order_seq_cst);
+    waiter->links.resize(lines.size());
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        CartWaitLink* link = &waiter->links[i];
+        CartWaitShard& shard = cartWaits[lines[i].item_id % CART_WAIT_SHARDS];
+        link->waiter = waiter;
+        link->item_id = lines[i].item_id;
+        link->prev = NULL;
+
+        smutex_lock(&shard.lock);
+        CartWaitLink*& head = shard.heads[link->item_id];
+        link->next = head;
+        if (head != NULL)
+        {
+            head->prev = link;
+        }
+        head = link;
+        smutex_unlock(&shard.lock);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unparkCart --
+ *
+ *      Unlink the waiter from every wait list parkCart put it on.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+unparkCart(CartWaiter* waiter)
+{
+    for (size_t i = 0; i < waiter->links.size(); i++)
+    {
+        CartWaitLink* link = &waiter->links[i];
+        CartWaitShard& shard = cartWaits[link->item_id % CART_WAIT_SHARDS];
+
+        smutex_lock(&shard.lock);
+        if (link->next != NULL)
+        {
+            link->next->prev = link->prev;
+        }
+        if (link->prev != NULL)
+        {
+            link->prev->next = link->next;
+        }
+        else if (link->next != NULL)
+        {
+            shard.heads[link->item_id] = link->next;
+        }
         else
         {
-            totalCost += inventory[(*item_ids)[i]].price * (1 - inventory[(*item_ids)[i]].discount);
+            shard.heads.erase(link->item_id);
         }
+        smutex_unlock(&shard.lock);
     }
+    cartsParked.fetch_sub(1, memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * notifyCartWaiters --
+ *
+ *      Wake the carts waiting on the specified item. Called after
+ *      any fine mode change that can let a cart complete: stock
+ *      added or returned, a lower price, a higher discount, or the
+ *      item's removal (which rejects the cart).
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+notifyCartWaiters(int item_id)
+{
+    // pairs with parkCart: either we see the cart, or it sees our change
+    atomic_thread_fence(memory_order_seq_cst);
+    if (cartsParked.load(memory_order_relaxed) == 0)
+    {
+        return;
+    }
+
+    CartWaitShard& shard = cartWaits[item_id % CART_WAIT_SHARDS];
+    smutex_lock(&shard.lock);
+    unordered_map<int, CartWaitLink*>::iterator it = shard.heads.find(item_id);
+    if (it != shard.heads.end())
+    {
+        for (CartWaitLink* link = it->second; link != NULL; link = link->next)
+        {
+            link->waiter->wake(link->waiter);
+        }
+    }
+    smutex_unlock(&shard.lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * notifyAllCartWaiters --
+ *
+ *      Wake every waiting cart. Used when shipping gets cheaper or
+ *      the store discount goes up.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+notifyAllCartWaiters()
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (cartsParked.load(memory_order_relaxed) == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < CART_WAIT_SHARDS; i++)
+    {
+        smutex_lock(&cartWaits[i].lock);
+        for (unordered_map<int, CartWaitLink*>::iterator it = cartWaits[i].heads.begin();
+             it != cartWaits[i].heads.end(); ++it)
+        {
+            for (CartWaitLink* link = it->second; link != NULL; link = link->next)
+            {
+                link->waiter->wake(link->waiter);
+            }
+        }
+        smutex_unlock(&cartWaits[i].lock);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * reserveItems --
+ *
+ *      Take the stock for the cart, as buyManyItems would, but hold
+ *      it for up to ttl seconds instead of completing the sale.
+ *      The reservation must then be passed to commitReservation or
+ *      abortReservation; if neither happens in time the sweeper
+ *      gives the stock back.
+ *
+ * Results:
+ *      The reservation id, or 0 if the cart could not be bought.
+ *
+ * ------------------------------------------------------------------
+ */
+unsigned long EStore::
+reserveItems(span<const CartLine> lines, double budget, double ttl)
+{
+    assert(fineModeEnabled());
+
+    Reservation reservation;
+    reservation.words.resize(lines.size());
+    if (takeCart(lines, budget, reservation.words, &reservation.cost) != CART_TAKEN)
+    {
+        return 0;
+    }
+    reservation.lines.assign(lines.begin(), lines.end());
+    double deadline = sutil_now() + ttl;
+
+    smutex_lock(&reservationLock);
+    // the sweeper is only needed once something can expire
+    if (!sweeperRunning)
+    {
+        sweeperRunning = true;
+        sthread_create(&sweeper, sweeperMain, this);
+    }
+    unsigned long id = nextReservation++;
+    reservation.expiry = expiries.insert(make_pair(deadline, id));
+    // the sweeper sleeps until the earliest deadline, which may now be ours
+    if (reservation.expiry == expiries.begin())
+    {
+        scond_signal(&sweeperCond, &reservationLock);
+    }
+    reservations[id] = std::move(reservation);
+    reservationCounts.reserved++;
+    reservationCounts.held++;
+    smutex_unlock(&reservationLock);
+    return id;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * endReservation --
+ *
+ *      Drop a held reservation from the books, as committed or as
+ *      aborted. An aborted reservation is moved to *released, whose
+ *      stock the caller must give back once it has unlocked. Must
+ *      be called with reservationLock held.
+ *
+ * Results:
+ *      true if the reservation was held, false if it had already
+ *      expired, been committed or been aborted.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+endReservation(unsigned long id, bool commit, Reservation* released)
+{
+    unordered_map<unsigned long, Reservation>::iterator it = reservations.find(id);
+    if (it == reservations.end())
+    {
+        return false;
+    }
+    expiries.erase(it->second.expiry);
+    if (commit)
+    {
+        reservationCounts.committed++;
+    }
+    else
+    {
+        *released = std::move(it->second);
+        reservationCounts.aborted++;
+    }
+    reservations.erase(it);
+    reservationCounts.held--;
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * commitReservation --
+ *
+ *      Complete the sale of a reserved cart. Its stock was taken at
+ *      reservation time, so this only drops the reservation.
+ *
+ * Results:
+ *      true if the sale completed, false if the reservation had
+ *      already expired or been aborted.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+commitReservation(unsigned long id)
+{
+    smutex_lock(&reservationLock);
+    bool committed = endReservation(id, true, NULL);
+    smutex_unlock(&reservationLock);
+    return committed;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * abortReservation --
+ *
+ *      Cancel a reserved cart and give its stock back.
+ *
+ * Results:
+ *      true if the reservation was cancelled, false if it had
+ *      already expired, been committed or been aborted.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+abortReservation(unsigned long id)
+{
+    Reservation reservation;
+    smutex_lock(&reservationLock);
+    bool aborted = endReservation(id, false, &reservation);
+    smutex_unlock(&reservationLock);
+
+    // returning stock is lock-free, so it is done after unlocking
+    if (aborted)
+    {
+        releaseCart(reservation.lines, reservation.words, reservation.lines.size());
+    }
+    return aborted;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * settleReservation --
+ *
+ *      Have the sweeper commit (or abort) a reservation at the
+ *      sutil_now time "when", then call done on its own thread. A
+ *      reservation that expires first is not settled, and done
+ *      hears so. Every settlement must be done before the store is
+ *      destroyed; see pendingSettlements.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+settleReservation(unsigned long id, double when, bool commit, settle_done_t done, void* arg)
+{
+    Settlement settlement = { id, commit, done, arg };
+    settlementsPending.fetch_add(1, memory_order_relaxed);
+    smutex_lock(&reservationLock);
+    // reserveItems started the sweeper
+    assert(sweeperRunning);
+    multimap<double, Settlement>::iterator slot = settlements.insert(make_pair(when, settlement));
+    if (slot == settlements.begin())
+    {
+        scond_signal(&sweeperCond, &reservationLock);
+    }
+    smutex_unlock(&reservationLock);
+}
+
+void* EStore::
+sweeperMain(void* arg)
+{
+    ((EStore*)arg)->sweepExpired();
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * sweepExpired --
+ *
+ *      The body of the sweeper thread. Sleep until the earliest
+ *      reservation deadline or scheduled settlement (or until woken
+ *      by a new earlier one), then, in time order, give back the
+ *      stock of every reservation that has expired and carry out
+ *      every settlement that is due. Runs until the store is
+ *      destroyed.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+sweepExpired()
+{
+    vector<Reservation> released;
+    vector<pair<Settlement, bool>> settled;
+
+    smutex_lock(&reservationLock);
+    while (!sweeperStop)
+    {
+        if (expiries.empty() && settlements.empty())
+        {
+            scond_wait(&sweeperCond, &reservationLock);
+            continue;
+        }
+        double next = expiries.empty() ? settlements.begin()->first : expiries.begin()->first;
+        if (!settlements.empty())
+        {
+            next = min(next, settlements.begin()->first);
+        }
+        double now = sutil_now();
+        if (next > now)
+        {
+            scond_timedwait(&sweeperCond, &reservationLock, next);
+            continue;
+        }
+
+        // a settlement due after its reservation's deadline finds it expired
+        for (;;)
+        {
+            bool expiryDue = !expiries.empty() && expiries.begin()->first <= now;
+            bool settlementDue = !settlements.empty() && settlements.begin()->first <= now;
+            if (expiryDue && (!settlementDue || expiries.begin()->first <= settlements.begin()->first))
+            {
+                unsigned long id = expiries.begin()->second;
+                unordered_map<unsigned long, Reservation>::iterator it = reservations.find(id);
+                released.push_back(std::move(it->second));
+                reservations.erase(it);
+                expiries.erase(expiries.begin());
+                reservationCounts.expired++;
+                reservationCounts.held--;
+            }
+            else if (settlementDue)
+            {
+                Settlement settlement = settlements.begin()->second;
+                settlements.erase(settlements.begin());
+                Reservation reservation;
+                bool ended = endReservation(settlement.id, settlement.commit, &reservation);
+                if (ended && !settlement.commit)
+                {
+                    released.push_back(std::move(reservation));
+                }
+                settled.push_back(make_pair(settlement, ended));
+            }
+            else
+            {
+                break;
+            }
+        }
+        smutex_unlock(&reservationLock);
+        for (size_t i = 0; i < released.size(); i++)
+        {
+            releaseCart(released[i].lines, released[i].words, released[i].lines.size());
+        }
+        released.clear();
+        for (size_t i = 0; i < settled.size(); i++)
+        {
+            settled[i].first.done(settled[i].first.arg, settled[i].second);
+            settlementsPending.fetch_sub(1, memory_order_release);
+        }
+        settled.clear();
+        smutex_lock(&reservationLock);
+    }
+    smutex_unlock(&reservationLock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * reservationStats --
+ *
+ *      Return a snapshot of the reservation counters.
+ *
+ * Results:
+ *      The current ReservationStats.
+ *
+ * ------------------------------------------------------------------
+ */
+ReservationStats EStore::
+reservationStats()
+{
+    smutex_lock(&reservationLock);
+    ReservationStats snapshot = reservationCounts;
+    smutex_unlock(&reservationLock);
+    return snapshot;
+}
 
-    // check if exceeds budget
-    if (totalCost * (1 - storeDiscount) + shippingCost * item_ids->size() > budget)
-    {
-        for (int j = 0; (size_t)j < item_ids->size(); j++)
-        {
-            smutex_unlock(&fineMutexes[(*item_ids)[j]]);
-        }   
-    }
-    // buy if all items together don't exceed budget
-    else
-    {
-        for (int j = 0; (size_t)j < item_ids->size(); j++)
-        {
-            inventory[(*item_ids)[j]].quantity -= 1;
-            smutex_unlock(&fineMutexes[(*item_ids)[j]]);
-        }
-    }
-    return;
+/*
+ * ------------------------------------------------------------------
+ * cartWaitStats --
+ *
+ *      Return the fine mode cart wait counters. They are read one
+ *      at a time, so they need not be mutually consistent.
+ *
+ * Results:
+ *      The current CartWaitStats.
+ *
+ * ------------------------------------------------------------------
+ */
+CartWaitStats EStore::
+cartWaitStats()
+{
+    CartWaitStats snapshot;
+    snapshot.parked = cartsParked.load(memory_order_relaxed);
+    snapshot.wakeups = cartWakeups.load(memory_order_relaxed);
+    snapshot.timeouts = cartTimeouts.load(memory_order_relaxed);
+    return snapshot;
 }
 
 /*
@@ -216,42 +1235,32 @@ addItem(int item_id, int quantity, double price, double discount)
         // only allow for one thread to access shared state
         smutex_lock(&mutex);
         // check for valid
-        if (inventory[item_id].valid)
+        if (catalog.item(item_id).valid())
         {
             smutex_unlock(&mutex);
             return;
         }
 
         // create new item if not already valid
-        Item item;
-        item.quantity = quantity;
-        item.price = price;
-        item.discount = discount;
-        item.valid = true;
-        inventory[item_id] = item;
+        catalog.item(item_id).publish(quantity, price, discount);
 
         smutex_unlock(&mutex);
     }
     else
     {
         // allow only one thread to access this specific item
-        smutex_lock(&fineMutexes[item_id]);
+        lockItem(item_id);
         // check for valid
-        if (inventory[item_id].valid)
+        if (catalog.item(item_id).valid())
         {
-            smutex_unlock(&fineMutexes[item_id]);
+            unlockItem(item_id);
             return;
         }
 
         // create new item if not already valid
-        Item item;
-        item.quantity = quantity;
-        item.price = price;
-        item.discount = discount;
-        item.valid = true;
-        inventory[item_id] = item;
+        catalog.item(item_id).publish(quantity, price, discount);
 
-        smutex_unlock(&fineMutexes[item_id]);
+        unlockItem(item_id);
     }
 
     return;
@@ -281,34 +1290,36 @@ removeItem(int item_id)
         // only allow one thread to access the shared state
         smutex_lock(&mutex);
         // check for valid
-        if (!inventory[item_id].valid)
+        if (!catalog.item(item_id).valid())
         {
             smutex_unlock(&mutex);
             return;
         }
 
         // set the items validity to false to remove it
-        inventory[item_id].valid = false;
+        catalog.item(item_id).retire();
 
         // wake any waiters
-        scond_broadcast(&cond, &mutex);
+        wakeItemWaiters(item_id, INT_MAX);
         smutex_unlock(&mutex);
     }
     else
     {
         // only allow one thread to access this item
-        smutex_lock(&fineMutexes[item_id]);
+        lockItem(item_id);
         // check for valid
-        if (!inventory[item_id].valid)
+        if (!catalog.item(item_id).valid())
         {
-            smutex_unlock(&fineMutexes[item_id]);
+            unlockItem(item_id);
             return;
         }
 
         // set the items validity to false to remove it
-        inventory[item_id].valid = false;
+        catalog.item(item_id).retire();
 
-        smutex_unlock(&fineMutexes[item_id]);
+        unlockItem(item_id);
+        // waiting carts holding the item are rejected
+        notifyCartWaiters(item_id);
     }
 
     return;
@@ -334,33 +1345,35 @@ addStock(int item_id, int count)
         // only allow one thread to access the shared state
         smutex_lock(&mutex);
         // check for valid
-        if (!inventory[item_id].valid)
+        if (!catalog.item(item_id).valid())
         {
             smutex_unlock(&mutex);
             return;
         }
 
         // add more stock if valid
-        inventory[item_id].quantity += count;
+        catalog.item(item_id).addQuantity(count);
 
-        scond_broadcast(&cond, &mutex);
+        // each new unit can satisfy at most one waiter
+        wakeItemWaiters(item_id, count);
         smutex_unlock(&mutex);
     }
     else
     {
         // only allow one thread to access this item
-        smutex_lock(&fineMutexes[item_id]);
+        lockItem(item_id);
         // check for valid
-        if (!inventory[item_id].valid)
+        if (!catalog.item(item_id).valid())
         {
-            smutex_unlock(&fineMutexes[item_id]);
+            unlockItem(item_id);
             return;
         }
 
         // add more stock if valid
-        inventory[item_id].quantity += count;
+        catalog.item(item_id).addQuantity(count);
 
-        smutex_unlock(&fineMutexes[item_id]);
+        unlockItem(item_id);
+        notifyCartWaiters(item_id);
     }
 
     return;
@@ -388,37 +1401,43 @@ priceItem(int item_id, double price)
         // only allow one thread to access the shared state
         smutex_lock(&mutex);
         // check for valid
-        if (!inventory[item_id].valid)
+        if (!catalog.item(item_id).valid())
         {
             smutex_unlock(&mutex);
             return;
         }
         // change price if valid
-        double oldPrice = inventory[item_id].price;
-        inventory[item_id].price = price;
+        double oldPrice = catalog.item(item_id).price.load(memory_order_relaxed);
+        catalog.item(item_id).setPrice(price);
 
         // if price decreased, wake waiters
         if (oldPrice > price)
         {
-            scond_broadcast(&cond, &mutex);
+            wakeItemWaiters(item_id, INT_MAX);
         }
         smutex_unlock(&mutex);
     }
     else
     {
         // only allow one thread to access this item
-        smutex_lock(&fineMutexes[item_id]);
+        lockItem(item_id);
 
         // check for valid
-        if (!inventory[item_id].valid)
+        if (!catalog.item(item_id).valid())
         {
-            smutex_unlock(&fineMutexes[item_id]);
+            unlockItem(item_id);
             return;
         }
         // change the price if valid
-        inventory[item_id].price = price;
+        double oldPrice = catalog.item(item_id).price.load(memory_order_relaxed);
+        catalog.item(item_id).setPrice(price);
 
-        smutex_unlock(&fineMutexes[item_id]);
+        unlockItem(item_id);
+        // if price decreased, wake waiting carts
+        if (oldPrice > price)
+        {
+            notifyCartWaiters(item_id);
+        }
     }
     return;
 }
@@ -445,37 +1464,43 @@ discountItem(int item_id, double discount)
         // only allow one thread to access the shared state
         smutex_lock(&mutex);
         // check for valid
-        if (!inventory[item_id].valid)
+        if (!catalog.item(item_id).valid())
         {
             smutex_unlock(&mutex);
             return;
         }
         // change discount if valid
-        double oldDiscount = inventory[item_id].discount;
-        inventory[item_id].discount = discount;
+        double oldDiscount = catalog.item(item_id).discount.load(memory_order_relaxed);
+        catalog.item(item_id).setDiscount(discount);
 
         // wake waiters if discount increased
         if (oldDiscount < discount)
         {
-            scond_broadcast(&cond, &mutex);
+            wakeItemWaiters(item_id, INT_MAX);
         }
         smutex_unlock(&mutex);
     }
     else
     {
         // only allow one thread to access this item
-        smutex_lock(&fineMutexes[item_id]);
+        lockItem(item_id);
 
         // check for valid
-        if (!inventory[item_id].valid)
+        if (!catalog.item(item_id).valid())
         {
-            smutex_unlock(&fineMutexes[item_id]);
+            unlockItem(item_id);
             return;
         }
         // change discount if valid
-        inventory[item_id].discount = discount;
+        double oldDiscount = catalog.item(item_id).discount.load(memory_order_relaxed);
+        catalog.item(item_id).setDiscount(discount);
 
-        smutex_unlock(&fineMutexes[item_id]);
+        unlockItem(item_id);
+        // wake waiting carts if discount increased
+        if (oldDiscount < discount)
+        {
+            notifyCartWaiters(item_id);
+        }
     }
 
     return;
@@ -500,26 +1525,34 @@ setShippingCost(double cost)
     {
         // only allow one thread to access the shared state
         smutex_lock(&mutex);
-        // change the shipping cost if valid
-        double oldShippingCost = shippingCost;
-        shippingCost = cost;
+        // change the shipping cost
+        StorePricing* current = pricing.load(memory_order_relaxed);
+        double oldShippingCost = current->shippingCost;
+        publishPricing(cost, current->storeDiscount);
 
         // wake any waiters if shipping decreased
         if (oldShippingCost > cost)
         {
-            scond_broadcast(&cond, &mutex);
+            wakeAllWaiters();
         }
         smutex_unlock(&mutex);
     }
     else
     {
-        // only allow one thread to access the shipping cost
-        smutex_lock(&shippingLock);
+        // only allow one thread to change the store-wide pricing
+        smutex_lock(&pricingLock);
 
         // change the shipping cost
-        shippingCost = cost;
+        StorePricing* current = pricing.load(memory_order_relaxed);
+        double oldShippingCost = current->shippingCost;
+        publishPricing(cost, current->storeDiscount);
 
-        smutex_unlock(&shippingLock);
+        smutex_unlock(&pricingLock);
+        // wake all waiting carts if shipping decreased
+        if (oldShippingCost > cost)
+        {
+            notifyAllCartWaiters();
+        }
     }
 
     return;
@@ -546,26 +1579,521 @@ setStoreDiscount(double discount)
         smutex_lock(&mutex);
         
         // change the discount
-        double oldStoreDiscount = storeDiscount;
-        storeDiscount = discount;
+        StorePricing* current = pricing.load(memory_order_relaxed);
+        double oldStoreDiscount = current->storeDiscount;
+        publishPricing(current->shippingCost, discount);
 
         // wake any waiters if the store discount increased
-        if (oldStoreDiscount < storeDiscount)
+        if (oldStoreDiscount < discount)
         {
-            scond_broadcast(&cond, &mutex);
+            wakeAllWaiters();
         }
         smutex_unlock(&mutex);
     }
     else
     {
-        // only allow one thread to access the store discount
-        smutex_lock(&discountLock);
+        // only allow one thread to change the store-wide pricing
+        smutex_lock(&pricingLock);
 
         // change the store discount
-        storeDiscount = discount;
+        StorePricing* current = pricing.load(memory_order_relaxed);
+        double oldStoreDiscount = current->storeDiscount;
+        publishPricing(current->shippingCost, discount);
 
-        smutex_unlock(&discountLock);
+        smutex_unlock(&pricingLock);
+        // wake all waiting carts if the store discount increased
+        if (oldStoreDiscount < discount)
+        {
+            notifyAllCartWaiters();
+        }
     }
 
     return;
 }
+
+/*
+ * ------------------------------------------------------------------
+ * applyBatch --
+ *
+ *      Apply a batch of supplier mutations, with the same effect as
+ *      making the corresponding calls one after the other: rows for
+ *      the same item are applied in batch order, and the last
+ *      shipping cost and store discount in the batch win.
+ *
+ *      In coarse mode the whole batch is applied under one
+ *      acquisition of the store mutex. Blocked buyers are woken
+ *      once at the end: each affected item gets at most one
+ *      wakeup pass, covering every unit added to it by the batch,
+ *      and a batch that leaves shipping cheaper or the store
+ *      discount higher wakes every item once instead. Removals
+ *      are the exception: they wake the item's buyers at once, so
+ *      that buyers of the removed incarnation give up even if a
+ *      later row adds the item again.
+ *
+ *      In fine mode the item rows are applied in batch order, and
+ *      a stripe lock is kept across a run of rows that share it
+ *      rather than taken again for each; only one lock is held at
+ *      a time. With item ownership on the rows are applied
+ *      unlocked, and every item of the batch must be owned by the
+ *      caller. Store-wide rows are published as a single
+ *      StorePricing under pricingLock. Waiting carts are then woken
+ *      once per affected item, or all at once if the store-wide
+ *      pricing got cheaper. Other threads may see the batch half
+ *      applied, exactly as they could see half of a run of single
+ *      calls.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+applyBatch(span<const SupplierMutation> batch)
+{
+    assert(batch.size() <= UINT32_MAX);
+    bool newShipping = false;
+    bool newDiscount = false;
+    double shippingCost = 0;
+    double storeDiscount = 0;
+
+    if (!fineModeEnabled())
+    {
+        // only allow one thread to access the shared state
+        smutex_lock(&mutex);
+
+        // (item, units added or INT_MAX) for each row that can wake buyers
+        vector<pair<int, int> > wake;
+        bool anyParked = stats.parked > 0;
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            const SupplierMutation& mutation = batch[i];
+            if (mutation.type == SET_SHIPPING_COST)
+            {
+                newShipping = true;
+                shippingCost = mutation.price;
+            }
+            else if (mutation.type == SET_STORE_DISCOUNT)
+            {
+                newDiscount = true;
+                storeDiscount = mutation.discount;
+            }
+            else
+            {
+                int limit = applyItemMutation(mutation);
+                if (limit > 0 && anyParked && !catalog.item(mutation.item_id).valid())
+                {
+                    // release the removed incarnation's buyers before a later row re-adds it
+                    wakeItemWaiters(mutation.item_id, INT_MAX);
+                }
+                else if (limit > 0 && anyParked)
+                {
+                    wake.push_back(make_pair(mutation.item_id, limit));
+                }
+            }
+        }
+
+        if (newShipping || newDiscount)
+        {
+            StorePricing* current = pricing.load(memory_order_relaxed);
+            shippingCost = newShipping ? shippingCost : current->shippingCost;
+            storeDiscount = newDiscount ? storeDiscount : current->storeDiscount;
+            bool cheaper = shippingCost < current->shippingCost || storeDiscount > current->storeDiscount;
+            publishPricing(shippingCost, storeDiscount);
+            if (cheaper)
+            {
+                // covers every item the rows touched as well
+                wakeAllWaiters();
+                smutex_unlock(&mutex);
+                return;
+            }
+        }
+
+        // one pass per item, with the limits of its rows summed
+        sort(wake.begin(), wake.end());
+        size_t row = 0;
+        while (row < wake.size())
+        {
+            int item_id = wake[row].first;
+            int limit = 0;
+            for (; row < wake.size() && wake[row].first == item_id; row++)
+            {
+                limit = wake[row].second > INT_MAX - limit ? INT_MAX : limit + wake[row].second;
+            }
+            wakeItemWaiters(item_id, limit);
+        }
+        smutex_unlock(&mutex);
+        return;
+    }
+
+    // the items whose waiting carts the batch should wake
+    vector<int> wakeBuffer(batch.size());
+    int* wake = wakeBuffer.data();
+    size_t numWake = 0;
+    // the stripe lock held for the current run of rows, kept while the next row shares it
+    smutex_t* held = NULL;
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        const SupplierMutation& mutation = batch[i];
+        if (mutation.type == SET_SHIPPING_COST)
+        {
+            newShipping = true;
+            shippingCost = mutation.price;
+            continue;
+        }
+        if (mutation.type == SET_STORE_DISCOUNT)
+        {
+            newDiscount = true;
+            storeDiscount = mutation.discount;
+            continue;
+        }
+        if (!ownedItems)
+        {
+            // every item of the batch is ours when owned: nothing to lock
+            smutex_t* lock = catalog.lockFor(mutation.item_id);
+            if (lock != held)
+            {
+                if (held != NULL)
+                {
+                    smutex_unlock(held);
+                }
+                smutex_lock(lock);
+                held = lock;
+            }
+        }
+        if (applyItemMutation(mutation) > 0)
+        {
+            wake[numWake++] = mutation.item_id;
+        }
+    }
+    if (held != NULL)
+    {
+        smutex_unlock(held);
+    }
+
+    if (newShipping || newDiscount)
+    {
+        // only allow one thread to change the store-wide pricing
+        smutex_lock(&pricingLock);
+        StorePricing* current = pricing.load(memory_order_relaxed);
+        shippingCost = newShipping ? shippingCost : current->shippingCost;
+        storeDiscount = newDiscount ? storeDiscount : current->storeDiscount;
+        bool cheaper = shippingCost < current->shippingCost || storeDiscount > current->storeDiscount;
+        publishPricing(shippingCost, storeDiscount);
+        smutex_unlock(&pricingLock);
+        if (cheaper)
+        {
+            notifyAllCartWaiters();
+            return;
+        }
+    }
+
+    // as in notifyCartWaiters, either we see a parked cart or it sees the whole batch
+    atomic_thread_fence(memory_order_seq_cst);
+    if (cartsParked.load(memory_order_relaxed) == 0)
+    {
+        return;
+    }
+    // one notification per item
+    sort(wake, wake + numWake);
+    int* last = unique(wake, wake + numWake);
+    for (int* item = wake; item < last; item++)
+    {
+        notifyCartWaiters(*item);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * applyItemMutation --
+ *
+ *      Apply one per-item supplier mutation, as addItem,
+ *      removeItem, addStock, priceItem or discountItem would, but
+ *      without locking or waking anyone. Must be called with mutex
+ *      (coarse mode) or the item's lock (fine mode) held.
+ *
+ * Results:
+ *      How many blocked buyers of the item the change can make
+ *      eligible: 0 if none, the units added for ADD_STOCK, and
+ *      INT_MAX for a removal, price drop or discount increase.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::
+applyItemMutation(const SupplierMutation& mutation)
+{
+    Item item = catalog.item(mutation.item_id);
+
+    // add item is the only mutation that applies to items not carried
+    if (mutation.type == ADD_ITEM)
+    {
+        if (!item.valid())
+        {
+            item.publish(mutation.quantity, mutation.price, mutation.discount);
+        }
+        return 0;
+    }
+    if (!item.valid())
+    {
+        return 0;
+    }
+
+    switch (mutation.type)
+    {
+        case REMOVE_ITEM:
+            item.retire();
+            return INT_MAX;
+        case ADD_STOCK:
+            item.addQuantity(mutation.quantity);
+            return mutation.quantity;
+        case CHANGE_ITEM_PRICE:
+        {
+            double oldPrice = item.price.load(memory_order_relaxed);
+            item.setPrice(mutation.price);
+            return oldPrice > mutation.price ? INT_MAX : 0;
+        }
+        case CHANGE_ITEM_DISCOUNT:
+        {
+            double oldDiscount = item.discount.load(memory_order_relaxed);
+            item.setDiscount(mutation.discount);
+            return oldDiscount < mutation.discount ? INT_MAX : 0;
+        }
+        default:
+            assert(false);
+            return 0;
+    }
+}
+
+static void
+reclaimPricing(void* ptr)
+{
+    delete (StorePricing*)ptr;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * publishPricing --
+ *
+ *      Replace the store-wide pricing with a new snapshot and retire
+ *      the old one. Must be called with mutex (coarse mode) or
+ *      pricingLock (fine mode) held.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+publishPricing(double shippingCost, double storeDiscount)
+{
+    StorePricing* old = pricing.load(memory_order_relaxed);
+    StorePricing* next = new StorePricing();
+    next->shippingCost = shippingCost;
+    next->storeDiscount = storeDiscount;
+    next->version = old->version + 1;
+    pricing.store(next, memory_order_release);
+    epoch_retire(old, reclaimPricing);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * itemCost --
+ *
+ *      The overall cost of buying one unit of the specified item,
+ *      as defined in buyItem. Must be called with mutex held.
+ *
+ * Results:
+ *      The cost including store discount and shipping.
+ *
+ * ------------------------------------------------------------------
+ */
+double EStore::
+itemCost(int item_id)
+{
+    // writers hold mutex too, so the current pricing cannot be retired under us
+    StorePricing* global = pricing.load(memory_order_relaxed);
+    return catalog.item(item_id).unitPrice() * (1 - global->storeDiscount) + global->shippingCost;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * signalEligible --
+ *
+ *      Wake, highest budget first, the buyers of the specified item
+ *      that could complete a purchase right now. At most "limit"
+ *      buyers are woken, and never more than the units in stock
+ *      that are not already promised to earlier woken buyers.
+ *      If the item was removed, every buyer is woken. Must be
+ *      called with mutex held.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+signalEligible(int item_id, int limit)
+{
+    ItemWaiters& entry = waiters[item_id];
+    WaitList& list = entry.list;
+    bool removed = !catalog.item(item_id).valid();
+    double cost = itemCost(item_id);
+    if (!removed)
+    {
+        limit = min(limit, catalog.item(item_id).quantity() - entry.pending);
+    }
+
+    while (!list.empty() && (removed || (limit > 0 && list.begin()->first >= cost)))
+    {
+        BuyWaiter* waiter = list.begin()->second;
+        list.erase(list.begin());
+        waiter->signaled = true;
+        entry.pending++;
+        limit--;
+        if (waiter->resumer != NULL)
+        {
+            resumeBuyer(waiter);
+        }
+        else
+        {
+            scond_signal(&waiter->cond, &mutex);
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeItemWaiters --
+ *
+ *      Wake the buyers of the specified item that the last
+ *      mutation made eligible, at most "limit" of them. Must be
+ *      called with mutex held.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+wakeItemWaiters(int item_id, int limit)
+{
+    unordered_map<int, ItemWaiters>::iterator it = waiters.find(item_id);
+    if (it == waiters.end() || it->second.list.empty())
+    {
+        return;
+    }
+    stats.mutations++;
+    stats.herd += stats.parked;
+    stats.itemHerd += it->second.list.size();
+    signalEligible(item_id, limit);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeAllWaiters --
+ *
+ *      Wake the eligible buyers of every item. Used for store-wide
+ *      changes (shipping cost, store discount). Must be called
+ *      with mutex held.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+wakeAllWaiters()
+{
+    if (stats.parked == 0)
+    {
+        return;
+    }
+    stats.mutations++;
+    stats.herd += stats.parked;
+    stats.itemHerd += stats.parked;
+    // only items with blocked buyers have an entry
+    for (unordered_map<int, ItemWaiters>::iterator it = waiters.begin(); it != waiters.end(); ++it)
+    {
+        if (!it->second.list.empty())
+        {
+            signalEligible(it->first, INT_MAX);
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * report --
+ *
+ *      Scan the whole catalog and total the items carried, the
+ *      units in stock and their value. The scan walks each shard in
+ *      slot order, so it streams through whichever arrays the item
+ *      layout uses, and only reads prices of items that are in
+ *      stock. In coarse mode the scan holds the store mutex; in
+ *      fine mode each item is read from a consistent snapshot but
+ *      the totals are not a single point in time.
+ *
+ * Results:
+ *      The InventoryReport.
+ *
+ * ------------------------------------------------------------------
+ */
+InventoryReport EStore::
+report()
+{
+    InventoryReport totals = InventoryReport();
+    int shards = catalog.shardCount();
+
+    if (!fineModeEnabled())
+    {
+        smutex_lock(&mutex);
+    }
+    for (int shard = 0; shard < shards; shard++)
+    {
+        for (int item_id = shard; item_id < catalog.size(); item_id += shards)
+        {
+            Item item = catalog.item(item_id);
+            uint64_t word = item.stock.load(memory_order_acquire);
+            if (!stock_valid(word))
+            {
+                continue;
+            }
+            totals.itemsCarried++;
+            if (stock_quantity(word) == 0)
+            {
+                continue;
+            }
+            double unit = item.snapshot(&word);
+            if (!stock_valid(word))
+            {
+                continue;
+            }
+            totals.unitsInStock += stock_quantity(word);
+            totals.stockValue += unit * stock_quantity(word);
+        }
+    }
+    if (!fineModeEnabled())
+    {
+        smutex_unlock(&mutex);
+    }
+    return totals;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeupStats --
+ *
+ *      Return a snapshot of the coarse mode wakeup counters.
+ *
+ * Results:
+ *      The current WakeupStats.
+ *
+ * ------------------------------------------------------------------
+ */
+WakeupStats EStore::
+wakeupStats()
+{
+    smutex_lock(&mutex);
+    WakeupStats snapshot = stats;
+    smutex_unlock(&mutex);
+    return snapshot;
+}
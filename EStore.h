@@ -1,40 +1,253 @@
 #pragma once
 
+#include <atomic>
+#include <coroutine>
+#include <functional>
+#include <map>
+#include <span>
+#include <unordered_map>
 #include <vector>
 
+#include "Catalog.h"
+#include "Coroutine.h"
+#include "Epoch.h"
 #include "Request.h"
 #include "sthread.h"
 
-/* 
+/*
  * ------------------------------------------------------------------
- * Item -- 
+ * StorePricing --
  *
- *      This class represents a type of item in the inventory of the
- *      estore.  It keeps track of the number of units in stock, the
- *      price of each unit, etc.
+ *      The store-wide pricing parameters. A StorePricing is never
+ *      modified once published: a change builds a new one, swaps
+ *      the store's pointer to it, and retires the old one through
+ *      epoch-based reclamation, so readers see both values from the
+ *      same update.
  *
- *      The current price of an individual item is defined as the
- *      normal price of the item (i.e. the price field of Item) times
- *      1 - the current discount (i.e. the discount field of Item).
- *      When a customer tries to buy an item, the current price of
- *      the item should be used to determine the cost of the overall
- *      purchase.
+ * ------------------------------------------------------------------
+ */
+struct StorePricing {
+    double shippingCost;
+    double storeDiscount;
+    unsigned long version;
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * InventoryReport --
  *
- *      If the particular item is not being offered by the store,
- *      then the valid field of the item in the inventory will be
- *      set to false.
+ *      Totals over the whole catalog, as returned by EStore::report.
+ *      stockValue is the sum of quantity times current unit price
+ *      (before store discount and shipping).
  *
  * ------------------------------------------------------------------
  */
-class Item {
-    public:
-    bool valid;
-    int quantity;
-    double price;
-    double discount;
+struct InventoryReport {
+    long itemsCarried;
+    long unitsInStock;
+    double stockValue;
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * Reservation --
+ *
+ *      Stock taken out of the catalog for a cart that has not been
+ *      paid for yet. words holds the stock word each line was taken
+ *      at, so that an abort can give the units back to the same
+ *      incarnation of the item (see Item::returnTo). cost is the
+ *      price of the cart when it was reserved, which commit keeps.
+ *
+ * ------------------------------------------------------------------
+ */
+struct Reservation {
+    std::vector<CartLine> lines;
+    std::vector<uint64_t> words;
+    double cost;
+    std::multimap<double, unsigned long>::iterator expiry;
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * ReservationStats --
+ *
+ *      Counters of the reservation API. held is the number of
+ *      reservations that are neither committed, aborted nor
+ *      expired yet.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ReservationStats {
+    long reserved;
+    long committed;
+    long aborted;
+    long expired;
+    long held;
+};
 
-    Item();
-    ~Item();
+// called by the sweeper once a settleReservation is carried out;
+// settled is false if the reservation had expired by then
+typedef void (*settle_done_t)(void* arg, bool settled);
+
+// a commit or abort that settleReservation scheduled
+struct Settlement {
+    unsigned long id;
+    bool commit;
+    settle_done_t done;
+    void* arg;
+};
+
+
+class TaskSink;
+
+/*
+ * ------------------------------------------------------------------
+ * BuyWaiter --
+ *
+ *      A coarse mode buyer waiting for an item, either a thread
+ *      blocked in buyItem or a coroutine suspended in buyItemAsync.
+ *      A blocked thread has its own condition variable so that a
+ *      mutation can wake exactly the buyers it makes eligible. A
+ *      suspended coroutine instead has a resumer, which it is
+ *      handed back to as a task, and if it has a deadline an entry
+ *      in the store's buyer deadlines that the timer thread acts on.
+ *
+ * ------------------------------------------------------------------
+ */
+struct BuyWaiter;
+
+// blocked buyers of one item, highest budget first
+typedef std::multimap<double, BuyWaiter*, std::greater<double> > WaitList;
+
+// suspended buyers by deadline
+typedef std::multimap<double, BuyWaiter*> BuyDeadlines;
+
+struct BuyWaiter {
+    double budget;
+    bool signaled;
+    scond_t cond;
+
+    // coroutines only
+    std::coroutine_handle<> coroutine;
+    TaskSink* resumer;
+    int item_id;
+    WaitList::iterator slot;
+    bool expires;
+    BuyDeadlines::iterator expiry;
+};
+
+// called by buyItemAsync with the purchase and its outcome, on whichever thread finished it
+typedef void (*purchase_done_t)(void* arg, int item_id, double budget, PurchaseResult result);
+
+// the blocked buyers of an item, plus how many were woken but have not run yet
+struct ItemWaiters {
+    WaitList list;
+    int pending;
+
+    ItemWaiters() : pending(0) { }
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * CartWaiter --
+ *
+ *      A fine mode cart blocked in buyManyItems. The cart is linked
+ *      into the wait list of every item it holds, one CartWaitLink
+ *      per line, so a change to an item finds only the carts that
+ *      hold it, and a cart that gives up unlinks itself in one step
+ *      per line. A waking change calls wake; for a blocked thread
+ *      that sets notified and signals cond, after which the cart is
+ *      priced again from scratch.
+ *
+ * ------------------------------------------------------------------
+ */
+struct CartWaiter;
+
+typedef void (*cart_wake_t)(CartWaiter* waiter);
+
+struct CartWaitLink {
+    CartWaiter* waiter;
+    int item_id;
+    CartWaitLink* prev;
+    CartWaitLink* next;
+};
+
+struct CartWaiter {
+    std::vector<CartWaitLink> links;
+    cart_wake_t wake;
+    smutex_t lock;
+    scond_t cond;
+    bool notified;
+};
+
+// heads of the cart wait lists of the items hashing to one shard
+#define CART_WAIT_SHARDS 64
+
+struct alignas(CACHE_LINE_SIZE) CartWaitShard {
+    smutex_t lock;
+    std::unordered_map<int, CartWaitLink*> heads;
+};
+
+// parked is the number of carts currently blocked
+struct CartWaitStats {
+    long parked;
+    long wakeups;
+    long timeouts;
+};
+
+// outcome of pricing and taking a cart once
+enum CartResult {
+    CART_TAKEN = 0,
+    CART_SHORT,                 // out of stock or over budget for now
+    CART_NOT_CARRIED            // an item is not carried, or a line is empty
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * WakeupStats --
+ *
+ *      Counters describing how coarse mode wakes blocked buyers.
+ *      parked is the number of buyers currently waiting, wakeups
+ *      the number of times a buyer returned from a wait, and
+ *      mutations the number of changes that found anyone waiting.
+ *
+ *      herd is the sum of parked buyers at each of those
+ *      mutations, i.e. the wakeups a single store-wide condition
+ *      variable would have caused. itemHerd is the sum of buyers
+ *      waiting on the mutated item, i.e. the wakeups a per-item
+ *      broadcast would have caused.
+ *
+ * ------------------------------------------------------------------
+ */
+struct WakeupStats {
+    long parked;
+    long wakeups;
+    long mutations;
+    long herd;
+    long itemHerd;
+};
+
+
+/*
+ * ------------------------------------------------------------------
+ * StoreLocks --
+ *
+ *      The LockKind of the store's own contended locks: mutex,
+ *      which is the monitor in coarse mode, and pricingLock. The
+ *      item locks are chosen with CatalogOptions::itemLocks.
+ *
+ * ------------------------------------------------------------------
+ */
+struct StoreLocks {
+    LockKind store;
+    LockKind pricing;
+
+    StoreLocks() : store(LOCK_BLOCKING), pricing(LOCK_BLOCKING) { }
 };
 
 
@@ -46,13 +259,27 @@ class Item {
  *      Customers and suppliers interact with the store through the
  *      methods of this class.
  *
- *      Items in the inventory are indexed by their item IDs.
+ *      Items in the inventory are indexed by their item IDs. The
+ *      inventory size, number of shards, lock stripes per shard and
+ *      item layout are fixed at construction (see Catalog), as are
+ *      the kinds of the locks (see StoreLocks).
  *
  *      The store discount should initially be set to 0.
  *      The shipping cost should initially be set to 3.
  *
+ *      Both purchase methods take a PurchasePolicy saying whether
+ *      to give up, wait, or wait until a deadline (in sutil_now
+ *      seconds) when the purchase cannot complete right away.
+ *
  *      If fineMode is false, then this class functions strictly as
  *      a monitor. The buyItem method only functions in this mode.
+ *      Blocked buyers wait in a per-item list ordered by budget,
+ *      and a mutation wakes only the buyers of that item that can
+ *      now afford it, at most one per unit in stock. Store-wide
+ *      changes apply the same rule to every item with buyers.
+ *      buyItemAsync is the same purchase as a coroutine: instead of
+ *      blocking a thread it suspends onto the item's list, and the
+ *      mutation that picks it hands it back to its executor.
  *
  *      If fineMode is true, simultaneous requests for:
  *          - addItem,
@@ -61,25 +288,79 @@ class Item {
  *          - priceItem,
  *          - discountItem
  *      that reference different item ids must process at the same
- *      time. The buyManyItems method only functions in this mode.
+ *      time, unless the ids share a lock stripe. setShippingCost
+ *      and setStoreDiscount serialize on pricingLock and publish a
+ *      new StorePricing snapshot. The buyManyItems method only
+ *      functions in this mode. It takes no lock: carts are priced
+ *      from the current StorePricing and versioned item snapshots,
+ *      and committed with a CAS on each item's stock word. Carts
+ *      that wait are linked into per-item CartWaiter lists, and
+ *      every fine mode change that can make an item cheaper or
+ *      more available wakes the carts on that item's list.
+ *
+ *      reserveItems takes a cart's stock the same way but holds it
+ *      under a reservation id until commitReservation keeps it,
+ *      abortReservation gives it back, or its TTL runs out and the
+ *      sweeper thread gives it back. settleReservation has the
+ *      sweeper commit or abort it later instead, so a caller that
+ *      waits for a payment need not hold a thread meanwhile. Only
+ *      reservationLock is held, and only to file or find the
+ *      reservation.
+ *
+ *      applyBatch applies many supplier mutations at once, in
+ *      either mode, taking each lock once per batch rather than
+ *      once per mutation.
+ *
+ *      With setItemOwnership, fine mode item writers take no lock
+ *      at all: the caller promises that every change to an item is
+ *      made by the one thread that owns it (see ShardedPool). Item
+ *      writes then only race with lock-free buyers, which the
+ *      stock word CAS already handles.
  *
  * ------------------------------------------------------------------
  */
 class EStore {
     private:
-    Item inventory[INVENTORY_SIZE];
+    Catalog catalog;
     const bool fineMode;
+    bool ownedItems;
     smutex_t mutex;
-    scond_t cond;
-    double shippingCost;
-    double storeDiscount;
-    smutex_t fineMutexes[INVENTORY_SIZE];
-    smutex_t shippingLock;
-    smutex_t discountLock;
+    std::unordered_map<int, ItemWaiters> waiters;
+    WakeupStats stats;
+
+    // coarse mode coroutine buyers, and the timer that expires them
+    BuyDeadlines buyDeadlines;
+    scond_t timerCond;
+    sthread_t timer;
+    bool timerRunning;
+    bool timerStop;
+    std::atomic<long> asyncPurchases;   // finished by buyItemAsync
+    std::atomic<StorePricing*> pricing;
+    smutex_t pricingLock;
+
+    // held reservations by id, their ids by expiry time, and scheduled settlements
+    smutex_t reservationLock;
+    std::unordered_map<unsigned long, Reservation> reservations;
+    std::multimap<double, unsigned long> expiries;
+    std::multimap<double, Settlement> settlements;
+    std::atomic<long> settlementsPending;  // scheduled, and not done yet
+    unsigned long nextReservation;
+    ReservationStats reservationCounts;
+    scond_t sweeperCond;
+    sthread_t sweeper;
+    bool sweeperRunning;
+    bool sweeperStop;
+
+    // fine mode carts blocked in buyManyItems
+    CartWaitShard* cartWaits;
+    std::atomic<long> cartsParked;
+    std::atomic<long> cartWakeups;
+    std::atomic<long> cartTimeouts;
 
     public:
 
-    explicit EStore(bool enableFineMode);
+    explicit EStore(bool enableFineMode, const CatalogOptions& options = CatalogOptions(),
+                    const StoreLocks& locks = StoreLocks());
     ~EStore();
 
     // no default copy constructor and assignment operators. this will prevent some
@@ -87,7 +368,10 @@ class EStore {
     EStore(const EStore&) = delete;
     EStore& operator=(const EStore &) = delete;
 
-    void buyItem(int item_id, double budget);
+    PurchaseResult buyItem(int item_id, double budget,
+                           PurchasePolicy policy = PURCHASE_BLOCK, double deadline = 0);
+    void buyItemAsync(int item_id, double budget, PurchasePolicy policy, double deadline,
+                      TaskSink* resumer, purchase_done_t done, void* arg);
     void addItem(int item_id, int quantity, double price, double discount);
     void removeItem(int item_id);
     void addStock(int item_id, int count);
@@ -96,8 +380,57 @@ class EStore {
     void setShippingCost(double price);
     void setStoreDiscount(double discount);
 
-    void buyManyItems(std::vector<int>* item_ids, double budget);
+    void applyBatch(std::span<const SupplierMutation> batch);
+
+    PurchaseResult buyManyItems(std::span<const CartLine> lines, double budget,
+                                PurchasePolicy policy = PURCHASE_FAIL_FAST, double deadline = 0);
+    unsigned long reserveItems(std::span<const CartLine> lines, double budget, double ttl);
+    bool commitReservation(unsigned long id);
+    bool abortReservation(unsigned long id);
+    void settleReservation(unsigned long id, double when, bool commit, settle_done_t done,
+                           void* arg);
+
+    void setItemOwnership(bool owned);
+    bool mayUnblock(const SupplierMutation& mutation);
 
     bool fineModeEnabled() const { return fineMode; }
+    bool itemOwnershipEnabled() const { return ownedItems; }
+    long asyncPurchasesDone() const { return asyncPurchases.load(std::memory_order_acquire); }
+    long pendingSettlements() const { return settlementsPending.load(std::memory_order_acquire); }
+    int inventorySize() const { return catalog.size(); }
+    size_t memoryUsage() const { return catalog.memoryUsage(); }
+    WakeupStats wakeupStats();
+    InventoryReport report();
+    ReservationStats reservationStats();
+    CartWaitStats cartWaitStats();
+
+    private:
+    // the item lock of a fine mode writer, unless items are owned
+    void lockItem(int item_id) { if (!ownedItems) smutex_lock(catalog.lockFor(item_id)); }
+    void unlockItem(int item_id) { if (!ownedItems) smutex_unlock(catalog.lockFor(item_id)); }
+
+    double itemCost(int item_id);
+    DetachedCoroutine buyItemCoroutine(int item_id, double budget, PurchasePolicy policy,
+                                       double deadline, TaskSink* resumer, purchase_done_t done,
+                                       void* arg);
+    void resumeBuyer(BuyWaiter* waiter);
+    static void* timerMain(void* arg);
+    void expireBuyers();
+    CartResult takeCart(std::span<const CartLine> lines, double budget,
+                        std::span<uint64_t> words, double* cost);
+    void releaseCart(std::span<const CartLine> lines, std::span<const uint64_t> words,
+                     size_t count);
+    void parkCart(CartWaiter* waiter, std::span<const CartLine> lines);
+    void unparkCart(CartWaiter* waiter);
+    void notifyCartWaiters(int item_id);
+    void notifyAllCartWaiters();
+    bool endReservation(unsigned long id, bool commit, Reservation* released);
+    static void* sweeperMain(void* arg);
+    void sweepExpired();
+    int applyItemMutation(const SupplierMutation& mutation);
+    void publishPricing(double shippingCost, double storeDiscount);
+    void wakeItemWaiters(int item_id, int limit);
+    void wakeAllWaiters();
+    void signalEligible(int item_id, int limit);
 };
 
@@ -0,0 +1,209 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <pthread.h>
+
+#include "Epoch.h"
+
+using namespace std;
+
+// a thread that is not inside a read section
+#define EPOCH_IDLE UINT64_MAX
+
+/*
+ * One record per thread that has ever entered a read section. Records
+ * are never freed; a thread that exits gives its record back for reuse.
+ */
+struct EpochRecord {
+    atomic<uint64_t> epoch;
+    atomic<bool> inUse;
+    EpochRecord* next;
+};
+
+struct Retired {
+    void* ptr;
+    reclaim_t reclaim;
+    uint64_t epoch;
+};
+
+static atomic<uint64_t> globalEpoch(0);
+static atomic<EpochRecord*> records(NULL);
+
+// protects retiredList and epoch advancement
+static pthread_mutex_t retireLock = PTHREAD_MUTEX_INITIALIZER;
+static vector<Retired> retiredList;
+
+/*
+ * Releases the calling thread's record when the thread exits.
+ */
+struct EpochThread {
+    EpochRecord* record;
+
+    EpochThread() : record(NULL) { }
+    ~EpochThread()
+    {
+        if (record != NULL)
+        {
+            record->epoch.store(EPOCH_IDLE, memory_order_relaxed);
+            record->inUse.store(false, memory_order_release);
+        }
+    }
+};
+
+static thread_local EpochThread self;
+
+/*
+ * ------------------------------------------------------------------
+ * acquireRecord --
+ *
+ *      Claim a free record, or push a new one onto the list.
+ *
+ * Results:
+ *      The calling thread's record.
+ *
+ * ------------------------------------------------------------------
+ */
+static EpochRecord*
+acquireRecord()
+{
+    for (EpochRecord* rec = records.load(memory_order_acquire); rec != NULL; rec = rec->next)
+    {
+        bool expected = false;
+        if (!rec->inUse.load(memory_order_relaxed)
+            && rec->inUse.compare_exchange_strong(expected, true, memory_order_acquire))
+        {
+            return rec;
+        }
+    }
+
+    EpochRecord* rec = new EpochRecord();
+    rec->epoch.store(EPOCH_IDLE, memory_order_relaxed);
+    rec->inUse.store(true, memory_order_relaxed);
+    rec->next = records.load(memory_order_relaxed);
+    while (!records.compare_exchange_weak(rec->next, rec, memory_order_release, memory_order_relaxed))
+        ;
+    return rec;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * epoch_enter --
+ *
+ *      Begin a read section. Objects reachable at this point are
+ *      not freed until the matching epoch_exit.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+epoch_enter()
+{
+    if (self.record == NULL)
+    {
+        self.record = acquireRecord();
+    }
+    self.record->epoch.store(globalEpoch.load(memory_order_relaxed), memory_order_relaxed);
+    // publish our epoch before any shared pointer is read
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * epoch_exit --
+ *
+ *      End a read section.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+epoch_exit()
+{
+    self.record->epoch.store(EPOCH_IDLE, memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryAdvance --
+ *
+ *      Move the global epoch forward if every thread inside a read
+ *      section has already observed the current one. Must be
+ *      called with retireLock held.
+ *
+ * Results:
+ *      The (possibly advanced) global epoch.
+ *
+ * ------------------------------------------------------------------
+ */
+static uint64_t
+tryAdvance()
+{
+    uint64_t current = globalEpoch.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (EpochRecord* rec = records.load(memory_order_acquire); rec != NULL; rec = rec->next)
+    {
+        uint64_t epoch = rec->epoch.load(memory_order_acquire);
+        if (epoch != EPOCH_IDLE && epoch != current)
+        {
+            return current;
+        }
+    }
+    globalEpoch.store(current + 1, memory_order_release);
+    return current + 1;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * epoch_retire --
+ *
+ *      Hand over an object that is no longer reachable from shared
+ *      state. It is passed to reclaim once two epoch advances have
+ *      happened, at which point no reader can still hold it. Also
+ *      reclaims any earlier retirements that have become safe.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+epoch_retire(void* ptr, reclaim_t reclaim)
+{
+    if (pthread_mutex_lock(&retireLock))
+    {
+        perror("epoch retire lock");
+        exit(-1);
+    }
+
+    Retired retired = { ptr, reclaim, globalEpoch.load(memory_order_relaxed) };
+    retiredList.push_back(retired);
+    // two advances are needed before anything becomes reclaimable
+    tryAdvance();
+    uint64_t current = tryAdvance();
+
+    size_t kept = 0;
+    for (size_t i = 0; i < retiredList.size(); i++)
+    {
+        if (retiredList[i].epoch + 2 <= current)
+        {
+            retiredList[i].reclaim(retiredList[i].ptr);
+        }
+        else
+        {
+            retiredList[kept++] = retiredList[i];
+        }
+    }
+    retiredList.resize(kept);
+
+    if (pthread_mutex_unlock(&retireLock))
+    {
+        perror("epoch retire unlock");
+        exit(-1);
+    }
+}
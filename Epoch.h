@@ -0,0 +1,23 @@
+#pragma once
+
+/*
+ * ------------------------------------------------------------------
+ * Epoch-based reclamation --
+ *
+ *      Lets readers dereference shared pointers without locks while
+ *      writers swap in new objects. A reader brackets its accesses
+ *      with epoch_enter/epoch_exit; a writer that has unlinked an
+ *      object hands it to epoch_retire, which frees it only once
+ *      every reader that could still hold it has exited.
+ *
+ *      Read sections must be short and must not nest. Each thread
+ *      is registered on its first epoch_enter.
+ *
+ * ------------------------------------------------------------------
+ */
+
+typedef void (*reclaim_t) (void *);
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, reclaim_t reclaim);
@@ -0,0 +1,139 @@
+#include <algorithm>
+
+#include "EventCount.h"
+#include "sthread.h"
+
+using namespace std;
+
+#define EVENT_EPOCH_MASK    0xffffffffULL
+#define EVENT_WAITER_SHIFT  32
+#define EVENT_SIGNAL_SHIFT  48
+#define EVENT_COUNT_MASK    0xffffULL
+#define EVENT_WAITER_ONE    (1ULL << EVENT_WAITER_SHIFT)
+
+// the futex word is the low half of the state
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "EventCount assumes little endian");
+static_assert(sizeof(atomic<uint64_t>) == sizeof(uint64_t), "EventCount state must be lock-free");
+
+static inline uint64_t
+event_waiters(uint64_t state)
+{
+    return (state >> EVENT_WAITER_SHIFT) & EVENT_COUNT_MASK;
+}
+
+static inline uint64_t
+event_signals(uint64_t state)
+{
+    return state >> EVENT_SIGNAL_SHIFT;
+}
+
+static inline uint64_t
+event_state(uint64_t epoch, uint64_t waiters, uint64_t signals)
+{
+    return (epoch & EVENT_EPOCH_MASK) | (waiters << EVENT_WAITER_SHIFT) | (signals << EVENT_SIGNAL_SHIFT);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * prepareWait --
+ *
+ *      Announce that the caller is about to wait. The caller must
+ *      check its condition again after this returns.
+ *
+ * Results:
+ *      The key to pass to cancelWait or commitWait.
+ *
+ * ------------------------------------------------------------------
+ */
+uint32_t EventCount::
+prepareWait()
+{
+    // seq_cst: the announcement is visible before the condition is re-read
+    return (uint32_t)(state.fetch_add(EVENT_WAITER_ONE, memory_order_seq_cst) & EVENT_EPOCH_MASK);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * cancelWait --
+ *
+ *      Leave after prepareWait, without sleeping. The departure
+ *      consumes a pending signal if there is one: the signal went
+ *      to a thread that is not asleep, so no sleeper is left
+ *      uncovered.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EventCount::
+cancelWait(uint32_t key)
+{
+    uint64_t current = state.load(memory_order_relaxed);
+    uint64_t next;
+    do
+    {
+        uint64_t signals = event_signals(current);
+        next = event_state(current, event_waiters(current) - 1, signals > 0 ? signals - 1 : 0);
+    } while (!state.compare_exchange_weak(current, next, memory_order_relaxed));
+}
+
+/*
+ * ------------------------------------------------------------------
+ * commitWait --
+ *
+ *      Sleep until the epoch moves past key, then leave as
+ *      cancelWait does.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EventCount::
+commitWait(uint32_t key)
+{
+    while ((uint32_t)(state.load(memory_order_acquire) & EVENT_EPOCH_MASK) == key)
+    {
+        sfutex_wait((uint32_t*)&state, key);
+    }
+    cancelWait(key);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * signal --
+ *
+ *      Wake up to count waiters that do not already have a signal
+ *      on its way. Must be called after the change that the waiters
+ *      are waiting for.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EventCount::
+signal(uint64_t count)
+{
+    // pairs with prepareWait: either we see the waiter, or it sees our change
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t current = state.load(memory_order_relaxed);
+    uint64_t woken;
+    for (;;)
+    {
+        uint64_t waiters = event_waiters(current);
+        uint64_t signals = event_signals(current);
+        if (waiters <= signals)
+        {
+            return;
+        }
+        woken = min(count, waiters - signals);
+        uint64_t next = event_state(current + 1, waiters, signals + woken);
+        if (state.compare_exchange_weak(current, next, memory_order_release, memory_order_relaxed))
+        {
+            break;
+        }
+    }
+    sfutex_wake((uint32_t*)&state, (int)woken);
+}
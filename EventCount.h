@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/*
+ * ------------------------------------------------------------------
+ * EventCount --
+ *
+ *      Lets threads sleep until a lock-free condition becomes true,
+ *      without a mutex on the fast path. A waiter calls
+ *      prepareWait, checks the condition again, and then either
+ *      cancelWait (it became true) or commitWait with the key that
+ *      prepareWait returned. The thread that makes the condition
+ *      true calls notify or notifyAll afterwards.
+ *
+ *      The state is one 64-bit word:
+ *
+ *          bits 0-31    epoch, also the futex word
+ *          bits 32-47   waiters: threads between prepareWait and
+ *                       the end of cancelWait or commitWait
+ *          bits 48-63   signals: wakeups sent that no waiter has
+ *                       consumed by leaving yet
+ *
+ *      notify moves to the next epoch, so a waiter that has not
+ *      slept yet will not, and wakes count sleepers (one by
+ *      default). It does nothing while every waiter is already
+ *      covered by a signal, so a burst of notifies before a woken
+ *      thread runs costs one syscall, not one each.
+ *
+ * ------------------------------------------------------------------
+ */
+class EventCount {
+    private:
+    std::atomic<uint64_t> state;
+
+    void signal(uint64_t count);
+
+    public:
+    EventCount() : state(0) { }
+
+    EventCount(const EventCount&) = delete;
+    EventCount& operator=(const EventCount &) = delete;
+
+    uint32_t prepareWait();
+    void cancelWait(uint32_t key);
+    void commitWait(uint32_t key);
+    void notify(int count = 1) { signal(count); }
+    void notifyAll() { signal(UINT64_MAX); }
+};
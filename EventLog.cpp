@@ -0,0 +1,476 @@
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+
+#include "EventLog.h"
+#include "sthread.h"
+
+using namespace std;
+
+#define EVENT_LOG_MAGIC "ESTLOG1"
+
+std::atomic<int> eventLevel(EVENT_OFF);
+
+/*
+ * One single-producer ring per thread that has ever logged. The owner
+ * fills records at tail; the drain thread writes them out from head.
+ * Rings are never freed; a thread that exits gives its ring back for
+ * reuse, and the drain thread still writes out what it left.
+ */
+struct EventRing {
+    alignas(CACHE_LINE_SIZE) atomic<uint64_t> head;
+    alignas(CACHE_LINE_SIZE) atomic<uint64_t> tail;
+    atomic<long> dropped;
+    atomic<bool> inUse;
+    int index;
+    EventRing* next;
+    EventRecord records[EVENT_RING_SIZE];
+};
+
+static_assert((EVENT_RING_SIZE & (EVENT_RING_SIZE - 1)) == 0, "ring size is a power of two");
+
+static atomic<EventRing*> rings(NULL);
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static int numRings = 0;
+
+// the drain thread, and what it writes to
+static EventSink* eventSink = NULL;
+static sthread_t drainer;
+static atomic<bool> draining(false);
+static long logged = 0;
+
+static const char* eventLevelNames[NUM_EVENT_LEVELS] = { "off", "info", "debug" };
+static const char* purchaseResults[] = { "bought", "rejected", "timed out" };
+static const char* checkoutOutcomes[] = { "unavailable", "aborted", "expired", "committed" };
+static const char* requestNames[NUM_REQUEST_TYPES] = {
+    "call", "AddItemReq", "RemoveItemReq", "AddStockReq", "ChangeItemPriceReq",
+    "ChangeItemDiscountReq", "SetShippingCostReq", "SetStoreDiscountReq", "SupplierBatchReq",
+    "BuyItemReq", "BuyItemReq", "BuyManyItemsReq", "CheckoutReq"
+};
+
+const char*
+event_level_name(EventLevel level)
+{
+    assert(level >= 0 && level < NUM_EVENT_LEVELS);
+    return eventLevelNames[level];
+}
+
+bool
+event_level_parse(const char* name, EventLevel* level)
+{
+    for (int i = 0; i < NUM_EVENT_LEVELS; i++)
+    {
+        if (strcmp(name, eventLevelNames[i]) == 0)
+        {
+            *level = (EventLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Gives the calling thread's ring back when the thread exits.
+ */
+struct EventThread {
+    EventRing* ring;
+
+    EventThread() : ring(NULL) { }
+    ~EventThread()
+    {
+        if (ring != NULL)
+        {
+            ring->inUse.store(false, memory_order_release);
+        }
+    }
+};
+
+static thread_local EventThread self;
+
+/*
+ * ------------------------------------------------------------------
+ * acquireRing --
+ *
+ *      Claim a ring given back by an exited thread, or add a new
+ *      one to the list.
+ *
+ * Results:
+ *      The calling thread's ring.
+ *
+ * ------------------------------------------------------------------
+ */
+static EventRing*
+acquireRing()
+{
+    for (EventRing* ring = rings.load(memory_order_acquire); ring != NULL; ring = ring->next)
+    {
+        bool expected = false;
+        if (!ring->inUse.load(memory_order_relaxed)
+            && ring->inUse.compare_exchange_strong(expected, true, memory_order_acquire))
+        {
+            return ring;
+        }
+    }
+
+    EventRing* ring = new EventRing();
+    ring->head.store(0, memory_order_relaxed);
+    ring->tail.store(0, memory_order_relaxed);
+    ring->dropped.store(0, memory_order_relaxed);
+    ring->inUse.store(true, memory_order_relaxed);
+    pthread_mutex_lock(&ringLock);
+    ring->index = numRings++;
+    ring->next = rings.load(memory_order_relaxed);
+    rings.store(ring, memory_order_release);
+    pthread_mutex_unlock(&ringLock);
+    return ring;
+}
+
+EventRecord*
+event_claim(EventType type)
+{
+    if (self.ring == NULL)
+    {
+        self.ring = acquireRing();
+    }
+    EventRing* ring = self.ring;
+    uint64_t tail = ring->tail.load(memory_order_relaxed);
+    if (tail - ring->head.load(memory_order_acquire) >= EVENT_RING_SIZE)
+    {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+        return NULL;
+    }
+    // a slot still holds an older event; clear what this type may not set
+    EventRecord* record = &ring->records[tail & (EVENT_RING_SIZE - 1)];
+    *record = EventRecord();
+    record->time = sutil_now();
+    record->type = type;
+    record->thread = ring->index;
+    return record;
+}
+
+// publish the record from the last event_claim to the drain thread
+void
+event_commit(EventRecord* record)
+{
+    EventRing* ring = self.ring;
+    assert(record == &ring->records[ring->tail.load(memory_order_relaxed) & (EVENT_RING_SIZE - 1)]);
+    ring->tail.fetch_add(1, memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * drainRings --
+ *
+ *      Write every record committed so far in every ring to the
+ *      sink, and free their slots for their owners.
+ *
+ * Results:
+ *      The number of records written.
+ *
+ * ------------------------------------------------------------------
+ */
+static long
+drainRings()
+{
+    long written = 0;
+    for (EventRing* ring = rings.load(memory_order_acquire); ring != NULL; ring = ring->next)
+    {
+        uint64_t head = ring->head.load(memory_order_relaxed);
+        uint64_t tail = ring->tail.load(memory_order_acquire);
+        for (uint64_t i = head; i < tail; i++)
+        {
+            eventSink->write(ring->records[i & (EVENT_RING_SIZE - 1)]);
+        }
+        ring->head.store(tail, memory_order_release);
+        written += tail - head;
+    }
+    logged += written;
+    return written;
+}
+
+// the drain thread: poll the rings, and flush the sink whenever they run dry
+static void*
+drainMain(void* arg)
+{
+    while (draining.load(memory_order_acquire))
+    {
+        if (drainRings() == 0)
+        {
+            eventSink->flush();
+            sthread_sleep(0, 1000000);
+        }
+    }
+    // whatever was committed before event_log_stop
+    drainRings();
+    eventSink->flush();
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * event_log_start --
+ *
+ *      Start logging events at the given level and below, and the
+ *      thread that drains them to sink. The log owns the sink.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+event_log_start(EventSink* sink, EventLevel level)
+{
+    assert(eventSink == NULL && sink != NULL);
+    eventSink = sink;
+    logged = 0;
+    draining.store(true, memory_order_release);
+    sthread_create(&drainer, drainMain, NULL);
+    eventLevel.store(level, memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * event_log_stop --
+ *
+ *      Stop logging, write out everything already logged, and
+ *      delete the sink. Threads still logging may have their last
+ *      events dropped, so stop the log after they are done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+event_log_stop()
+{
+    assert(eventSink != NULL);
+    eventLevel.store(EVENT_OFF, memory_order_relaxed);
+    draining.store(false, memory_order_release);
+    sthread_join(drainer);
+    delete eventSink;
+    eventSink = NULL;
+}
+
+void
+event_log_set_level(EventLevel level)
+{
+    assert(level >= 0 && level < NUM_EVENT_LEVELS);
+    eventLevel.store(level, memory_order_relaxed);
+}
+
+// only meaningful while the drain thread is stopped
+EventLogStats
+event_log_stats()
+{
+    EventLogStats stats = EventLogStats();
+    stats.logged = logged;
+    for (EventRing* ring = rings.load(memory_order_acquire); ring != NULL; ring = ring->next)
+    {
+        stats.dropped += ring->dropped.load(memory_order_relaxed);
+    }
+    return stats;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * event_format --
+ *
+ *      Print a record as the line the handlers used to print.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+event_format(const EventRecord& record, FILE* out)
+{
+    switch (record.type)
+    {
+        case EVENT_ADD_ITEM:
+            fprintf(out, "Handling AddItemReq: item_id - %d, quantity - %d, price - $%.2f, discount - %.2f\n",
+                    record.item_id, record.quantity, record.amount, record.discount);
+            break;
+        case EVENT_REMOVE_ITEM:
+            fprintf(out, "Handling RemoveItemReq: item_id - %d\n", record.item_id);
+            break;
+        case EVENT_ADD_STOCK:
+            fprintf(out, "Handling AddStockReq: item_id - %d, additional_stock - %d\n",
+                    record.item_id, record.quantity);
+            break;
+        case EVENT_CHANGE_ITEM_PRICE:
+            fprintf(out, "Handling ChangeItemPriceReq: item_id - %d, new_price - $%.2f\n",
+                    record.item_id, record.amount);
+            break;
+        case EVENT_CHANGE_ITEM_DISCOUNT:
+            fprintf(out, "Handling ChangeItemDiscountReq: item_id - %d, new_discount - %.2f\n",
+                    record.item_id, record.discount);
+            break;
+        case EVENT_SET_SHIPPING_COST:
+            fprintf(out, "Handling SetShippingCostReq: new_shipping - $%.2f\n", record.amount);
+            break;
+        case EVENT_SET_STORE_DISCOUNT:
+            fprintf(out, "Handling SetStoreDiscountReq: new_discount - %.2f\n", record.discount);
+            break;
+        case EVENT_SUPPLIER_BATCH:
+            fprintf(out, "Handling SupplierBatchReq: %d mutations\n", record.quantity);
+            break;
+        case EVENT_BUY_ITEM:
+            fprintf(out, "Handling BuyItemReq: item_id - %d, budget - $%.2f : %s\n",
+                    record.item_id, record.amount, purchaseResults[record.outcome]);
+            break;
+        case EVENT_BUY_MANY_ITEMS:
+            fprintf(out, "Handling BuyManyItemsReq: items - ");
+            for (int i = 0; i < record.quantity && i < MAX_BUY_ITEM; i++)
+            {
+                fprintf(out, "%dx%d ", record.lines[i].item_id, record.lines[i].quantity);
+            }
+            fprintf(out, ", budget - $%.2f : %s\n", record.amount, purchaseResults[record.outcome]);
+            break;
+        case EVENT_CHECKOUT:
+            fprintf(out, "Handling CheckoutReq: %d lines, budget - $%.2f, ttl - %.2fs, payment - %.2fs : %s\n",
+                    record.quantity, record.amount, record.discount, record.extra,
+                    checkoutOutcomes[record.outcome]);
+            break;
+        case EVENT_STOP:
+            fprintf(out, "Handling StopHandlerReq : Quitting.\n");
+            break;
+        case EVENT_TASK_DISCARDED:
+            fprintf(out, "Discarded %s task (affinity %d): %s\n", requestNames[record.quantity],
+                    record.item_id, record.outcome ? "dropped" : "rejected");
+            break;
+        default:
+            fprintf(out, "unknown event type %d\n", record.type);
+            break;
+    }
+}
+
+void TextEventSink::
+write(const EventRecord& record)
+{
+    event_format(record, out);
+}
+
+void TextEventSink::
+flush()
+{
+    fflush(out);
+}
+
+// the start of a binary log file
+struct EventLogHeader {
+    char magic[8];
+    uint32_t recordSize;
+    uint32_t reserved;
+};
+
+BinaryEventSink::
+BinaryEventSink(const char* path)
+{
+    file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        perror(path);
+        exit(-1);
+    }
+    EventLogHeader header = EventLogHeader();
+    memcpy(header.magic, EVENT_LOG_MAGIC, sizeof(EVENT_LOG_MAGIC));
+    header.recordSize = sizeof(EventRecord);
+    fwrite(&header, sizeof(header), 1, file);
+}
+
+BinaryEventSink::
+~BinaryEventSink()
+{
+    fclose(file);
+}
+
+void BinaryEventSink::
+write(const EventRecord& record)
+{
+    fwrite(&record, sizeof(record), 1, file);
+}
+
+void BinaryEventSink::
+flush()
+{
+    fflush(file);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * event_sink_create --
+ *
+ *      Make the sink a command line names: "text" (standard
+ *      output), "null", or "binary:PATH".
+ *
+ * Results:
+ *      The sink, or NULL if spec names none.
+ *
+ * ------------------------------------------------------------------
+ */
+EventSink*
+event_sink_create(const char* spec)
+{
+    if (strcmp(spec, "text") == 0)
+    {
+        return new TextEventSink(stdout);
+    }
+    if (strcmp(spec, "null") == 0)
+    {
+        return new NullEventSink();
+    }
+    if (strncmp(spec, "binary:", 7) == 0 && spec[7] != '\0')
+    {
+        return new BinaryEventSink(spec + 7);
+    }
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * event_log_decode --
+ *
+ *      Print a binary log file as text.
+ *
+ * Results:
+ *      false if the file cannot be read or is not a log written
+ *      with this build's record layout.
+ *
+ * ------------------------------------------------------------------
+ */
+bool
+event_log_decode(const char* path, FILE* out)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return false;
+    }
+    EventLogHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, EVENT_LOG_MAGIC, sizeof(EVENT_LOG_MAGIC)) != 0
+        || header.recordSize != sizeof(EventRecord))
+    {
+        fprintf(stderr, "%s: not an event log of this build\n", path);
+        fclose(file);
+        return false;
+    }
+    EventRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if (record.type < NUM_EVENT_TYPES)
+        {
+            event_format(record, out);
+        }
+    }
+    fclose(file);
+    return true;
+}
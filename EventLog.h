@@ -0,0 +1,193 @@
+#pragma once
+
+#include "Request.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+#define EVENT_RING_SIZE 1024    // records per thread; a power of two
+
+/*
+ * ------------------------------------------------------------------
+ * EventLevel --
+ *
+ *      How much the event log records, set at run time (see
+ *      event_log_start and event_log_set_level).
+ *
+ *      EVENT_OFF       nothing.
+ *      EVENT_INFO      every request handled, and worker stops.
+ *      EVENT_DEBUG     also every task a full queue turns away or
+ *                      drops.
+ *
+ *      Building with -DNO_EVENT_LOG removes logging altogether:
+ *      event_begin is then a constant NULL and the code that fills
+ *      records is dead.
+ *
+ * ------------------------------------------------------------------
+ */
+enum EventLevel {
+    EVENT_OFF = 0,
+    EVENT_INFO,
+    EVENT_DEBUG,
+    NUM_EVENT_LEVELS
+};
+
+const char* event_level_name(EventLevel level);
+bool event_level_parse(const char* name, EventLevel* level);
+
+enum EventType {
+    EVENT_ADD_ITEM = 0,
+    EVENT_REMOVE_ITEM,
+    EVENT_ADD_STOCK,
+    EVENT_CHANGE_ITEM_PRICE,
+    EVENT_CHANGE_ITEM_DISCOUNT,
+    EVENT_SET_SHIPPING_COST,
+    EVENT_SET_STORE_DISCOUNT,
+    EVENT_SUPPLIER_BATCH,
+    EVENT_BUY_ITEM,
+    EVENT_BUY_MANY_ITEMS,
+    EVENT_CHECKOUT,
+    EVENT_STOP,
+    EVENT_TASK_DISCARDED,
+    NUM_EVENT_TYPES
+};
+
+// how a checkout ended
+enum CheckoutOutcome {
+    CHECKOUT_UNAVAILABLE = 0,   // the cart could not be reserved
+    CHECKOUT_ABORTED,
+    CHECKOUT_EXPIRED,
+    CHECKOUT_COMMITTED
+};
+
+/*
+ * ------------------------------------------------------------------
+ * EventRecord --
+ *
+ *      One logged event, stored as is in the rings and binary log
+ *      files. Which fields mean what depends on the type:
+ *
+ *      item_id     the item, or for EVENT_TASK_DISCARDED the task's
+ *                  affinity.
+ *      quantity    stock of an added item or restock, rows of a
+ *                  batch, lines of a cart, or for a discarded task
+ *                  its RequestType.
+ *      amount      new price or cost, or a purchase's budget.
+ *      discount    new discount, or a checkout's ttl.
+ *      extra       a checkout's payment time.
+ *      outcome     PurchaseResult, CheckoutOutcome, or for a
+ *                  discarded task 1 if it was dropped from the
+ *                  queue and 0 if it was turned away.
+ *      lines       a cart's first lines, up to MAX_BUY_ITEM.
+ *
+ * ------------------------------------------------------------------
+ */
+struct EventRecord {
+    double time;                // sutil_now when logged
+    uint16_t type;              // EventType
+    uint16_t outcome;
+    int32_t thread;             // the logging thread's ring
+    int32_t item_id;
+    int32_t quantity;
+    double amount;
+    double discount;
+    double extra;
+    CartLine lines[MAX_BUY_ITEM];
+};
+
+// what the event log has seen since it started
+struct EventLogStats {
+    long logged;                // records written to the sink
+    long dropped;               // records lost to a full ring
+};
+
+/*
+ * ------------------------------------------------------------------
+ * EventSink --
+ *
+ *      Where the drain thread writes records: as text
+ *      (TextEventSink), to a binary file (BinaryEventSink), or
+ *      nowhere (NullEventSink). Only the drain thread calls a sink.
+ *
+ * ------------------------------------------------------------------
+ */
+class EventSink {
+    public:
+    virtual ~EventSink() { }
+    virtual void write(const EventRecord& record) = 0;
+    virtual void flush() { }
+};
+
+class TextEventSink final : public EventSink {
+    private:
+    FILE* out;
+
+    public:
+    explicit TextEventSink(FILE* output) : out(output) { }
+    void write(const EventRecord& record) override;
+    void flush() override;
+};
+
+/*
+ * A file of EventRecords as they are in memory, after a header that
+ * names the format and the record size (see event_log_decode).
+ */
+class BinaryEventSink final : public EventSink {
+    private:
+    FILE* file;
+
+    public:
+    explicit BinaryEventSink(const char* path);
+    ~BinaryEventSink();
+    void write(const EventRecord& record) override;
+    void flush() override;
+};
+
+class NullEventSink final : public EventSink {
+    public:
+    void write(const EventRecord& record) override { }
+};
+
+EventSink* event_sink_create(const char* spec);
+
+void event_log_start(EventSink* sink, EventLevel level);
+void event_log_stop();
+void event_log_set_level(EventLevel level);
+EventLogStats event_log_stats();
+
+void event_format(const EventRecord& record, FILE* out);
+bool event_log_decode(const char* path, FILE* out);
+
+extern std::atomic<int> eventLevel;
+
+EventRecord* event_claim(EventType type);
+void event_commit(EventRecord* record);
+
+/*
+ * ------------------------------------------------------------------
+ * event_begin --
+ *
+ *      Start a record of the given type in the calling thread's
+ *      ring, if the log is at the given level or above. The caller
+ *      fills in the fields of its type and passes it to
+ *      event_commit. Never blocks: if the ring is full the event is
+ *      counted as dropped instead.
+ *
+ * Results:
+ *      The record, or NULL if the event is not to be logged.
+ *
+ * ------------------------------------------------------------------
+ */
+inline EventRecord*
+event_begin(EventLevel level, EventType type)
+{
+#ifdef NO_EVENT_LOG
+    return NULL;
+#else
+    if (level > eventLevel.load(std::memory_order_relaxed))
+    {
+        return NULL;
+    }
+    return event_claim(type);
+#endif
+}
@@ -0,0 +1,132 @@
+#include <cstdio>
+
+#include "Executor.h"
+#include "RequestHandlers.h"
+
+/*
+ * ------------------------------------------------------------------
+ * stop --
+ *
+ *      Drain and shut down the executor: enqueue one stop task per
+ *      worker behind whatever is queued, then join.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Executor::
+stop()
+{
+    for (int i = 0; i < size(); i++)
+    {
+        Task stopReq = call_task(stop_handler, NULL);
+        stopReq.kind = TASK_CONTROL;
+        enqueue(stopReq);
+    }
+    join();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * report_workers --
+ *
+ *      Print, for each worker, the tasks it ran, the share of its
+ *      life spent in handlers, and its rate in tasks per second of
+ *      life and per second of handler time. The first rate is what
+ *      the worker delivered; the second is what it could deliver
+ *      if it were never idle. With showStolen, also print how many
+ *      of its tasks it stole.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+report_workers(FILE* out, const char* name, const WorkerStats* stats, int numWorkers,
+               bool showStolen)
+{
+    long total = 0;
+    double first = 0, last = 0;
+    for (int i = 0; i < numWorkers; i++)
+    {
+        total += stats[i].tasks;
+        first = i == 0 ? stats[i].started : (stats[i].started < first ? stats[i].started : first);
+        last = stats[i].stopped > last ? stats[i].stopped : last;
+    }
+    double seconds = last - first;
+    fprintf(out, "%s pool: %d workers, %ld tasks in %.2fs, %.1f tasks/s\n",
+            name, numWorkers, total, seconds, seconds > 0 ? total / seconds : 0.0);
+    for (int i = 0; i < numWorkers; i++)
+    {
+        const WorkerStats& s = stats[i];
+        double life = s.stopped - s.started;
+        fprintf(out, "  worker %2d: %6ld tasks  %5.1f%% busy  %9.1f tasks/s  %11.1f tasks/busy-s",
+                i, s.tasks, life > 0 ? 100 * s.busySeconds / life : 0.0,
+                life > 0 ? s.tasks / life : 0.0,
+                s.busySeconds > 0 ? s.tasks / s.busySeconds : 0.0);
+        if (showStolen)
+        {
+            fprintf(out, "  %6ld stolen", s.stolen);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * record --
+ *
+ *      Count one latency, in seconds.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void LatencyHistogram::
+record(double seconds)
+{
+    int bucket = 0;
+    double bound = 1e-6;
+    while (seconds >= bound && bucket < LATENCY_BUCKETS - 1)
+    {
+        bound *= 2;
+        bucket++;
+    }
+    counts[bucket]++;
+    total++;
+    sum += seconds;
+    max = seconds > max ? seconds : max;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * percentile --
+ *
+ *      The latency that the given fraction of the counted ones do
+ *      not exceed, rounded up to the end of its bucket (but never
+ *      above the largest latency counted).
+ *
+ * Results:
+ *      The latency in seconds; 0 if nothing was counted.
+ *
+ * ------------------------------------------------------------------
+ */
+double LatencyHistogram::
+percentile(double fraction) const
+{
+    long rank = (long)(fraction * total + 0.5);
+    long seen = 0;
+    double bound = 1e-6;
+    for (int b = 0; b < LATENCY_BUCKETS; b++, bound *= 2)
+    {
+        seen += counts[b];
+        if (seen >= rank && seen > 0)
+        {
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
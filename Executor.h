@@ -0,0 +1,90 @@
+#pragma once
+
+#include "TaskQueue.h"
+#include "sthread.h"
+#include <cstdio>
+#include <vector>
+
+/*
+ * ------------------------------------------------------------------
+ * WorkerStats --
+ *
+ *      What one pool worker did: the tasks it ran (not counting its
+ *      stop task), the time spent inside handlers, and when it
+ *      started and stopped, in sutil_now seconds. stolen counts the
+ *      tasks it took from other workers, for executors that steal.
+ *      Padded so that workers never share a line.
+ *
+ * ------------------------------------------------------------------
+ */
+struct alignas(CACHE_LINE_SIZE) WorkerStats {
+    long tasks;
+    long stolen;
+    double busySeconds;
+    double started;
+    double stopped;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * Executor --
+ *
+ *      A fixed set of worker threads that run the tasks enqueued
+ *      to it, until each worker has been handed a stop task (see
+ *      RequestGenerator::enqueueStops). Every task enqueued before
+ *      the stops is run before the workers exit.
+ *
+ *      join waits for every worker to stop; stop enqueues one stop
+ *      task per worker first, for executors whose producer does
+ *      not.
+ *
+ *      pinTo, before start, pins worker i to CPU cpus[i % n]; by
+ *      default workers run wherever the scheduler puts them.
+ *
+ * ------------------------------------------------------------------
+ */
+class Executor : public TaskSink {
+    protected:
+    std::vector<int> cpus;
+
+    public:
+    void pinTo(const std::vector<int>& cpuList) { cpus = cpuList; }
+    int cpuOf(int worker) const { return cpus.empty() ? -1 : cpus[worker % cpus.size()]; }
+
+    virtual void start() = 0;
+    virtual void join() = 0;
+    virtual int size() const = 0;
+    virtual void report(FILE* out) const = 0;
+
+    void stop();
+};
+
+void report_workers(FILE* out, const char* name, const WorkerStats* stats, int numWorkers,
+                    bool showStolen);
+
+// buckets of a LatencyHistogram; the last one holds everything above ~9 minutes
+#define LATENCY_BUCKETS 30
+
+/*
+ * ------------------------------------------------------------------
+ * LatencyHistogram --
+ *
+ *      Counts of latencies in power-of-two buckets: bucket b holds
+ *      those under 2^b microseconds (and at least half that). A
+ *      percentile is reported as the upper end of its bucket, so
+ *      within a factor of two. Not thread safe.
+ *
+ * ------------------------------------------------------------------
+ */
+struct LatencyHistogram {
+    long counts[LATENCY_BUCKETS];
+    long total;
+    double sum;
+    double max;
+
+    LatencyHistogram() : counts(), total(0), sum(0), max(0) { }
+
+    void record(double seconds);
+    double percentile(double fraction) const;
+    double mean() const { return total > 0 ? sum / total : 0; }
+};
@@ -0,0 +1,389 @@
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+
+#include "PriorityPool.h"
+#include "RequestHandlers.h"
+#include "sthread.h"
+
+using namespace std;
+
+PriorityScheduler::
+PriorityScheduler(int numLanes)
+    : lanes(numLanes), nextSeq(0)
+{
+    assert(numLanes > 0);
+    smutex_init(&mutex);
+    for (int i = 0; i < numLanes; i++)
+    {
+        scond_init(&lanes[i].cond);
+        lanes[i].idle = 0;
+        lanes[i].borrows = false;
+        lanes[i].borrowed = 0;
+    }
+    for (int p = 0; p < NUM_TASK_PRIORITIES; p++)
+    {
+        stats[p].deadlines = 0;
+        stats[p].missed = 0;
+    }
+}
+
+PriorityScheduler::
+~PriorityScheduler()
+{
+    for (size_t i = 0; i < lanes.size(); i++)
+    {
+        assert(lanes[i].idle == 0);
+        scond_destroy(&lanes[i].cond);
+    }
+    smutex_destroy(&mutex);
+}
+
+void PriorityScheduler::
+setBorrowing(int lane, bool borrows)
+{
+    smutex_lock(&mutex);
+    lanes[lane].borrows = borrows;
+    smutex_unlock(&mutex);
+}
+
+// file a task in its lane; mutex must be held
+void PriorityScheduler::
+push(int lane, const Task& task, double now)
+{
+    ScheduledTask entry;
+    entry.rank = task_is_stop(task) ? NUM_TASK_PRIORITIES : task.priority;
+    entry.deadline = task.deadline > 0 ? task.deadline : HUGE_VAL;
+    entry.seq = nextSeq++;
+    entry.enqueued = now;
+    entry.task = task;
+    lanes[lane].tasks.push(entry);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wake --
+ *
+ *      Wake workers for count new tasks in the given lane: its own
+ *      idle workers first, then idle workers of lanes that borrow.
+ *      Must be called with mutex held.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void PriorityScheduler::
+wake(int lane, int count)
+{
+    for (size_t i = 0; i < lanes.size() && count > 0; i++)
+    {
+        SchedulerLane& target = lanes[(lane + i) % lanes.size()];
+        if (i > 0 && !target.borrows)
+        {
+            continue;
+        }
+        int woken = min(count, target.idle);
+        if (woken == target.idle && woken > 0)
+        {
+            scond_broadcast(&target.cond, &mutex);
+        }
+        else
+        {
+            for (int w = 0; w < woken; w++)
+            {
+                scond_signal(&target.cond, &mutex);
+            }
+        }
+        count -= woken;
+    }
+}
+
+void PriorityScheduler::
+enqueue(int lane, const Task& task)
+{
+    smutex_lock(&mutex);
+    push(lane, task, sutil_now());
+    wake(lane, 1);
+    smutex_unlock(&mutex);
+}
+
+void PriorityScheduler::
+enqueueBatch(int lane, span<const Task> tasks)
+{
+    if (tasks.empty())
+    {
+        return;
+    }
+    smutex_lock(&mutex);
+    double now = sutil_now();
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        push(lane, tasks[i], now);
+    }
+    wake(lane, (int)tasks.size());
+    smutex_unlock(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * pickLender --
+ *
+ *      Find the lane whose next task an idle worker of the given
+ *      lane should borrow: the one whose next task runs first, not
+ *      counting stop tasks. Must be called with mutex held.
+ *
+ * Results:
+ *      The lane, or -1 if there is nothing to borrow.
+ *
+ * ------------------------------------------------------------------
+ */
+int PriorityScheduler::
+pickLender(int lane)
+{
+    RunsLater later;
+    int best = -1;
+    for (size_t i = 1; i < lanes.size(); i++)
+    {
+        int other = (lane + i) % lanes.size();
+        if (lanes[other].tasks.empty() || lanes[other].tasks.top().rank == NUM_TASK_PRIORITIES)
+        {
+            continue;
+        }
+        if (best < 0 || later(lanes[best].tasks.top(), lanes[other].tasks.top()))
+        {
+            best = other;
+        }
+    }
+    return best;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * take --
+ *
+ *      Remove and return the next task for a worker of the given
+ *      lane, borrowing from another lane if its own is empty and
+ *      the lane borrows, and waiting if there is nothing. Records
+ *      how long the task waited.
+ *
+ * Results:
+ *      The task; *borrowed says whether it came from another lane.
+ *
+ * ------------------------------------------------------------------
+ */
+Task PriorityScheduler::
+take(int lane, bool* borrowed)
+{
+    SchedulerLane& own = lanes[lane];
+    ScheduledTask entry;
+    smutex_lock(&mutex);
+    for (;;)
+    {
+        if (!own.tasks.empty())
+        {
+            entry = own.tasks.top();
+            own.tasks.pop();
+            *borrowed = false;
+            break;
+        }
+        int lender = own.borrows ? pickLender(lane) : -1;
+        if (lender >= 0)
+        {
+            entry = lanes[lender].tasks.top();
+            lanes[lender].tasks.pop();
+            own.borrowed++;
+            *borrowed = true;
+            break;
+        }
+        own.idle++;
+        scond_wait(&own.cond, &mutex);
+        own.idle--;
+    }
+
+    if (entry.rank < NUM_TASK_PRIORITIES)
+    {
+        double now = sutil_now();
+        PriorityStats& counts = stats[entry.rank];
+        counts.waits.record(now - entry.enqueued);
+        if (entry.deadline != HUGE_VAL)
+        {
+            counts.deadlines++;
+            counts.missed += now > entry.deadline ? 1 : 0;
+        }
+    }
+    smutex_unlock(&mutex);
+    return entry.task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * report --
+ *
+ *      Print, for each priority, how long its tasks waited to
+ *      start and how many missed their deadline, then how many
+ *      tasks each lane's workers borrowed.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void PriorityScheduler::
+report(FILE* out, const char* const* laneNames)
+{
+    smutex_lock(&mutex);
+    fprintf(out, "priority scheduler: waits to start, in ms\n");
+    for (int p = 0; p < NUM_TASK_PRIORITIES; p++)
+    {
+        const PriorityStats& s = stats[p];
+        fprintf(out, "  %-9s %7ld tasks  mean %8.3f  p50 %8.3f  p99 %8.3f  max %8.3f",
+                task_priority_name((TaskPriority)p), s.waits.total, 1e3 * s.waits.mean(),
+                1e3 * s.waits.percentile(0.5), 1e3 * s.waits.percentile(0.99), 1e3 * s.waits.max);
+        if (s.deadlines > 0)
+        {
+            fprintf(out, "  %ld of %ld deadlines missed", s.missed, s.deadlines);
+        }
+        fprintf(out, "\n");
+    }
+    for (size_t i = 0; i < lanes.size(); i++)
+    {
+        fprintf(out, "  %s lane: %s, %ld tasks borrowed\n", laneNames[i],
+                lanes[i].borrows ? "borrows when idle" : "does not borrow", lanes[i].borrowed);
+    }
+    smutex_unlock(&mutex);
+}
+
+
+PriorityPool::
+PriorityPool(const char* poolName, PriorityScheduler* sharedScheduler, int schedulerLane,
+             int workers)
+    : name(poolName), scheduler(sharedScheduler), lane(schedulerLane), numWorkers(workers),
+      nextWorker(0), running(false)
+{
+    assert(numWorkers > 0 && lane >= 0 && lane < scheduler->size());
+    threads = new sthread_t[numWorkers];
+    stats = new WorkerStats[numWorkers]();
+    smutex_init(&lock);
+}
+
+PriorityPool::
+~PriorityPool()
+{
+    assert(!running);
+    smutex_destroy(&lock);
+    delete[] threads;
+    delete[] stats;
+}
+
+void* PriorityPool::
+workerMain(void* arg)
+{
+    PriorityPool* pool = (PriorityPool*)arg;
+
+    smutex_lock(&pool->lock);
+    int worker = pool->nextWorker++;
+    smutex_unlock(&pool->lock);
+
+    sthread_pin(pool->cpuOf(worker));
+    pool->work(worker);
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * work --
+ *
+ *      The loop of one worker: run what the scheduler hands it
+ *      until it is handed a stop task.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void PriorityPool::
+work(int worker)
+{
+    WorkerStats& mine = stats[worker];
+    mine.started = sutil_now();
+    for (;;)
+    {
+        bool borrowed;
+        Task task = scheduler->take(lane, &borrowed);
+        if (task_is_stop(task))
+        {
+            run_task(task);
+            break;
+        }
+        double begin = sutil_now();
+        run_task(task);
+        mine.busySeconds += sutil_now() - begin;
+        mine.tasks++;
+        mine.stolen += borrowed ? 1 : 0;
+    }
+    mine.stopped = sutil_now();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * start --
+ *
+ *      Create the worker threads.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void PriorityPool::
+start()
+{
+    assert(!running);
+    running = true;
+    for (int i = 0; i < numWorkers; i++)
+    {
+        sthread_create(&threads[i], workerMain, this);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * join --
+ *
+ *      Wait until every worker has run its stop task and exited.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void PriorityPool::
+join()
+{
+    assert(running);
+    for (int i = 0; i < numWorkers; i++)
+    {
+        sthread_join(threads[i]);
+    }
+    running = false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * report --
+ *
+ *      Print the pool's per-worker throughput and borrowed tasks
+ *      (see report_workers). Must be called after join.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void PriorityPool::
+report(FILE* out) const
+{
+    assert(!running);
+    report_workers(out, name, stats, numWorkers, true);
+}
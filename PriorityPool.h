@@ -0,0 +1,140 @@
+#pragma once
+
+#include "Executor.h"
+#include "TaskQueue.h"
+#include "sthread.h"
+#include <cstdio>
+#include <queue>
+#include <vector>
+
+// a task waiting in a PriorityScheduler lane
+struct ScheduledTask {
+    int rank;               // task.priority; stop tasks rank after every priority
+    double deadline;        // task.deadline, or HUGE_VAL for none
+    unsigned long seq;      // enqueue order, to keep FIFO among equals
+    double enqueued;        // sutil_now when enqueued
+    Task task;
+};
+
+// orders a lane's heap so that its top is the task to run next
+struct RunsLater {
+    bool operator()(const ScheduledTask& a, const ScheduledTask& b) const
+    {
+        if (a.rank != b.rank)
+            return a.rank > b.rank;
+        if (a.deadline != b.deadline)
+            return a.deadline > b.deadline;
+        return a.seq > b.seq;
+    }
+};
+
+// one pool's tasks, and its workers waiting for one
+struct SchedulerLane {
+    std::priority_queue<ScheduledTask, std::vector<ScheduledTask>, RunsLater> tasks;
+    scond_t cond;
+    int idle;               // workers blocked in cond
+    bool borrows;           // idle workers may take other lanes' tasks
+    long borrowed;          // tasks taken from other lanes
+};
+
+// how long the tasks of one priority waited to start
+struct PriorityStats {
+    LatencyHistogram waits;
+    long deadlines;         // tasks that had a deadline
+    long missed;            // of those, tasks that started after it
+};
+
+/*
+ * ------------------------------------------------------------------
+ * PriorityScheduler --
+ *
+ *      The queues of several pools (see PriorityPool) behind one
+ *      lock, one lane per pool. A lane runs its tasks by priority
+ *      class (see TaskPriority), then earliest deadline first,
+ *      then in the order they were enqueued; tasks without a
+ *      deadline come after those with one in the same class.
+ *
+ *      A worker takes the next task of its own lane. If its lane
+ *      has none and it is allowed to borrow, it takes the best next
+ *      task of the other lanes instead, ordered the same way, so an
+ *      idle customer worker can run a restock that would otherwise
+ *      wait behind busy suppliers. Only idle workers borrow: a
+ *      coarse mode purchase can block its worker for a long time,
+ *      and a pool should not lose workers to it while its own work
+ *      is queued.
+ *
+ *      Stop tasks rank after everything, so a lane drains before
+ *      its workers exit, and they are never borrowed.
+ *
+ * ------------------------------------------------------------------
+ */
+class PriorityScheduler {
+    private:
+    smutex_t mutex;
+    std::vector<SchedulerLane> lanes;
+    unsigned long nextSeq;
+    PriorityStats stats[NUM_TASK_PRIORITIES];
+
+    void push(int lane, const Task& task, double now);
+    void wake(int lane, int count);
+    int pickLender(int lane);
+
+    public:
+    explicit PriorityScheduler(int numLanes);
+    ~PriorityScheduler();
+
+    PriorityScheduler(const PriorityScheduler&) = delete;
+    PriorityScheduler& operator=(const PriorityScheduler &) = delete;
+
+    void setBorrowing(int lane, bool borrows);
+    void enqueue(int lane, const Task& task);
+    void enqueueBatch(int lane, std::span<const Task> tasks);
+    Task take(int lane, bool* borrowed);
+
+    int size() const { return (int)lanes.size(); }
+    void report(FILE* out, const char* const* laneNames);
+};
+
+/*
+ * ------------------------------------------------------------------
+ * PriorityPool --
+ *
+ *      An executor whose workers serve one lane of a
+ *      PriorityScheduler, which may be shared with other pools.
+ *      Tasks enqueued to the pool go to that lane. A worker exits
+ *      on the first stop task it takes; tasks it borrowed from
+ *      other lanes are counted as stolen in its report.
+ *
+ * ------------------------------------------------------------------
+ */
+class PriorityPool final : public Executor {
+    private:
+    const char* name;
+    PriorityScheduler* scheduler;
+    int lane;
+    int numWorkers;
+    sthread_t* threads;
+    WorkerStats* stats;
+    int nextWorker;
+    smutex_t lock;
+    bool running;
+
+    static void* workerMain(void* arg);
+    void work(int worker);
+
+    public:
+    PriorityPool(const char* poolName, PriorityScheduler* sharedScheduler, int schedulerLane,
+                 int workers);
+    ~PriorityPool();
+
+    PriorityPool(const PriorityPool&) = delete;
+    PriorityPool& operator=(const PriorityPool &) = delete;
+
+    void enqueue(Task task) override { scheduler->enqueue(lane, task); }
+    void enqueueBatch(std::span<const Task> tasks) override { scheduler->enqueueBatch(lane, tasks); }
+    void start() override;
+    void join() override;
+
+    int size() const override { return numWorkers; }
+    void report(FILE* out) const override;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * ------------------------------------------------------------------
+ * Random --
+ *
+ *      A xoshiro256** generator (Blackman and Vigna): 32 bytes of
+ *      state, a few shifts and multiplies per number, and no
+ *      locking, so each thread that draws numbers should own one.
+ *      A (seed, stream) pair always yields the same sequence, and
+ *      different streams of one seed are independent for any
+ *      practical purpose, so a run made of several generators can
+ *      be repeated exactly from its seed.
+ *
+ * ------------------------------------------------------------------
+ */
+class Random {
+    private:
+    uint64_t state[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    // the splitmix64 step, which spreads a seed over the state
+    static uint64_t
+    splitmix(uint64_t* x)
+    {
+        uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    public:
+    explicit Random(uint64_t seed = 1, uint64_t stream = 0) { reseed(seed, stream); }
+
+    void
+    reseed(uint64_t seed, uint64_t stream = 0)
+    {
+        uint64_t x = seed;
+        uint64_t mixed = stream;
+        x ^= splitmix(&mixed);
+        for (int i = 0; i < 4; i++)
+        {
+            state[i] = splitmix(&x);
+        }
+    }
+
+    uint64_t
+    next()
+    {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    // uniform in [0, bound), by Lemire's multiply-shift; bound > 0
+    uint32_t
+    below(uint32_t bound)
+    {
+        uint64_t product = (next() >> 32) * bound;
+        uint32_t low = (uint32_t)product;
+        if (low < bound)
+        {
+            uint32_t threshold = -bound % bound;
+            while (low < threshold)
+            {
+                product = (next() >> 32) * bound;
+                low = (uint32_t)product;
+            }
+        }
+        return (uint32_t)(product >> 32);
+    }
+
+    // uniform in [0, 1), with 53 random bits
+    double unit() { return (next() >> 11) * 0x1.0p-53; }
+};
@@ -1,10 +1,18 @@
 #pragma once
 
-#include <vector>
+#include <cassert>
+#include <cstddef>
+#include <span>
 
-#define INVENTORY_SIZE    100
+#define DEFAULT_INVENTORY_SIZE 100
+#define DEFAULT_NUM_SHARDS     4
+#define DEFAULT_LOCK_STRIPES   64
 
 #define MAX_BUY_ITEM      8
+#define MAX_SUPPLIER_BATCH 64
+#define MAX_CART_QUANTITY 3
+#define CHECKOUT_TTL      1.0
+#define CUSTOMER_TIMEOUT  2.0
 #define MAX_QUANTITY      100
 #define MAX_BUDGET        3000000
 #define MIN_BUDGET        5000
@@ -12,6 +20,20 @@
 #define MAX_SHIPPING_COST 10000
 
 class EStore;
+class TaskSink;
+
+// what a purchase does when it cannot complete right away
+enum PurchasePolicy {
+    PURCHASE_FAIL_FAST = 0,     // give up
+    PURCHASE_BLOCK,             // wait until it can complete
+    PURCHASE_DEADLINE           // wait, but no later than a deadline
+};
+
+enum PurchaseResult {
+    PURCHASE_OK = 0,
+    PURCHASE_REJECTED,          // not carried, or could not complete and did not wait
+    PURCHASE_TIMED_OUT          // the deadline passed while waiting
+};
 
 enum SupplierRequestTypes {
     ADD_ITEM = 0,
@@ -72,17 +94,169 @@ struct SetStoreDiscountReq {
     double new_discount;
 };
 
+/*
+ * One row of a supplier batch. item_id is ignored by the store-wide
+ * types; quantity is the stock for ADD_ITEM and the count for
+ * ADD_STOCK; price is the price for ADD_ITEM and CHANGE_ITEM_PRICE
+ * and the cost for SET_SHIPPING_COST; discount is the discount for
+ * ADD_ITEM, CHANGE_ITEM_DISCOUNT and SET_STORE_DISCOUNT.
+ */
+struct SupplierMutation {
+    SupplierRequestTypes type;
+
+    int item_id;
+    int quantity;
+    double price;
+    double discount;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * SupplierMutations --
+ *
+ *      The rows of a supplier batch, held inline like CartLines. A
+ *      batch has at most MAX_SUPPLIER_BATCH rows, so a batch request
+ *      is one pooled object with no vector of its own to allocate.
+ *      Converts to the span of rows applyBatch takes.
+ *
+ * ------------------------------------------------------------------
+ */
+class SupplierMutations {
+    private:
+    SupplierMutation rows[MAX_SUPPLIER_BATCH];
+    size_t count = 0;
+
+    public:
+    void push_back(const SupplierMutation& row)
+    {
+        assert(count < MAX_SUPPLIER_BATCH);
+        rows[count++] = row;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    SupplierMutation& back() { return rows[count - 1]; }
+    SupplierMutation& operator[](size_t i) { return rows[i]; }
+    const SupplierMutation& operator[](size_t i) const { return rows[i]; }
+    const SupplierMutation* begin() const { return rows; }
+    const SupplierMutation* end() const { return rows + count; }
+
+    operator std::span<const SupplierMutation>() const
+    {
+        return std::span<const SupplierMutation>(rows, count);
+    }
+};
+
+struct SupplierBatchReq {
+    EStore* store;
+
+    SupplierMutations mutations;
+};
+
+/*
+ * timeout is in seconds from when the request is handled, and only
+ * used with PURCHASE_DEADLINE. resumer is only used by
+ * buy_item_async_handler (see EStore::buyItemAsync).
+ */
 struct BuyItemReq {
     EStore* store;
 
     int item_id;
+    PurchasePolicy policy;
     double budget;
+    double timeout;
+    TaskSink* resumer;
+};
+
+// quantity units of one item in a cart
+struct CartLine {
+    int item_id;
+    int quantity;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * CartLines --
+ *
+ *      The lines of a cart, held inline. A generated cart has at
+ *      most MAX_BUY_ITEM lines, so a cart request is one object
+ *      with no vector of its own to allocate. Converts to the span
+ *      of lines the store takes.
+ *
+ * ------------------------------------------------------------------
+ */
+class CartLines {
+    private:
+    CartLine lines[MAX_BUY_ITEM];
+    size_t count = 0;
+
+    public:
+    void push_back(const CartLine& line)
+    {
+        assert(count < MAX_BUY_ITEM);
+        lines[count++] = line;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    CartLine& operator[](size_t i) { return lines[i]; }
+    const CartLine& operator[](size_t i) const { return lines[i]; }
+    const CartLine* begin() const { return lines; }
+    const CartLine* end() const { return lines + count; }
+
+    operator std::span<const CartLine>() const { return std::span<const CartLine>(lines, count); }
 };
 
 struct BuyManyItemsReq {
     EStore* store;
 
-    std::vector<int> item_ids;
+    CartLines lines;
+    double budget;
+    PurchasePolicy policy;
+    double timeout;
+};
+
+/*
+ * Reserve the cart, spend payment_time seconds paying, then commit
+ * the reservation if paid, or abort it. The payment holds no
+ * worker: the store settles the reservation when it is over. A
+ * payment that takes longer than ttl finds the reservation expired.
+ */
+struct CheckoutReq {
+    EStore* store;
+
+    CartLines lines;
     double budget;
+    double ttl;
+    double payment_time;
+    bool paid;
 };
 
+/*
+ * ------------------------------------------------------------------
+ * RequestType --
+ *
+ *      What a Task carries (see TaskPayload), and so which handler
+ *      runs it. REQ_CALL is a plain function call, the form of stop
+ *      tasks, coroutine resumes and benchmark tasks; every other
+ *      type is one of the requests above. A BuyItemReq with a
+ *      resumer is REQ_BUY_ITEM_ASYNC.
+ *
+ * ------------------------------------------------------------------
+ */
+enum RequestType {
+    REQ_CALL = 0,
+    REQ_ADD_ITEM,
+    REQ_REMOVE_ITEM,
+    REQ_ADD_STOCK,
+    REQ_CHANGE_ITEM_PRICE,
+    REQ_CHANGE_ITEM_DISCOUNT,
+    REQ_SET_SHIPPING_COST,
+    REQ_SET_STORE_DISCOUNT,
+    REQ_SUPPLIER_BATCH,
+    REQ_BUY_ITEM,
+    REQ_BUY_ITEM_ASYNC,
+    REQ_BUY_MANY_ITEMS,
+    REQ_CHECKOUT,
+    NUM_REQUEST_TYPES
+};
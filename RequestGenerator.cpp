@@ -1,62 +1,202 @@
+#include <algorithm>
 #include <iostream>
 #include <cstdlib>
 #include <cassert>
-#include <set>
+#include <cmath>
+#include <cstring>
+#include <vector>
 
 #include "RequestHandlers.h"
 #include "RequestGenerator.h"
+#include "SlabPool.h"
 
 using namespace std;
 
 static int
-rand_id()
+rand_id(Random& rng, EStore* store)
 {
-    return sutil_random() % INVENTORY_SIZE;
+    return rng.below(store->inventorySize());
 }
 
+// a random id among those of owner, out of "owners" (item_id % owners == owner)
 static int
-rand_quantity()
+rand_owned_id(Random& rng, EStore* store, int owner, int owners)
 {
-    return (sutil_random() % MAX_QUANTITY) + 1;
+    int count = (store->inventorySize() - owner + owners - 1) / owners;
+    return owner + owners * rng.below(count);
+}
+
+static int
+rand_quantity(Random& rng)
+{
+    return rng.below(MAX_QUANTITY) + 1;
 }
 
 static double
-rand_price(int max_price_cents)
+rand_price(Random& rng, int max_price_cents)
 {
-    return (sutil_random() % max_price_cents) / 100.0;
+    return rng.below(max_price_cents) / 100.0;
 }
 
 static double
-rand_discount()
+rand_discount(Random& rng)
 {
-    return ((double) sutil_random() / RAND_MAX);
+    return rng.unit();
 }
 
 static int
-rand_request()
+rand_request(Random& rng)
+{
+    return rng.below(NUM_SUPPLIER_REQUEST_TYPES);
+}
+
+// a gap of an exponential distribution with the given mean
+static double
+rand_exponential(Random& rng, double mean)
+{
+    return -log(1.0 - rng.unit()) * mean;
+}
+
+static const char* arrivalNames[NUM_ARRIVAL_PROCESSES] = {
+    "constant", "poisson", "onoff", "unthrottled"
+};
+
+const char*
+arrival_process_name(ArrivalProcess process)
+{
+    assert(process >= 0 && process < NUM_ARRIVAL_PROCESSES);
+    return arrivalNames[process];
+}
+
+bool
+arrival_process_parse(const char* name, ArrivalProcess* process)
 {
-    return sutil_random() % NUM_SUPPLIER_REQUEST_TYPES;
+    for (int i = 0; i < NUM_ARRIVAL_PROCESSES; i++)
+    {
+        if (strcmp(name, arrivalNames[i]) == 0)
+        {
+            *process = (ArrivalProcess)i;
+            return true;
+        }
+    }
+    return false;
 }
 
 RequestGenerator::
-RequestGenerator(TaskQueue* queue)
-    : taskQueue(queue), taskCount(0)
+RequestGenerator(TaskSink* sink)
+    : taskSink(sink), taskDeadline(0), load(), taskCount(0)
 { }
 
 RequestGenerator::
 ~RequestGenerator()
 { }
 
+/*
+ * ------------------------------------------------------------------
+ * nextArrival --
+ *
+ *      Schedule the arrival after the one due at "previous", as the
+ *      profile's arrival process spaces them. On/off arrivals are
+ *      spaced on a clock that only runs during on periods, so a gap
+ *      that outlasts an on period carries over into the next.
+ *
+ * Results:
+ *      The sutil_now time the next arrival is due.
+ *
+ * ------------------------------------------------------------------
+ */
+double RequestGenerator::
+nextArrival(const LoadProfile& profile, double previous)
+{
+    double gap = profile.burst / profile.rate;
+    switch (profile.process)
+    {
+        case ARRIVAL_CONSTANT:
+            return previous + gap;
+        case ARRIVAL_POISSON:
+            return previous + rand_exponential(rng, gap);
+        case ARRIVAL_ONOFF:
+        {
+            double period = profile.onTime + profile.offTime;
+            double elapsed = previous - profile.start;
+            double periods = floor(elapsed / period);
+            double onClock = periods * profile.onTime
+                + min(elapsed - periods * period, profile.onTime);
+            onClock += rand_exponential(rng, gap * profile.onTime / period);
+            periods = floor(onClock / profile.onTime);
+            return profile.start + periods * period + (onClock - periods * profile.onTime);
+        }
+        default:
+            return previous;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueTasks --
+ *
+ *      Generate maxTasks requests (forever if negative) and offer
+ *      them to the sink as the profile says: each arrival's burst
+ *      is generated ahead of time, then handed over with one
+ *      enqueueBatch once it is due. Arrivals are due at times fixed
+ *      from the start of the schedule, so if the sink makes the
+ *      generator late it catches up rather than slowing down; how
+ *      late it was is kept in loadStats. With a deadline set (see
+ *      setDeadline), each request is due to start that many seconds
+ *      after its arrival was due.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
 void RequestGenerator::
-enqueueTasks(int maxTasks, EStore* store)
+enqueueTasks(int maxTasks, EStore* store, const LoadProfile& profile)
 {
+    assert(profile.burst > 0);
+    assert(profile.process == ARRIVAL_UNTHROTTLED || profile.rate > 0);
+    assert(profile.process != ARRIVAL_ONOFF || (profile.onTime > 0 && profile.offTime >= 0));
+    bool throttled = profile.process != ARRIVAL_UNTHROTTLED;
+    LoadProfile schedule = profile;
+    if (schedule.start == 0)
+    {
+        schedule.start = sutil_now();
+    }
+
+    std::vector<Task> tasks;
+    tasks.reserve(profile.burst);
     taskCount = 0;
+    load = LoadStats();
+    double due = schedule.start;
     while (taskCount < maxTasks || maxTasks < 0)
     {
-        taskQueue->enqueue(generateTask(store));
-        taskCount++;
-        sthread_sleep(0, 100000000);
+        tasks.clear();
+        while ((int)tasks.size() < profile.burst && (taskCount < maxTasks || maxTasks < 0))
+        {
+            tasks.push_back(generateTask(store));
+            taskCount++;
+        }
+        if (throttled)
+        {
+            sthread_sleep_until(due);
+        }
+        double now = sutil_now();
+        double arrival = throttled ? due : now;
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            tasks[i].deadline = taskDeadline > 0 ? arrival + taskDeadline : 0;
+        }
+        taskSink->enqueueBatch(tasks);
+
+        double lag = now - arrival;
+        load.requests += tasks.size();
+        load.arrivals++;
+        load.lagTotal += lag;
+        load.lagMax = max(load.lagMax, lag);
+        due = nextArrival(schedule, due);
     }
+    // a throttled schedule lasts until the arrival after its last
+    load.elapsed = (throttled ? max(due, sutil_now()) : sutil_now()) - schedule.start;
 }
 
 /*
@@ -64,7 +204,7 @@ enqueueTasks(int maxTasks, EStore* store)
  * enqueueStops --
  *
  *      Enqueue "num" stop requests (i.e. one per worker thread) into
- *      the task queue associated with this request generator.
+ *      the task sink associated with this request generator.
  *
  *      Hint: Use the stop_handler function declared in
  *      RequestHandlers.h in conjunction with the task queue to
@@ -79,18 +219,75 @@ void RequestGenerator::
 enqueueStops(int num)
 {
     // enqueue num amount of thread stopper tasks and initialize their handlers
-    for (int i = 0; i < num; i++)
-    {
-        Task stopReq;
-        stopReq.handler = stop_handler;
-        taskQueue->enqueue(stopReq);
-    }
+    Task stopReq = call_task(stop_handler, NULL);
+    stopReq.kind = TASK_CONTROL;
+    std::vector<Task> stops(num, stopReq);
+    taskSink->enqueueBatch(stops);
 }
 
 SupplierRequestGenerator::
-SupplierRequestGenerator(TaskQueue* queue)
-    : RequestGenerator(queue)
-{ }
+SupplierRequestGenerator(TaskSink* sink, int mutationsPerTask, int owners)
+    : RequestGenerator(sink), batchSize(mutationsPerTask), itemOwners(owners)
+{
+    // a batch request holds its rows inline
+    assert(batchSize <= MAX_SUPPLIER_BATCH);
+    assert(itemOwners >= 0);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * generateMutation --
+ *
+ *      Build one random batch row of the given request type. If
+ *      owner is not -1, the row's item is one of that owner's.
+ *
+ * Results:
+ *      The SupplierMutation.
+ *
+ * ------------------------------------------------------------------
+ */
+SupplierMutation SupplierRequestGenerator::
+generateMutation(EStore* store, int request_type, int owner)
+{
+    SupplierMutation mutation = SupplierMutation();
+    mutation.type = (SupplierRequestTypes)request_type;
+    int item_id = owner < 0 ? rand_id(rng, store) : rand_owned_id(rng, store, owner, itemOwners);
+
+    switch (request_type)
+    {
+        case ADD_ITEM:
+            mutation.item_id  = item_id;
+            mutation.price    = rand_price(rng, MAX_PRICE) + 1;
+            mutation.quantity = rand_quantity(rng);
+            break;
+        case REMOVE_ITEM:
+            mutation.item_id = item_id;
+            break;
+        case ADD_STOCK:
+            mutation.item_id  = item_id;
+            mutation.quantity = rand_quantity(rng);
+            break;
+        case CHANGE_ITEM_PRICE:
+            mutation.item_id = item_id;
+            mutation.price   = rand_price(rng, MAX_PRICE);
+            break;
+        case CHANGE_ITEM_DISCOUNT:
+            mutation.item_id  = item_id;
+            mutation.discount = rand_discount(rng);
+            break;
+        case SET_SHIPPING_COST:
+            mutation.price = rand_price(rng, MAX_SHIPPING_COST);
+            break;
+        case SET_STORE_DISCOUNT:
+            mutation.discount = rand_discount(rng);
+            break;
+        default:
+            cerr << "Request type is undefined. Can not generate this type of requests." << endl;
+            assert(false);
+            break;
+    }
+    return mutation;
+}
 
 Task SupplierRequestGenerator::
 generateTask(EStore* store)
@@ -104,83 +301,116 @@ generateTask(EStore* store)
     if (taskCount < 30)
         request_type = ADD_ITEM;
     else
-        request_type = rand_request();
+        request_type = rand_request(rng);
+
+    // a batch task carries batchSize rows, all adds while the store fills
+    if (batchSize > 1)
+    {
+        // with owners, all of a batch's items belong to one of them
+        int owner = -1;
+        if (itemOwners > 0)
+        {
+            owner = rng.below(min(itemOwners, store->inventorySize()));
+        }
+        auto req = pool_new<SupplierBatchReq>();
+        req->store = store;
+        bool unblocks = false;
+        for (int i = 0; i < batchSize; i++)
+        {
+            int row_type = taskCount < 30 ? ADD_ITEM : rand_request(rng);
+            req->mutations.push_back(generateMutation(store, row_type, owner));
+            unblocks = unblocks || store->mayUnblock(req->mutations.back());
+        }
+
+        task = request_task(req);
+        task.kind = TASK_SUPPLIER;
+        task.affinity = owner;
+        if (unblocks)
+            task.priority = PRIORITY_UNBLOCK;
+        return task;
+    }
 
     switch (request_type)
     {
         case ADD_ITEM:
         {
-            auto req = new AddItemReq();
-            req->store    = store;
-            req->item_id  = rand_id();
-            req->price    = rand_price(MAX_PRICE) + 1;
-            req->quantity = rand_quantity();
-
-            task.handler = add_item_handler;
-            task.arg     = req;
+            AddItemReq req = AddItemReq();
+            req.store    = store;
+            req.item_id  = rand_id(rng, store);
+            req.price    = rand_price(rng, MAX_PRICE) + 1;
+            req.quantity = rand_quantity(rng);
+
+            task = request_task(req);
+            task.affinity = req.item_id;
+            task.priority = PRIORITY_UNBLOCK;
             break;
         }
         case REMOVE_ITEM:
         {
-            auto req = new RemoveItemReq();
-            req->store   = store;
-            req->item_id = rand_id();
+            RemoveItemReq req = RemoveItemReq();
+            req.store   = store;
+            req.item_id = rand_id(rng, store);
 
-            task.handler = remove_item_handler;
-            task.arg     = req;
+            task = request_task(req);
+            task.affinity = req.item_id;
             break;
         }
         case ADD_STOCK:
         {
-            auto req = new AddStockReq();
-            req->store            = store;
-            req->item_id          = rand_id();
-            req->additional_stock = rand_quantity();
-
-            task.handler = add_stock_handler;
-            task.arg     = req;
+            AddStockReq req = AddStockReq();
+            req.store            = store;
+            req.item_id          = rand_id(rng, store);
+            req.additional_stock = rand_quantity(rng);
+
+            task = request_task(req);
+            task.affinity = req.item_id;
+            task.priority = PRIORITY_UNBLOCK;
             break;
         }
         case CHANGE_ITEM_PRICE:
         {
-            auto req = new ChangeItemPriceReq();
-            req->store = store;
-            req->item_id   = rand_id();
-            req->new_price = rand_price(MAX_PRICE);
-
-            task.handler = change_item_price_handler;
-            task.arg     = req;
+            ChangeItemPriceReq req = ChangeItemPriceReq();
+            req.store = store;
+            req.item_id   = rand_id(rng, store);
+            req.new_price = rand_price(rng, MAX_PRICE);
+
+            task = request_task(req);
+            task.affinity = req.item_id;
+            SupplierMutation change = { CHANGE_ITEM_PRICE, req.item_id, 0, req.new_price, 0 };
+            if (store->mayUnblock(change))
+                task.priority = PRIORITY_UNBLOCK;
             break;
         }
         case CHANGE_ITEM_DISCOUNT:
         {
-            auto req = new ChangeItemDiscountReq();
-            req->store = store;
-            req->item_id      = rand_id();
-            req->new_discount = rand_discount();
-
-            task.handler = change_item_discount_handler;
-            task.arg     = req;
+            ChangeItemDiscountReq req = ChangeItemDiscountReq();
+            req.store = store;
+            req.item_id      = rand_id(rng, store);
+            req.new_discount = rand_discount(rng);
+
+            task = request_task(req);
+            task.affinity = req.item_id;
+            SupplierMutation change = { CHANGE_ITEM_DISCOUNT, req.item_id, 0, 0, req.new_discount };
+            if (store->mayUnblock(change))
+                task.priority = PRIORITY_UNBLOCK;
             break;
         }
         case SET_SHIPPING_COST:
         {
-            auto req = new SetShippingCostReq();
-            req->store    = store;
-            req->new_cost = rand_price(MAX_SHIPPING_COST);
+            SetShippingCostReq req = SetShippingCostReq();
+            req.store    = store;
+            req.new_cost = rand_price(rng, MAX_SHIPPING_COST);
 
-            task.handler = set_shipping_cost_handler;
-            task.arg     = req;
+            task = request_task(req);
             break;
         }
         case SET_STORE_DISCOUNT:
         {
-            auto req = new SetStoreDiscountReq();
-            req->store        = store;
-            req->new_discount = rand_discount();
+            SetStoreDiscountReq req = SetStoreDiscountReq();
+            req.store        = store;
+            req.new_discount = rand_discount(rng);
 
-            task.handler = set_store_discount_handler;
-            task.arg     = req;
+            task = request_task(req);
             break;
         }
         default:
@@ -191,13 +421,18 @@ generateTask(EStore* store)
         }
     } // !switch
 
+    task.kind = TASK_SUPPLIER;
     return task;
 }
 
 CustomerRequestGenerator::
-CustomerRequestGenerator(TaskQueue* queue, bool inFineMode)
-    : RequestGenerator(queue), fineMode(inFineMode)
-{ }
+CustomerRequestGenerator(TaskSink* sink, bool inFineMode, bool coroutines)
+    : RequestGenerator(sink), fineMode(inFineMode), waiting(false),
+      resumer(coroutines ? sink : NULL)
+{
+    // only coarse mode single-item purchases run as coroutines
+    assert(!(fineMode && coroutines));
+}
 
 Task CustomerRequestGenerator::
 generateTask(EStore* store)
@@ -206,31 +441,78 @@ generateTask(EStore* store)
 
     if (!fineMode)
     {
-        auto req = new BuyItemReq();
-        req->store   = store;
-        req->item_id = rand_id();
-        req->budget  = rand_price(MAX_BUDGET) + MIN_BUDGET;
-
-        task.handler = buy_item_handler;
-        task.arg     = req;
+        BuyItemReq req = BuyItemReq();
+        req.store   = store;
+        req.item_id = rand_id(rng, store);
+        req.budget  = rand_price(rng, MAX_BUDGET) + MIN_BUDGET;
+        // a waiting buyer never blocks for good, so a worker cannot be lost to one request
+        req.policy  = waiting ? PURCHASE_DEADLINE : PURCHASE_FAIL_FAST;
+        req.timeout = CUSTOMER_TIMEOUT;
+        // waiting buyers suspend and are resumed on the same sink
+        req.resumer = resumer;
+
+        task = request_task(req);
+        task.affinity = req.item_id;
     }
     else
     {
-        auto req = new BuyManyItemsReq();
-
-        int num_buy_item = (sutil_random() % MAX_BUY_ITEM) + 1;
+        int num_buy_item = rng.below(MAX_BUY_ITEM) + 1;
 
-        set<int> order;
+        // distinct ids in ascending order, by insertion into a small array
+        int order[MAX_BUY_ITEM];
+        int distinct = 0;
         for (int i = 0; i < num_buy_item; i++)
-            order.insert(rand_id());
+        {
+            int id = rand_id(rng, store);
+            int at = 0;
+            while (at < distinct && order[at] < id)
+                at++;
+            if (at < distinct && order[at] == id)
+                continue;
+            for (int j = distinct; j > at; j--)
+                order[j] = order[j - 1];
+            order[at] = id;
+            distinct++;
+        }
+
+        CartLines lines;
+        for (int i = 0; i < distinct; i++)
+        {
+            CartLine line = { order[i], (int)rng.below(MAX_CART_QUANTITY) + 1 };
+            lines.push_back(line);
+        }
+        double budget = rand_price(rng, MAX_BUDGET) + MIN_BUDGET;
 
-        req->store  = store;
-        req->item_ids.insert(req->item_ids.begin(), order.begin(), order.end());
-        req->budget = rand_price(MAX_BUDGET) + MIN_BUDGET;;
+        // one customer in four goes through a checkout that pays later
+        if (rng.below(4) == 0)
+        {
+            auto req = pool_new<CheckoutReq>();
+            req->store        = store;
+            req->lines        = lines;
+            req->budget       = budget;
+            req->ttl          = CHECKOUT_TTL;
+            req->payment_time = rand_price(rng, 150);
+            req->paid         = rng.below(10) != 0;
 
-        task.handler = buy_many_items_handler;
-        task.arg     = req;
+            task = request_task(req);
+        }
+        else
+        {
+            auto req = pool_new<BuyManyItemsReq>();
+            req->store  = store;
+            req->lines  = lines;
+            req->budget = budget;
+            // when waiting, half the customers wait a while for a cart they cannot buy yet
+            req->policy  = waiting && rng.below(2) ? PURCHASE_DEADLINE : PURCHASE_FAIL_FAST;
+            req->timeout = CUSTOMER_TIMEOUT;
+
+            task = request_task(req);
+        }
+        // a cart runs on the shard of its lowest item
+        task.affinity = lines[0].item_id;
     }
+    task.kind = TASK_CUSTOMER;
+    task.priority = PRIORITY_PURCHASE;
     return task;
 }
 
@@ -2,41 +2,114 @@
 
 #include "EStore.h"
 #include "TaskQueue.h"
+#include "Random.h"
 #include "Request.h"
 
+// how a generator spaces its arrivals (see LoadProfile)
+enum ArrivalProcess {
+    ARRIVAL_CONSTANT = 0,       // evenly spaced
+    ARRIVAL_POISSON,            // exponentially distributed gaps
+    ARRIVAL_ONOFF,              // Poisson during on periods, none during off periods
+    ARRIVAL_UNTHROTTLED,        // as fast as the sink takes them
+    NUM_ARRIVAL_PROCESSES
+};
+
+const char* arrival_process_name(ArrivalProcess process);
+bool arrival_process_parse(const char* name, ArrivalProcess* process);
+
+/*
+ * ------------------------------------------------------------------
+ * LoadProfile --
+ *
+ *      The load a generator offers: arrivals of "burst" requests
+ *      each, spaced by the arrival process so that requests come at
+ *      "rate" a second on average. Arrivals are scheduled open loop
+ *      from "start": each is due at a time fixed in advance, not
+ *      relative to when the one before was enqueued, so a slow
+ *      enqueue delays later arrivals without lowering the rate.
+ *
+ *      With ARRIVAL_ONOFF, on periods of onTime seconds alternate
+ *      with off periods of offTime, starting with an on period; the
+ *      rate during on periods is raised so the average stays at
+ *      rate.
+ *
+ * ------------------------------------------------------------------
+ */
+struct LoadProfile {
+    ArrivalProcess process;
+    double rate;                // requests per second; unused when unthrottled
+    int burst;                  // requests per arrival, enqueued together
+    double onTime;
+    double offTime;
+    double start;               // sutil_now time of the schedule's start; 0 for now
+
+    LoadProfile()
+        : process(ARRIVAL_CONSTANT), rate(10), burst(1), onTime(1), offTime(1), start(0)
+    { }
+};
+
+// how closely a generator kept to its LoadProfile
+struct LoadStats {
+    long requests;
+    long arrivals;
+    double elapsed;             // seconds from the start to the last enqueue
+    double lagTotal;            // seconds arrivals were enqueued after they were due
+    double lagMax;
+};
+
 class RequestGenerator {
     private:
-    TaskQueue* taskQueue;
+    TaskSink* taskSink;
+    double taskDeadline;
+    LoadStats load;
+
+    double nextArrival(const LoadProfile& profile, double previous);
 
     protected:
     int taskCount;
+    Random rng;                 // this generator's own; see setSeed
 
     virtual Task generateTask(EStore* store) = 0;
 
     public:
-    RequestGenerator(TaskQueue* queue);
+    RequestGenerator(TaskSink* sink);
     virtual ~RequestGenerator();
 
-    void enqueueTasks(int maxTasks, EStore* store);
+    void setDeadline(double seconds) { taskDeadline = seconds; }
+    // generators given the same seed but different streams draw independent requests
+    void setSeed(uint64_t seed, uint64_t stream) { rng.reseed(seed, stream); }
+    void enqueueTasks(int maxTasks, EStore* store, const LoadProfile& profile);
     void enqueueStops(int num);
+    LoadStats loadStats() const { return load; }
 };
 
 class SupplierRequestGenerator : public RequestGenerator {
+    private:
+    int batchSize;
+    int itemOwners;
+
+    SupplierMutation generateMutation(EStore* store, int request_type, int owner);
+
     protected:
     virtual Task generateTask(EStore* store);
 
     public:
-    SupplierRequestGenerator(TaskQueue* queue);
+    SupplierRequestGenerator(TaskSink* sink, int mutationsPerTask = 1, int owners = 0);
 };
 
 class CustomerRequestGenerator : public RequestGenerator {
     private:
     bool fineMode;
+    bool waiting;
+    TaskSink* resumer;
 
     protected:
     virtual Task generateTask(EStore* store);
 
     public:
-    CustomerRequestGenerator(TaskQueue* queue, bool inFineMode);
+    CustomerRequestGenerator(TaskSink* sink, bool inFineMode, bool coroutines = false);
+
+    // off by default: every customer fails fast when it cannot buy yet
+    void setWaiting(bool on) { waiting = on; }
 };
 
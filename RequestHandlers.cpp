@@ -1,9 +1,11 @@
 #include "Request.h"
 #include "EStore.h"
+#include "EventLog.h"
 #include "RequestHandlers.h"
+#include "SlabPool.h"
 #include "sthread.h"
-#include <cstdlib>
-#include <cstdio>
+#include <algorithm>
+#include <cassert>
 
 /*
  * ------------------------------------------------------------------
@@ -11,23 +13,26 @@
  *
  *      Handle an AddItemReq.
  *
- *      Delete the request object when done.
- *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
 void
-add_item_handler(void* args)
+add_item_handler(const AddItemReq* req)
 {
-    struct AddItemReq* req = (AddItemReq*)args;
-    
     // handle task by calling respective EStore method
     req->store->addItem(req->item_id, req->quantity, req->price, req->discount);
-    // print arguments info
-    printf("Handling AddItemReq: item_id - %d, quantity - %d, price - $%.2f, discount - %.2f\n", req->item_id, req->quantity, req->price, req->discount);
-    free(req);
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_ADD_ITEM);
+    if (event != NULL)
+    {
+        event->item_id = req->item_id;
+        event->quantity = req->quantity;
+        event->amount = req->price;
+        event->discount = req->discount;
+        event_commit(event);
+    }
 }
 
 /*
@@ -36,23 +41,23 @@ add_item_handler(void* args)
  *
  *      Handle a RemoveItemReq.
  *
- *      Delete the request object when done.
- *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
 void
-remove_item_handler(void* args)
+remove_item_handler(const RemoveItemReq* req)
 {
-    struct RemoveItemReq* req = (RemoveItemReq*)args;
-
     // handle task by calling respective EStore method
     req->store->removeItem(req->item_id);
-    // print arguments info
-    printf("Handling RemoveItemReq: item_id - %d\n", req->item_id);
-    free(req);
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_REMOVE_ITEM);
+    if (event != NULL)
+    {
+        event->item_id = req->item_id;
+        event_commit(event);
+    }
 }
 
 /*
@@ -61,23 +66,24 @@ remove_item_handler(void* args)
  *
  *      Handle an AddStockReq.
  *
- *      Delete the request object when done.
- *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
 void
-add_stock_handler(void* args)
+add_stock_handler(const AddStockReq* req)
 {
-    struct AddStockReq* req = (AddStockReq*)args;
-    
     // handle task by calling respective EStore method
     req->store->addStock(req->item_id, req->additional_stock);
-    // print arguments info
-    printf("Handling AddStockReq: item_id - %d, additional_stock - %d\n", req->item_id, req->additional_stock);
-    free(req);
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_ADD_STOCK);
+    if (event != NULL)
+    {
+        event->item_id = req->item_id;
+        event->quantity = req->additional_stock;
+        event_commit(event);
+    }
 }
 
 /*
@@ -86,23 +92,24 @@ add_stock_handler(void* args)
  *
  *      Handle a ChangeItemPriceReq.
  *
- *      Delete the request object when done.
- *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
 void
-change_item_price_handler(void* args)
+change_item_price_handler(const ChangeItemPriceReq* req)
 {
-    struct ChangeItemPriceReq* req = (ChangeItemPriceReq*)args;
-
     // handle task by calling respective EStore method
     req->store->priceItem(req->item_id, req->new_price);
-    // print arguments info
-    printf("Handling ChangeItemPriceReq: item_id - %d, new_price - $%.2f\n", req->item_id, req->new_price);
-    free(req);
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_CHANGE_ITEM_PRICE);
+    if (event != NULL)
+    {
+        event->item_id = req->item_id;
+        event->amount = req->new_price;
+        event_commit(event);
+    }
 }
 
 /*
@@ -111,23 +118,24 @@ change_item_price_handler(void* args)
  *
  *      Handle a ChangeItemDiscountReq.
  *
- *      Delete the request object when done.
- *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
 void
-change_item_discount_handler(void* args)
+change_item_discount_handler(const ChangeItemDiscountReq* req)
 {
-    struct ChangeItemDiscountReq* req = (ChangeItemDiscountReq*)args;
-
     // handle task by calling respective EStore method
     req->store->discountItem(req->item_id, req->new_discount);
-    // print arguments info
-    printf("Handling ChangeItemDiscountReq: item_id - %d, new_discount - %.2f\n", req->item_id, req->new_discount);
-    free(req);
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_CHANGE_ITEM_DISCOUNT);
+    if (event != NULL)
+    {
+        event->item_id = req->item_id;
+        event->discount = req->new_discount;
+        event_commit(event);
+    }
 }
 
 /*
@@ -136,23 +144,23 @@ change_item_discount_handler(void* args)
  *
  *      Handle a SetShippingCostReq.
  *
- *      Delete the request object when done.
- *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
 void
-set_shipping_cost_handler(void* args)
+set_shipping_cost_handler(const SetShippingCostReq* req)
 {
-    struct SetShippingCostReq* req = (SetShippingCostReq*)args;
-
     // handle task by calling respective EStore method
     req->store->setShippingCost(req->new_cost);
-    // print arguments info
-    printf("Handling SetShippingCostReq: new_shipping - $%.2f\n", req->new_cost);
-    free(req);
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_SET_SHIPPING_COST);
+    if (event != NULL)
+    {
+        event->amount = req->new_cost;
+        event_commit(event);
+    }
 }
 
 /*
@@ -161,32 +169,32 @@ set_shipping_cost_handler(void* args)
  *
  *      Handle a SetStoreDiscountReq.
  *
- *      Delete the request object when done.
- *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
 void
-set_store_discount_handler(void* args)
+set_store_discount_handler(const SetStoreDiscountReq* req)
 {
-    struct SetStoreDiscountReq* req = (SetStoreDiscountReq*)args;
-
     // handle task by calling respective EStore method
     req->store->setStoreDiscount(req->new_discount);
-    // print arguments info
-    printf("Handling SetStoreDiscountReq: new_discount - %.2f\n", req->new_discount);
-    free(req);
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_SET_STORE_DISCOUNT);
+    if (event != NULL)
+    {
+        event->discount = req->new_discount;
+        event_commit(event);
+    }
 }
 
 /*
  * ------------------------------------------------------------------
- * buy_item_handler --
+ * supplier_batch_handler --
  *
- *      Handle a BuyItemReq.
+ *      Handle a SupplierBatchReq.
  *
- *      Delete the request object when done.
+ *      Return the request to its pool when done.
  *
  * Results:
  *      None.
@@ -194,15 +202,84 @@ set_store_discount_handler(void* args)
  * ------------------------------------------------------------------
  */
 void
-buy_item_handler(void* args)
+supplier_batch_handler(SupplierBatchReq* req)
 {
-    struct BuyItemReq* req = (BuyItemReq*)args;
+    // handle task by calling respective EStore method
+    req->store->applyBatch(req->mutations);
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_SUPPLIER_BATCH);
+    if (event != NULL)
+    {
+        event->quantity = (int32_t)req->mutations.size();
+        event_commit(event);
+    }
+    pool_delete(req);
+}
 
+/*
+ * ------------------------------------------------------------------
+ * buy_item_handler --
+ *
+ *      Handle a BuyItemReq.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+buy_item_handler(const BuyItemReq* req)
+{
     // handle task by calling respective EStore method
-    req->store->buyItem(req->item_id, req->budget);
-    // print arguments info
-    printf("Handling BuyItemReq: item_id - %d, budget - $%.2f\n", req->item_id, req->budget);
-    free(req);
+    PurchaseResult result = req->store->buyItem(req->item_id, req->budget, req->policy,
+                                                sutil_now() + req->timeout);
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_BUY_ITEM);
+    if (event != NULL)
+    {
+        event->item_id = req->item_id;
+        event->amount = req->budget;
+        event->outcome = result;
+        event_commit(event);
+    }
+}
+
+// the end of a purchase started by buy_item_async_handler
+static void
+buy_item_done(void* arg, int item_id, double budget, PurchaseResult result)
+{
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_BUY_ITEM);
+    if (event != NULL)
+    {
+        event->item_id = item_id;
+        event->amount = budget;
+        event->outcome = result;
+        event_commit(event);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buy_item_async_handler --
+ *
+ *      Handle a BuyItemReq with EStore::buyItemAsync, so a buyer
+ *      that has to wait suspends instead of holding the worker. It
+ *      is resumed on req->resumer, and the request is printed by
+ *      whichever worker finishes it. The request itself lives in
+ *      the task and is gone once this returns; the coroutine keeps
+ *      its own copy of what it needs.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+buy_item_async_handler(const BuyItemReq* req)
+{
+    req->store->buyItemAsync(req->item_id, req->budget, req->policy, sutil_now() + req->timeout,
+                             req->resumer, buy_item_done, NULL);
 }
 
 /*
@@ -211,7 +288,7 @@ buy_item_handler(void* args)
  *
  *      Handle a BuyManyItemsReq.
  *
- *      Delete the request object when done.
+ *      Return the request to its pool when done.
  *
  * Results:
  *      None.
@@ -219,27 +296,91 @@ buy_item_handler(void* args)
  * ------------------------------------------------------------------
  */
 void
-buy_many_items_handler(void* args)
+buy_many_items_handler(BuyManyItemsReq* req)
 {
-    struct BuyManyItemsReq* req = (BuyManyItemsReq*)args;
-
     // handle task by calling respective EStore method
-    req->store->buyManyItems(&req->item_ids, req->budget);
-    // print arguments info
-    printf("Handling BuyManyItemsReq: item_ids - ");
-    for (size_t i = 0; i < req->item_ids.size(); i++)
+    PurchaseResult result = req->store->buyManyItems(req->lines, req->budget, req->policy,
+                                                     sutil_now() + req->timeout);
+    // log the request
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_BUY_MANY_ITEMS);
+    if (event != NULL)
+    {
+        event->quantity = (int32_t)req->lines.size();
+        std::copy(req->lines.begin(), req->lines.end(), event->lines);
+        event->amount = req->budget;
+        event->outcome = result;
+        event_commit(event);
+    }
+    pool_delete(req);
+}
+
+// log how a checkout ended, and return its request to the pool
+static void
+checkout_done(CheckoutReq* req, CheckoutOutcome outcome)
+{
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_CHECKOUT);
+    if (event != NULL)
     {
-        printf("%d ", req->item_ids[i]);
+        event->quantity = (int32_t)req->lines.size();
+        event->amount = req->budget;
+        event->discount = req->ttl;
+        event->extra = req->payment_time;
+        event->outcome = outcome;
+        event_commit(event);
     }
-    printf(", budget - $%.2f\n", req->budget);
-    free(req);
+    pool_delete(req);
+}
+
+// the end of a checkout's payment, on the store's sweeper thread
+static void
+checkout_settled(void* arg, bool settled)
+{
+    CheckoutReq* req = (CheckoutReq*)arg;
+    CheckoutOutcome outcome = CHECKOUT_EXPIRED;
+    if (settled)
+    {
+        outcome = req->paid ? CHECKOUT_COMMITTED : CHECKOUT_ABORTED;
+    }
+    checkout_done(req, outcome);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * checkout_handler --
+ *
+ *      Handle a CheckoutReq: reserve the cart, then leave the
+ *      payment to the store, which commits or aborts the
+ *      reservation once payment_time has passed. The worker is free
+ *      as soon as the cart is reserved.
+ *
+ *      The request goes back to its pool when the checkout ends.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+checkout_handler(CheckoutReq* req)
+{
+    // handle task by calling respective EStore methods
+    unsigned long id = req->store->reserveItems(req->lines, req->budget, req->ttl);
+    if (id == 0)
+    {
+        checkout_done(req, CHECKOUT_UNAVAILABLE);
+        return;
+    }
+    req->store->settleReservation(id, sutil_now() + req->payment_time, req->paid,
+                                  checkout_settled, req);
 }
 
 /*
  * ------------------------------------------------------------------
  * stop_handler --
  *
- *      The thread should exit.
+ *      Marks the end of a worker's work. The worker that dequeues
+ *      it (see WorkerPool) runs it and then returns from its loop;
+ *      the handler itself only reports the stop.
  *
  * Results:
  *      None.
@@ -249,7 +390,182 @@ buy_many_items_handler(void* args)
 void
 stop_handler(void* args)
 {
-    // print info that you are stopping the calling thread
-    printf("Handling StopHandlerReq : Quitting.\n");
-    sthread_exit();
+    // log that the calling worker is stopping
+    EventRecord* event = event_begin(EVENT_INFO, EVENT_STOP);
+    if (event != NULL)
+    {
+        event_commit(event);
+    }
+}
+
+// a task carrying one request; the member of payload is set by the caller
+static Task
+typed_task(RequestType type)
+{
+    Task task;
+    task.type = type;
+    return task;
+}
+
+Task
+request_task(const AddItemReq& req)
+{
+    Task task = typed_task(REQ_ADD_ITEM);
+    task.payload.addItem = req;
+    return task;
+}
+
+Task
+request_task(const RemoveItemReq& req)
+{
+    Task task = typed_task(REQ_REMOVE_ITEM);
+    task.payload.removeItem = req;
+    return task;
+}
+
+Task
+request_task(const AddStockReq& req)
+{
+    Task task = typed_task(REQ_ADD_STOCK);
+    task.payload.addStock = req;
+    return task;
+}
+
+Task
+request_task(const ChangeItemPriceReq& req)
+{
+    Task task = typed_task(REQ_CHANGE_ITEM_PRICE);
+    task.payload.changeItemPrice = req;
+    return task;
+}
+
+Task
+request_task(const ChangeItemDiscountReq& req)
+{
+    Task task = typed_task(REQ_CHANGE_ITEM_DISCOUNT);
+    task.payload.changeItemDiscount = req;
+    return task;
+}
+
+Task
+request_task(const SetShippingCostReq& req)
+{
+    Task task = typed_task(REQ_SET_SHIPPING_COST);
+    task.payload.setShippingCost = req;
+    return task;
+}
+
+Task
+request_task(const SetStoreDiscountReq& req)
+{
+    Task task = typed_task(REQ_SET_STORE_DISCOUNT);
+    task.payload.setStoreDiscount = req;
+    return task;
+}
+
+Task
+request_task(SupplierBatchReq* req)
+{
+    Task task = typed_task(REQ_SUPPLIER_BATCH);
+    task.payload.supplierBatch = req;
+    return task;
+}
+
+// a purchase with a resumer runs as a coroutine (see buy_item_async_handler)
+Task
+request_task(const BuyItemReq& req)
+{
+    Task task = typed_task(req.resumer != NULL ? REQ_BUY_ITEM_ASYNC : REQ_BUY_ITEM);
+    task.payload.buyItem = req;
+    return task;
+}
+
+Task
+request_task(BuyManyItemsReq* req)
+{
+    Task task = typed_task(REQ_BUY_MANY_ITEMS);
+    task.payload.buyManyItems = req;
+    return task;
+}
+
+Task
+request_task(CheckoutReq* req)
+{
+    Task task = typed_task(REQ_CHECKOUT);
+    task.payload.checkout = req;
+    return task;
+}
+
+typedef void (*request_handler_t)(TaskPayload& payload);
+
+// the handler of each RequestType, in the order of the enum
+static constexpr request_handler_t requestHandlers[] = {
+    [](TaskPayload& p) { p.call.handler(p.call.arg); },
+    [](TaskPayload& p) { add_item_handler(&p.addItem); },
+    [](TaskPayload& p) { remove_item_handler(&p.removeItem); },
+    [](TaskPayload& p) { add_stock_handler(&p.addStock); },
+    [](TaskPayload& p) { change_item_price_handler(&p.changeItemPrice); },
+    [](TaskPayload& p) { change_item_discount_handler(&p.changeItemDiscount); },
+    [](TaskPayload& p) { set_shipping_cost_handler(&p.setShippingCost); },
+    [](TaskPayload& p) { set_store_discount_handler(&p.setStoreDiscount); },
+    [](TaskPayload& p) { supplier_batch_handler(p.supplierBatch); },
+    [](TaskPayload& p) { buy_item_handler(&p.buyItem); },
+    [](TaskPayload& p) { buy_item_async_handler(&p.buyItem); },
+    [](TaskPayload& p) { buy_many_items_handler(p.buyManyItems); },
+    [](TaskPayload& p) { checkout_handler(p.checkout); },
+};
+
+static_assert(sizeof(requestHandlers) / sizeof(requestHandlers[0]) == NUM_REQUEST_TYPES,
+              "one handler per request type");
+
+/*
+ * ------------------------------------------------------------------
+ * run_task --
+ *
+ *      Run a task: call the handler of its request type on its
+ *      payload. Handlers of requests held by pointer return them to
+ *      their pool.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+run_task(Task& task)
+{
+    assert(task.type >= 0 && task.type < NUM_REQUEST_TYPES);
+    requestHandlers[task.type](task.payload);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dispose_task --
+ *
+ *      Free what a task that will never run owns: its request, if
+ *      it is held by pointer. Tasks whose request is held by value
+ *      own nothing.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+dispose_task(const Task& task)
+{
+    switch (task.type)
+    {
+        case REQ_SUPPLIER_BATCH:
+            pool_delete(task.payload.supplierBatch);
+            break;
+        case REQ_BUY_MANY_ITEMS:
+            pool_delete(task.payload.buyManyItems);
+            break;
+        case REQ_CHECKOUT:
+            pool_delete(task.payload.checkout);
+            break;
+        default:
+            break;
+    }
 }
@@ -1,14 +1,42 @@
 #pragma once
 
-void add_item_handler(void *args);
-void remove_item_handler(void *args);
-void add_stock_handler(void *args);
-void change_item_price_handler(void *args);
-void change_item_discount_handler(void *args);
-void set_shipping_cost_handler(void *args);
-void set_store_discount_handler(void *args);
+#include "TaskQueue.h"
 
-void buy_item_handler(void *args);
-void buy_many_items_handler(void *args);
+void add_item_handler(const AddItemReq* req);
+void remove_item_handler(const RemoveItemReq* req);
+void add_stock_handler(const AddStockReq* req);
+void change_item_price_handler(const ChangeItemPriceReq* req);
+void change_item_discount_handler(const ChangeItemDiscountReq* req);
+void set_shipping_cost_handler(const SetShippingCostReq* req);
+void set_store_discount_handler(const SetStoreDiscountReq* req);
+void supplier_batch_handler(SupplierBatchReq* req);
+
+void buy_item_handler(const BuyItemReq* req);
+void buy_item_async_handler(const BuyItemReq* req);
+void buy_many_items_handler(BuyManyItemsReq* req);
+void checkout_handler(CheckoutReq* req);
 
 void stop_handler(void *args);
+
+// tasks carrying a request; those taking a pointer (from pool_new) own it
+Task request_task(const AddItemReq& req);
+Task request_task(const RemoveItemReq& req);
+Task request_task(const AddStockReq& req);
+Task request_task(const ChangeItemPriceReq& req);
+Task request_task(const ChangeItemDiscountReq& req);
+Task request_task(const SetShippingCostReq& req);
+Task request_task(const SetStoreDiscountReq& req);
+Task request_task(SupplierBatchReq* req);
+Task request_task(const BuyItemReq& req);
+Task request_task(BuyManyItemsReq* req);
+Task request_task(CheckoutReq* req);
+
+void run_task(Task& task);
+void dispose_task(const Task& task);
+
+// whether the task is a stop task (see stop_handler)
+inline bool
+task_is_stop(const Task& task)
+{
+    return task.type == REQ_CALL && task.payload.call.handler == stop_handler;
+}
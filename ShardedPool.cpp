@@ -0,0 +1,268 @@
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+#include "RequestHandlers.h"
+#include "ShardedPool.h"
+#include "WorkerPool.h"
+#include "sthread.h"
+
+using namespace std;
+
+ShardedPool::
+ShardedPool(const char* poolName, int workers, QueueBackend backend, size_t maxTasks,
+            OverflowPolicy policy, LockKind queueLocks)
+    : name(poolName), numWorkers(workers), nextWorker(0), running(false), nextShard(0), nextStop(0)
+{
+    assert(numWorkers > 0);
+    queues = new TaskQueue*[numWorkers];
+    for (int i = 0; i < numWorkers; i++)
+    {
+        queues[i] = new TaskQueue(backend, maxTasks, policy, queueLocks);
+    }
+    threads = new sthread_t[numWorkers];
+    stats = new WorkerStats[numWorkers]();
+    smutex_init(&lock);
+}
+
+ShardedPool::
+~ShardedPool()
+{
+    assert(!running);
+    smutex_destroy(&lock);
+    for (int i = 0; i < numWorkers; i++)
+    {
+        delete queues[i];
+    }
+    delete[] queues;
+    delete[] threads;
+    delete[] stats;
+}
+
+void* ShardedPool::
+workerMain(void* arg)
+{
+    ShardedPool* pool = (ShardedPool*)arg;
+
+    smutex_lock(&pool->lock);
+    int worker = pool->nextWorker++;
+    smutex_unlock(&pool->lock);
+
+    sthread_pin(pool->cpuOf(worker));
+    pool->work(worker);
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * work --
+ *
+ *      The loop of one worker: run tasks from its own queue, a
+ *      batch at a time, until a batch holds a stop task. The rest
+ *      of that batch is still run. Any further stop in it is from
+ *      a later round and is dropped, as this worker is stopping
+ *      anyway.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedPool::
+work(int worker)
+{
+    WorkerStats& mine = stats[worker];
+    TaskQueue* queue = queues[worker];
+    mine.started = sutil_now();
+    Task batch[WORKER_DEQUEUE_BATCH];
+    Task stop;
+    bool stopping = false;
+    while (!stopping)
+    {
+        size_t count = queue->dequeueBatch(batch, WORKER_DEQUEUE_BATCH);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (task_is_stop(batch[i]))
+            {
+                stop = batch[i];
+                stopping = true;
+                continue;
+            }
+            double begin = sutil_now();
+            run_task(batch[i]);
+            mine.busySeconds += sutil_now() - begin;
+            mine.tasks++;
+        }
+    }
+    run_task(stop);
+    mine.stopped = sutil_now();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * route --
+ *
+ *      Pick the worker whose queue a task goes to: the owner of its
+ *      affinity item, or the next worker in round-robin order (on
+ *      a separate counter for stop tasks).
+ *
+ * Results:
+ *      The worker index.
+ *
+ * ------------------------------------------------------------------
+ */
+int ShardedPool::
+route(const Task& task)
+{
+    if (task_is_stop(task))
+    {
+        return (int)(nextStop.fetch_add(1, memory_order_relaxed) % numWorkers);
+    }
+    if (task.affinity >= 0)
+    {
+        return ownerOf(task.affinity);
+    }
+    return (int)(nextShard.fetch_add(1, memory_order_relaxed) % numWorkers);
+}
+
+void ShardedPool::
+enqueue(Task task)
+{
+    queues[route(task)]->enqueue(task);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueBatch --
+ *
+ *      Route every task, then hand each worker its share with one
+ *      enqueueBatch. A counting sort keeps each share in the order
+ *      of the batch, so tasks on one item stay in order.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedPool::
+enqueueBatch(span<const Task> tasks)
+{
+    if (tasks.empty())
+    {
+        return;
+    }
+    vector<int> owners(tasks.size());
+    vector<size_t> start(numWorkers + 1, 0);
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        owners[i] = route(tasks[i]);
+        start[owners[i] + 1]++;
+    }
+    for (int w = 0; w < numWorkers; w++)
+    {
+        start[w + 1] += start[w];
+    }
+    vector<Task> grouped(tasks.size());
+    vector<size_t> next(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        grouped[next[owners[i]]++] = tasks[i];
+    }
+    for (int w = 0; w < numWorkers; w++)
+    {
+        if (start[w + 1] > start[w])
+        {
+            queues[w]->enqueueBatch(span<const Task>(grouped.data() + start[w], start[w + 1] - start[w]));
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * start --
+ *
+ *      Create the worker threads.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedPool::
+start()
+{
+    assert(!running);
+    running = true;
+    for (int i = 0; i < numWorkers; i++)
+    {
+        sthread_create(&threads[i], workerMain, this);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * join --
+ *
+ *      Wait until every worker has run its stop task and exited.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedPool::
+join()
+{
+    assert(running);
+    for (int i = 0; i < numWorkers; i++)
+    {
+        sthread_join(threads[i]);
+    }
+    running = false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * queueStats --
+ *
+ *      Sum the admission counters of the workers' queues.
+ *
+ * Results:
+ *      The totals.
+ *
+ * ------------------------------------------------------------------
+ */
+QueueStats ShardedPool::
+queueStats() const
+{
+    QueueStats total = QueueStats();
+    for (int i = 0; i < numWorkers; i++)
+    {
+        QueueStats shard = queues[i]->stats();
+        total.enqueued += shard.enqueued;
+        total.rejected += shard.rejected;
+        total.dropped += shard.dropped;
+        total.producerWaits += shard.producerWaits;
+    }
+    return total;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * report --
+ *
+ *      Print the pool's per-worker throughput (see report_workers);
+ *      uneven task counts show skew between the shards. Must be
+ *      called after join.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedPool::
+report(FILE* out) const
+{
+    assert(!running);
+    report_workers(out, name, stats, numWorkers, false);
+}
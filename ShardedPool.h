@@ -0,0 +1,68 @@
+#pragma once
+
+#include "Executor.h"
+#include "TaskQueue.h"
+#include "sthread.h"
+#include <atomic>
+#include <cstdio>
+
+/*
+ * ------------------------------------------------------------------
+ * ShardedPool --
+ *
+ *      An executor where every worker owns a partition of the
+ *      inventory and has a TaskQueue of its own. A task with an
+ *      affinity goes to the queue of the worker owning that item,
+ *      item_id % size(), so all tasks on one item run on one
+ *      thread, in the order they were enqueued. Tasks without one
+ *      are spread round-robin. Nothing is ever moved between
+ *      workers: a busy shard is not helped by an idle one.
+ *
+ *      Stop tasks are spread round-robin on a counter of their own,
+ *      so n rounds of size() stops hand each worker n of them. A
+ *      worker exits on its first stop; since producers enqueue
+ *      their stops after their work, each queue drains first.
+ *
+ *      With EStore::setItemOwnership, item writers skip the item
+ *      lock, which is only sound if every task that changes an
+ *      item carries its id as affinity.
+ *
+ * ------------------------------------------------------------------
+ */
+class ShardedPool final : public Executor {
+    private:
+    const char* name;
+    int numWorkers;
+    TaskQueue** queues;
+    sthread_t* threads;
+    WorkerStats* stats;
+    int nextWorker;
+    smutex_t lock;
+    bool running;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> nextShard;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> nextStop;
+
+    static void* workerMain(void* arg);
+    void work(int worker);
+    int route(const Task& task);
+
+    public:
+    ShardedPool(const char* poolName, int workers, QueueBackend backend = QUEUE_MONITOR,
+                size_t maxTasks = 0, OverflowPolicy policy = OVERFLOW_BLOCK,
+                LockKind queueLocks = LOCK_BLOCKING);
+    ~ShardedPool();
+
+    ShardedPool(const ShardedPool&) = delete;
+    ShardedPool& operator=(const ShardedPool &) = delete;
+
+    void enqueue(Task task) override;
+    void enqueueBatch(std::span<const Task> tasks) override;
+    void start() override;
+    void join() override;
+
+    int size() const override { return numWorkers; }
+    int ownerOf(int item_id) const { return item_id % numWorkers; }
+    QueueStats queueStats() const;
+    void report(FILE* out) const override;
+};
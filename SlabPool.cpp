@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <new>
+
+#include "SlabPool.h"
+#include "sthread.h"
+
+using namespace std;
+
+static atomic<int> numPools(0);
+static atomic<SlabPool*> pools[MAX_SLAB_POOLS];
+
+/*
+ * The calling thread's caches, one per pool, handed to the depots
+ * when the thread exits.
+ */
+struct SlabThread {
+    SlabCache caches[MAX_SLAB_POOLS];
+
+    SlabThread() : caches() { }
+    ~SlabThread()
+    {
+        for (int i = 0; i < MAX_SLAB_POOLS; i++)
+        {
+            SlabPool* pool = pools[i].load(memory_order_acquire);
+            if (pool != NULL && caches[i].count > 0)
+            {
+                pool->flush(&caches[i]);
+            }
+        }
+    }
+};
+
+static thread_local SlabThread self;
+
+SlabPool::
+SlabPool(size_t size)
+    : objectSize((max(size, sizeof(SlabFree)) + alignof(max_align_t) - 1)
+                 & ~(alignof(max_align_t) - 1)),
+      index(numPools.fetch_add(1, memory_order_relaxed)), depot(NULL), counts()
+{
+    assert(index < MAX_SLAB_POOLS);
+    smutex_init(&lock);
+    pools[index].store(this, memory_order_release);
+}
+
+SlabPool::
+~SlabPool()
+{
+    pools[index].store(NULL, memory_order_release);
+    smutex_destroy(&lock);
+    for (size_t i = 0; i < slabs.size(); i++)
+    {
+        ::operator delete(slabs[i]);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * refill --
+ *
+ *      Give an empty thread cache a magazine from the depot, or a
+ *      new slab's worth of objects if the depot has none.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void SlabPool::
+refill(SlabCache* cache)
+{
+    assert(cache->head == NULL);
+    smutex_lock(&lock);
+    if (depot != NULL)
+    {
+        cache->head = depot;
+        cache->count = depot->count;
+        depot = depot->nextMagazine;
+        counts.exchanges++;
+        smutex_unlock(&lock);
+        return;
+    }
+    counts.slabs++;
+    counts.objects += SLAB_MAGAZINE_SIZE;
+    smutex_unlock(&lock);
+
+    // carve the slab outside the lock; only its bookkeeping is shared
+    char* slab = (char*)::operator new(objectSize * SLAB_MAGAZINE_SIZE);
+    for (int i = 0; i < SLAB_MAGAZINE_SIZE; i++)
+    {
+        SlabFree* object = (SlabFree*)(slab + i * objectSize);
+        object->next = i + 1 < SLAB_MAGAZINE_SIZE ? (SlabFree*)(slab + (i + 1) * objectSize) : NULL;
+    }
+    cache->head = (SlabFree*)slab;
+    cache->count = SLAB_MAGAZINE_SIZE;
+    smutex_lock(&lock);
+    slabs.push_back(slab);
+    smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * spill --
+ *
+ *      Move the first count objects of a thread cache to the depot
+ *      as one magazine.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void SlabPool::
+spill(SlabCache* cache, size_t count)
+{
+    assert(count > 0 && count <= cache->count);
+    SlabFree* magazine = cache->head;
+    SlabFree* last = magazine;
+    for (size_t i = 1; i < count; i++)
+    {
+        last = last->next;
+    }
+    cache->head = last->next;
+    cache->count -= count;
+    last->next = NULL;
+    magazine->count = count;
+
+    smutex_lock(&lock);
+    magazine->nextMagazine = depot;
+    depot = magazine;
+    counts.exchanges++;
+    smutex_unlock(&lock);
+}
+
+void* SlabPool::
+allocate()
+{
+    SlabCache* cache = &self.caches[index];
+    if (cache->head == NULL)
+    {
+        refill(cache);
+    }
+    SlabFree* object = cache->head;
+    cache->head = object->next;
+    cache->count--;
+    return object;
+}
+
+void SlabPool::
+release(void* object)
+{
+    SlabCache* cache = &self.caches[index];
+    SlabFree* freed = (SlabFree*)object;
+    freed->next = cache->head;
+    cache->head = freed;
+    cache->count++;
+    if (cache->count >= 2 * SLAB_MAGAZINE_SIZE)
+    {
+        spill(cache, SLAB_MAGAZINE_SIZE);
+    }
+}
+
+// hand all of an exiting thread's cache to the depot
+void SlabPool::
+flush(SlabCache* cache)
+{
+    if (cache->count > 0)
+    {
+        spill(cache, cache->count);
+    }
+}
+
+SlabStats SlabPool::
+stats()
+{
+    smutex_lock(&lock);
+    SlabStats snapshot = counts;
+    smutex_unlock(&lock);
+    return snapshot;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "sthread.h"
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#define MAX_SLAB_POOLS     8
+#define SLAB_MAGAZINE_SIZE 64
+
+// a free object, overlaid on the memory of the object it replaces
+struct SlabFree {
+    SlabFree* next;             // within a thread cache or a magazine
+    SlabFree* nextMagazine;     // in the depot; set on a magazine's first object
+    size_t count;               // objects in the magazine; set on its first object
+};
+
+// one thread's free objects of one pool
+struct SlabCache {
+    SlabFree* head;
+    size_t count;
+};
+
+// how a SlabPool has been used so far
+struct SlabStats {
+    long slabs;                 // slabs taken from the heap
+    long objects;               // objects in those slabs
+    long exchanges;             // magazines moved between thread caches and the depot
+};
+
+/*
+ * ------------------------------------------------------------------
+ * SlabPool --
+ *
+ *      A pool of objects of one size, cached per thread in the
+ *      manner of Bonwick's magazines. Each thread allocates from
+ *      and frees to a free list of its own, with no
+ *      synchronization; an object freed by a thread other than the
+ *      one that allocated it simply joins the freeing thread's
+ *      list. A list that grows to two magazines of
+ *      SLAB_MAGAZINE_SIZE objects hands one to the pool's depot,
+ *      and an empty list takes one back, so a generator thread that
+ *      only allocates and a worker that only frees trade whole
+ *      magazines and take the depot lock once per magazine. Only
+ *      when the depot is empty as well is a new slab allocated from
+ *      the heap. A thread that exits hands its lists to the depots.
+ *
+ *      Slabs go back to the heap only when the pool is destroyed,
+ *      which happens at exit for the pools of slab_pool.
+ *
+ * ------------------------------------------------------------------
+ */
+class SlabPool {
+    private:
+    const size_t objectSize;
+    const int index;            // of this pool's cache in every thread
+    smutex_t lock;
+    SlabFree* depot;            // full magazines
+    std::vector<void*> slabs;
+    SlabStats counts;
+
+    void refill(SlabCache* cache);
+    void spill(SlabCache* cache, size_t count);
+
+    public:
+    explicit SlabPool(size_t size);
+    ~SlabPool();
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool &) = delete;
+
+    void* allocate();
+    void release(void* object);
+    void flush(SlabCache* cache);
+    SlabStats stats();
+};
+
+// the pool of objects of type T
+template <typename T>
+SlabPool&
+slab_pool()
+{
+    static SlabPool pool(sizeof(T));
+    return pool;
+}
+
+// a new T from its pool; free it with pool_delete
+template <typename T>
+T*
+pool_new()
+{
+    static_assert(alignof(T) <= alignof(std::max_align_t), "slabs are only malloc aligned");
+    return new (slab_pool<T>().allocate()) T();
+}
+
+template <typename T>
+void
+pool_delete(T* object)
+{
+    if (object != NULL)
+    {
+        object->~T();
+        slab_pool<T>().release(object);
+    }
+}
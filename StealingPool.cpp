@@ -0,0 +1,512 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+
+#include "RequestHandlers.h"
+#include "StealingPool.h"
+#include "sthread.h"
+
+using namespace std;
+
+WorkDeque::
+WorkDeque()
+    : top(0), bottom(0), buffer(new DequeBuffer(WORK_DEQUE_INITIAL_CAPACITY))
+{ }
+
+WorkDeque::
+~WorkDeque()
+{
+    delete buffer.load(memory_order_relaxed);
+    for (size_t i = 0; i < retired.size(); i++)
+    {
+        delete retired[i];
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * grow --
+ *
+ *      Replace a full buffer by one twice its size holding the same
+ *      tasks at the same indices. Called by the owner only.
+ *
+ * Results:
+ *      The new buffer.
+ *
+ * ------------------------------------------------------------------
+ */
+DequeBuffer* WorkDeque::
+grow(DequeBuffer* old, int64_t head, int64_t tail)
+{
+    DequeBuffer* bigger = new DequeBuffer(old->capacity * 2);
+    for (int64_t i = head; i < tail; i++)
+    {
+        bigger->at(i).store(old->at(i).load());
+    }
+    // thieves may still be reading the old buffer
+    retired.push_back(old);
+    buffer.store(bigger, memory_order_release);
+    return bigger;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * push --
+ *
+ *      Add a task at the bottom. Owner only.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkDeque::
+push(const Task& task)
+{
+    int64_t tail = bottom.load(memory_order_relaxed);
+    int64_t head = top.load(memory_order_acquire);
+    DequeBuffer* buf = buffer.load(memory_order_relaxed);
+    if (tail - head > buf->capacity - 1)
+    {
+        buf = grow(buf, head, tail);
+    }
+    buf->at(tail).store(task);
+    // publishes the slot to thieves that read bottom with acquire
+    bottom.store(tail + 1, memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * take --
+ *
+ *      Remove the task at the bottom, i.e. the newest one. Owner
+ *      only. Races with thieves only over the last task.
+ *
+ * Results:
+ *      true if *task was filled, false if the deque is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkDeque::
+take(Task* task)
+{
+    int64_t tail = bottom.load(memory_order_relaxed) - 1;
+    DequeBuffer* buf = buffer.load(memory_order_relaxed);
+    bottom.store(tail, memory_order_relaxed);
+    // thieves must see the lowered bottom before we read top
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t head = top.load(memory_order_relaxed);
+    if (head > tail)
+    {
+        bottom.store(tail + 1, memory_order_relaxed);
+        return false;
+    }
+
+    *task = buf->at(tail).load();
+    if (head < tail)
+    {
+        return true;
+    }
+
+    // the last task: whoever moves top past it owns it
+    bool won = top.compare_exchange_strong(head, head + 1, memory_order_seq_cst, memory_order_relaxed);
+    bottom.store(tail + 1, memory_order_relaxed);
+    return won;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * steal --
+ *
+ *      Remove the task at the top, i.e. the oldest one. Any thread
+ *      may call it.
+ *
+ * Results:
+ *      STEAL_OK if *task was filled, STEAL_EMPTY, or STEAL_ABORT if
+ *      another thread took the task first.
+ *
+ * ------------------------------------------------------------------
+ */
+StealResult WorkDeque::
+steal(Task* task)
+{
+    int64_t head = top.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t tail = bottom.load(memory_order_acquire);
+    if (head >= tail)
+    {
+        return STEAL_EMPTY;
+    }
+
+    DequeBuffer* buf = buffer.load(memory_order_acquire);
+    Task stolen = buf->at(head).load();
+    if (!top.compare_exchange_strong(head, head + 1, memory_order_seq_cst, memory_order_relaxed))
+    {
+        return STEAL_ABORT;
+    }
+    *task = stolen;
+    return STEAL_OK;
+}
+
+
+StealingPool::
+StealingPool(const char* poolName, int workerCount)
+    : name(poolName), numWorkers(workerCount), nextWorker(0), running(false),
+      nextInbox(0), stopsRun(0)
+{
+    assert(numWorkers > 0);
+    workers = new StealingWorker[numWorkers];
+    for (int i = 0; i < numWorkers; i++)
+    {
+        smutex_init(&workers[i].inboxLock);
+        workers[i].inboxSize.store(0, memory_order_relaxed);
+    }
+    threads = new sthread_t[numWorkers];
+    stats = new WorkerStats[numWorkers]();
+    smutex_init(&lock);
+}
+
+StealingPool::
+~StealingPool()
+{
+    assert(!running);
+    for (int i = 0; i < numWorkers; i++)
+    {
+        smutex_destroy(&workers[i].inboxLock);
+    }
+    smutex_destroy(&lock);
+    delete[] workers;
+    delete[] threads;
+    delete[] stats;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueue --
+ *
+ *      Hand the task to the next worker's inbox, round-robin, and
+ *      wake any parked worker.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StealingPool::
+enqueue(Task task)
+{
+    StealingWorker& target = workers[nextInbox.fetch_add(1, memory_order_relaxed) % numWorkers];
+    smutex_lock(&target.inboxLock);
+    target.inbox.push_back(task);
+    target.inboxSize.store(target.inbox.size(), memory_order_relaxed);
+    smutex_unlock(&target.inboxLock);
+    workAvailable.notify();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueBatch --
+ *
+ *      Split the tasks into one contiguous run per inbox, starting
+ *      at the next inbox in round-robin order, so each inbox is
+ *      locked once. Wake one parked worker per run.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StealingPool::
+enqueueBatch(span<const Task> tasks)
+{
+    if (tasks.empty())
+    {
+        return;
+    }
+    size_t runs = min(tasks.size(), (size_t)numWorkers);
+    size_t first = nextInbox.fetch_add(runs, memory_order_relaxed);
+    size_t begin = 0;
+    for (size_t r = 0; r < runs; r++)
+    {
+        size_t end = tasks.size() * (r + 1) / runs;
+        StealingWorker& target = workers[(first + r) % numWorkers];
+        smutex_lock(&target.inboxLock);
+        target.inbox.insert(target.inbox.end(), tasks.begin() + begin, tasks.begin() + end);
+        target.inboxSize.store(target.inbox.size(), memory_order_relaxed);
+        smutex_unlock(&target.inboxLock);
+        begin = end;
+    }
+    workAvailable.notify((int)runs);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * drainInbox --
+ *
+ *      Move the worker's whole inbox into its deque, where other
+ *      workers can steal from it. Wakes parked workers if that made
+ *      more than one task available.
+ *
+ * Results:
+ *      true if any task was moved.
+ *
+ * ------------------------------------------------------------------
+ */
+bool StealingPool::
+drainInbox(int worker)
+{
+    StealingWorker& self = workers[worker];
+    if (self.inboxSize.load(memory_order_relaxed) == 0)
+    {
+        return false;
+    }
+
+    smutex_lock(&self.inboxLock);
+    size_t moved = self.inbox.size();
+    for (size_t i = 0; i < moved; i++)
+    {
+        self.deque.push(self.inbox[i]);
+    }
+    self.inbox.clear();
+    self.inboxSize.store(0, memory_order_relaxed);
+    smutex_unlock(&self.inboxLock);
+
+    if (moved > 1)
+    {
+        workAvailable.notify();
+    }
+    return moved > 0;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * stealFrom --
+ *
+ *      Take the oldest task from the victim's inbox, for when its
+ *      owner is busy with a long task and has not drained it.
+ *
+ * Results:
+ *      true if *task was filled.
+ *
+ * ------------------------------------------------------------------
+ */
+bool StealingPool::
+stealFrom(int victim, Task* task)
+{
+    StealingWorker& other = workers[victim];
+    if (other.inboxSize.load(memory_order_relaxed) == 0)
+    {
+        return false;
+    }
+
+    bool found = false;
+    smutex_lock(&other.inboxLock);
+    if (!other.inbox.empty())
+    {
+        *task = other.inbox.front();
+        other.inbox.pop_front();
+        other.inboxSize.store(other.inbox.size(), memory_order_relaxed);
+        found = true;
+    }
+    smutex_unlock(&other.inboxLock);
+    return found;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * findTask --
+ *
+ *      Look for a task for the worker: its own deque, its inbox,
+ *      the other deques, then the other inboxes. Victims are tried
+ *      starting from the next worker, so thieves spread out. A
+ *      steal that lost a race means a task may still be there, so
+ *      the scan is repeated rather than reported empty.
+ *
+ * Results:
+ *      true if *task was filled, false if no task was found.
+ *
+ * ------------------------------------------------------------------
+ */
+bool StealingPool::
+findTask(int worker, Task* task)
+{
+    StealingWorker& self = workers[worker];
+    if (self.deque.take(task))
+    {
+        return true;
+    }
+    if (drainInbox(worker) && self.deque.take(task))
+    {
+        return true;
+    }
+
+    for (;;)
+    {
+        bool contended = false;
+        for (int i = 1; i < numWorkers; i++)
+        {
+            StealResult result = workers[(worker + i) % numWorkers].deque.steal(task);
+            if (result == STEAL_OK)
+            {
+                // the victim may have more; let another parked worker help
+                stats[worker].stolen++;
+                workAvailable.notify();
+                return true;
+            }
+            contended |= result == STEAL_ABORT;
+        }
+        for (int i = 1; i < numWorkers; i++)
+        {
+            if (stealFrom((worker + i) % numWorkers, task))
+            {
+                stats[worker].stolen++;
+                return true;
+            }
+        }
+        if (!contended)
+        {
+            return false;
+        }
+    }
+}
+
+void* StealingPool::
+workerMain(void* arg)
+{
+    StealingPool* pool = (StealingPool*)arg;
+
+    smutex_lock(&pool->lock);
+    int worker = pool->nextWorker++;
+    smutex_unlock(&pool->lock);
+
+    sthread_pin(pool->cpuOf(worker));
+    pool->work(worker);
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * work --
+ *
+ *      The loop of one worker: run whatever findTask comes up with,
+ *      parking when there is nothing, until one stop task per
+ *      worker has been run and no task is left.
+ *
+ *      The stop count is read before the last scan: every task was
+ *      enqueued before the stops, so if all stops have been run and
+ *      the scan after that finds nothing, nothing is left.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StealingPool::
+work(int worker)
+{
+    WorkerStats& mine = stats[worker];
+    mine.started = sutil_now();
+    for (;;)
+    {
+        Task task;
+        if (!findTask(worker, &task))
+        {
+            uint32_t key = workAvailable.prepareWait();
+            bool finished = stopsRun.load(memory_order_acquire) == numWorkers;
+            if (findTask(worker, &task))
+            {
+                workAvailable.cancelWait(key);
+            }
+            else if (finished)
+            {
+                workAvailable.cancelWait(key);
+                break;
+            }
+            else
+            {
+                workAvailable.commitWait(key);
+                continue;
+            }
+        }
+
+        if (task_is_stop(task))
+        {
+            run_task(task);
+            if (stopsRun.fetch_add(1, memory_order_acq_rel) + 1 == numWorkers)
+            {
+                // parked workers need to see the count to exit
+                workAvailable.notifyAll();
+            }
+            continue;
+        }
+        double begin = sutil_now();
+        run_task(task);
+        mine.busySeconds += sutil_now() - begin;
+        mine.tasks++;
+    }
+    mine.stopped = sutil_now();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * start --
+ *
+ *      Create the worker threads.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StealingPool::
+start()
+{
+    assert(!running);
+    running = true;
+    stopsRun.store(0, memory_order_relaxed);
+    for (int i = 0; i < numWorkers; i++)
+    {
+        sthread_create(&threads[i], workerMain, this);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * join --
+ *
+ *      Wait until every worker has exited.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StealingPool::
+join()
+{
+    assert(running);
+    for (int i = 0; i < numWorkers; i++)
+    {
+        sthread_join(threads[i]);
+    }
+    running = false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * report --
+ *
+ *      Print the pool's per-worker throughput and steals (see
+ *      report_workers). Must be called after join.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StealingPool::
+report(FILE* out) const
+{
+    assert(!running);
+    report_workers(out, name, stats, numWorkers, true);
+}
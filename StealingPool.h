@@ -0,0 +1,186 @@
+#pragma once
+
+#include "EventCount.h"
+#include "Executor.h"
+#include "TaskQueue.h"
+#include "sthread.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#define WORK_DEQUE_INITIAL_CAPACITY 64
+
+// result of a steal attempt
+enum StealResult {
+    STEAL_OK = 0,
+    STEAL_EMPTY,
+    STEAL_ABORT             // lost a race with another thief or the owner; retry
+};
+
+// one deque slot; the fields are atomic because a thief may read a
+// slot that the owner is about to reuse (its CAS then fails), and the
+// payload is copied a word at a time for the same reason
+struct DequeSlot {
+    static const int PAYLOAD_WORDS = sizeof(TaskPayload) / sizeof(uint64_t);
+    static_assert(sizeof(TaskPayload) % sizeof(uint64_t) == 0, "payload is whole words");
+
+    std::atomic<RequestType> type;
+    std::atomic<TaskKind> kind;
+    std::atomic<int> affinity;
+    std::atomic<TaskPriority> priority;
+    std::atomic<double> deadline;
+    std::atomic<uint64_t> payload[PAYLOAD_WORDS];
+
+    void store(const Task& task)
+    {
+        uint64_t words[PAYLOAD_WORDS];
+        memcpy(words, &task.payload, sizeof(words));
+        type.store(task.type, std::memory_order_relaxed);
+        kind.store(task.kind, std::memory_order_relaxed);
+        affinity.store(task.affinity, std::memory_order_relaxed);
+        priority.store(task.priority, std::memory_order_relaxed);
+        deadline.store(task.deadline, std::memory_order_relaxed);
+        for (int i = 0; i < PAYLOAD_WORDS; i++)
+        {
+            payload[i].store(words[i], std::memory_order_relaxed);
+        }
+    }
+
+    Task load() const
+    {
+        uint64_t words[PAYLOAD_WORDS];
+        Task task;
+        task.type = type.load(std::memory_order_relaxed);
+        task.kind = kind.load(std::memory_order_relaxed);
+        task.affinity = affinity.load(std::memory_order_relaxed);
+        task.priority = priority.load(std::memory_order_relaxed);
+        task.deadline = deadline.load(std::memory_order_relaxed);
+        for (int i = 0; i < PAYLOAD_WORDS; i++)
+        {
+            words[i] = payload[i].load(std::memory_order_relaxed);
+        }
+        memcpy(&task.payload, words, sizeof(words));
+        return task;
+    }
+};
+
+struct DequeBuffer {
+    int64_t capacity;       // a power of two
+    DequeSlot* slots;
+
+    explicit DequeBuffer(int64_t size) : capacity(size), slots(new DequeSlot[size]) { }
+    ~DequeBuffer() { delete[] slots; }
+
+    DequeSlot& at(int64_t index) { return slots[index & (capacity - 1)]; }
+};
+
+/*
+ * ------------------------------------------------------------------
+ * WorkDeque --
+ *
+ *      A Chase-Lev work-stealing deque, with the memory orders of
+ *      Le, Pop, Cohen and Zappa Nardelli (PPoPP 2013). The owning
+ *      worker pushes and takes at the bottom without atomic
+ *      read-modify-writes except when one task is left; any other
+ *      thread may steal from the top with a CAS.
+ *
+ *      The buffer doubles when full. A thief can still be reading
+ *      the old buffer, so replaced buffers are kept until the deque
+ *      is destroyed (they total less than the final one).
+ *
+ *      push and take must only be called by the owner.
+ *
+ * ------------------------------------------------------------------
+ */
+class WorkDeque {
+    private:
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> top;
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> bottom;
+    std::atomic<DequeBuffer*> buffer;
+    std::vector<DequeBuffer*> retired;
+
+    DequeBuffer* grow(DequeBuffer* old, int64_t head, int64_t tail);
+
+    public:
+    WorkDeque();
+    ~WorkDeque();
+
+    WorkDeque(const WorkDeque&) = delete;
+    WorkDeque& operator=(const WorkDeque &) = delete;
+
+    void push(const Task& task);
+    bool take(Task* task);
+    StealResult steal(Task* task);
+};
+
+// a worker's deque, and the inbox that producers hand it tasks through
+struct alignas(CACHE_LINE_SIZE) StealingWorker {
+    WorkDeque deque;
+    smutex_t inboxLock;
+    std::deque<Task> inbox;
+    std::atomic<size_t> inboxSize;  // lets thieves skip empty inboxes without locking
+};
+
+/*
+ * ------------------------------------------------------------------
+ * StealingPool --
+ *
+ *      An executor where every worker has its own WorkDeque instead
+ *      of all of them sharing one queue.
+ *
+ *      Only a deque's owner may push to it, so enqueue hands each
+ *      task to a worker's inbox (a short mutex-protected list),
+ *      choosing workers round-robin; enqueueBatch splits a batch
+ *      into one run per inbox. A worker moves its whole inbox
+ *      into its deque and runs tasks from the bottom. When both are
+ *      empty it steals from the top of other workers' deques, then
+ *      from their inboxes, and parks on an EventCount if there is
+ *      nothing anywhere.
+ *
+ *      There is no global order, so a stop task does not end the
+ *      worker that runs it. Workers count stop tasks instead, and
+ *      all of them exit once one stop per worker has been run and
+ *      no work is left. Since producers enqueue their stops after
+ *      their work, the pool still drains before it exits.
+ *
+ * ------------------------------------------------------------------
+ */
+class StealingPool final : public Executor {
+    private:
+    const char* name;
+    int numWorkers;
+    StealingWorker* workers;
+    sthread_t* threads;
+    WorkerStats* stats;
+    int nextWorker;
+    smutex_t lock;
+    bool running;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> nextInbox;
+    alignas(CACHE_LINE_SIZE) std::atomic<int> stopsRun;
+    EventCount workAvailable;
+
+    static void* workerMain(void* arg);
+    void work(int worker);
+    bool findTask(int worker, Task* task);
+    bool drainInbox(int worker);
+    bool stealFrom(int victim, Task* task);
+
+    public:
+    StealingPool(const char* poolName, int workers);
+    ~StealingPool();
+
+    StealingPool(const StealingPool&) = delete;
+    StealingPool& operator=(const StealingPool &) = delete;
+
+    void enqueue(Task task) override;
+    void enqueueBatch(std::span<const Task> tasks) override;
+    void start() override;
+    void join() override;
+
+    int size() const override { return numWorkers; }
+    void report(FILE* out) const override;
+};
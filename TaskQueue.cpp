@@ -1,13 +1,116 @@
+#include "EventLog.h"
+#include "RequestHandlers.h"
 #include "TaskQueue.h"
 #include "sthread.h"
-#include <queue>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+
+using namespace std;
+
+static const char* backendNames[NUM_QUEUE_BACKENDS] = { "monitor", "ring" };
+
+const char*
+queue_backend_name(QueueBackend backend)
+{
+    return backendNames[backend];
+}
+
+bool
+queue_backend_parse(const char* name, QueueBackend* backend)
+{
+    for (int i = 0; i < NUM_QUEUE_BACKENDS; i++)
+    {
+        if (strcmp(name, backendNames[i]) == 0)
+        {
+            *backend = (QueueBackend)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char* policyNames[NUM_OVERFLOW_POLICIES] = {
+    "block", "try", "drop-oldest", "shed-customers"
+};
+
+const char*
+overflow_policy_name(OverflowPolicy policy)
+{
+    return policyNames[policy];
+}
+
+bool
+overflow_policy_parse(const char* name, OverflowPolicy* policy)
+{
+    for (int i = 0; i < NUM_OVERFLOW_POLICIES; i++)
+    {
+        if (strcmp(name, policyNames[i]) == 0)
+        {
+            *policy = (OverflowPolicy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char* priorityNames[NUM_TASK_PRIORITIES] = { "unblock", "purchase", "default" };
+
+const char*
+task_priority_name(TaskPriority priority)
+{
+    return priorityNames[priority];
+}
+
+// wake up to count of the waiters blocked on cond
+static void
+signal_waiters(scond_t* cond, smutex_t* mutex, int waiters, int count)
+{
+    if (count <= 0 || waiters == 0)
+    {
+        return;
+    }
+    if (count >= waiters)
+    {
+        scond_broadcast(cond, mutex);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        scond_signal(cond, mutex);
+    }
+}
 
 TaskQueue::
-TaskQueue()
+TaskQueue(QueueBackend queueBackend, size_t maxTasks, OverflowPolicy overflow, LockKind lockKind)
+    : backend(queueBackend), policy(overflow), capacity(maxTasks), cells(NULL), mask(0),
+      enqueuePos(0), dequeuePos(0), enqueued(0), rejected(0), dropped(0), producerWaits(0)
 {
-    smutex_init(&mutex);
+    smutex_init_kind(&mutex, lockKind);
     scond_init(&cond);
+    scond_init(&notFullCond);
     queueSize = 0;
+    waiting = 0;
+    producersWaiting = 0;
+
+    if (backend == QUEUE_RING)
+    {
+        // the ring indexes with a mask, so round up to a power of two
+        size_t size = 2;
+        while (size < (maxTasks > 0 ? maxTasks : DEFAULT_RING_CAPACITY))
+        {
+            size <<= 1;
+        }
+        cells = new RingCell[size];
+        for (size_t i = 0; i < size; i++)
+        {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+        mask = size - 1;
+        capacity = size;
+    }
 }
 
 TaskQueue::
@@ -15,6 +118,58 @@ TaskQueue::
 {
     smutex_destroy(&mutex);
     scond_destroy(&cond);
+    scond_destroy(&notFullCond);
+    delete[] cells;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * stats --
+ *
+ *      Return the queue's admission counters.
+ *
+ * Results:
+ *      A snapshot of the counters.
+ *
+ * ------------------------------------------------------------------
+ */
+QueueStats TaskQueue::
+stats() const
+{
+    QueueStats snapshot;
+    snapshot.enqueued = enqueued.load(memory_order_relaxed);
+    snapshot.rejected = rejected.load(memory_order_relaxed);
+    snapshot.dropped = dropped.load(memory_order_relaxed);
+    snapshot.producerWaits = producerWaits.load(memory_order_relaxed);
+    return snapshot;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * discard --
+ *
+ *      Give up on a task that will never run: count it, log it at
+ *      EVENT_DEBUG, and free what it owns (see dispose_task).
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+discard(const Task& task, atomic<long>* counter)
+{
+    assert(task.kind != TASK_CONTROL);
+    counter->fetch_add(1, memory_order_relaxed);
+    EventRecord* event = event_begin(EVENT_DEBUG, EVENT_TASK_DISCARDED);
+    if (event != NULL)
+    {
+        event->item_id = task.affinity;
+        event->quantity = task.type;
+        event->outcome = counter == &dropped;
+        event_commit(event);
+    }
+    dispose_task(task);
 }
 
 /*
@@ -31,6 +186,14 @@ TaskQueue::
 int TaskQueue::
 size()
 {
+    if (backend == QUEUE_RING)
+    {
+        // a snapshot; may be stale by the time it is used
+        size_t head = dequeuePos.load(memory_order_relaxed);
+        size_t tail = enqueuePos.load(memory_order_relaxed);
+        return tail > head ? (int)(tail - head) : 0;
+    }
+
     smutex_lock(&mutex);
     int tmpSize = queueSize;
     smutex_unlock(&mutex);
@@ -51,6 +214,11 @@ size()
 bool TaskQueue::
 empty()
 {
+    if (backend == QUEUE_RING)
+    {
+        return size() == 0;
+    }
+
     smutex_lock(&mutex);
     bool empty = false;
     // check if the queue is empty
@@ -62,11 +230,21 @@ empty()
     return empty; // Keep compiler happy until routine done.
 }
 
+void TaskSink::
+enqueueBatch(span<const Task> tasks)
+{
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        enqueue(tasks[i]);
+    }
+}
+
 /*
  * ------------------------------------------------------------------
  * enqueue --
  *
- *      Insert the task at the back of the queue.
+ *      Insert the task at the back of the queue. With the ring
+ *      backend, block while the ring is full.
  *
  * Results:
  *      None.
@@ -76,15 +254,251 @@ empty()
 void TaskQueue::
 enqueue(Task task)
 {
+    enqueueBatch(span<const Task>(&task, 1));
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueBatch --
+ *
+ *      Insert the tasks at the back of the queue, in order, and
+ *      wake up to one blocked consumer per task. Where the queue is
+ *      full, apply its OverflowPolicy. Consumers are told about the
+ *      tasks already in before the producer waits for room.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+enqueueBatch(span<const Task> tasks)
+{
+    if (tasks.empty())
+    {
+        return;
+    }
+
+    int unannounced = 0;
+    if (backend == QUEUE_RING)
+    {
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            if (ringAdmit(tasks[i], &unannounced))
+            {
+                unannounced++;
+            }
+        }
+        if (unannounced > 0)
+        {
+            notEmpty.notify(unannounced);
+        }
+        return;
+    }
+
     smutex_lock(&mutex);
-    // enqueue a task
-    queue.push(task);
-    // increase the size
-    queueSize++;
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        if (monitorAdmit(tasks[i], &unannounced))
+        {
+            // enqueue a task
+            queue.push_back(tasks[i]);
+            // increase the size
+            queueSize++;
+            unannounced++;
+        }
+    }
+    // wake one waiter per new task
+    wakeConsumers(unannounced);
+    smutex_unlock(&mutex);
+}
 
-    // wake any waiters
-    scond_broadcast(&cond, &mutex);
+/*
+ * ------------------------------------------------------------------
+ * tryEnqueue --
+ *
+ *      Insert the task unless the queue is full, whatever the
+ *      queue's policy. Never waits.
+ *
+ * Results:
+ *      true if the task was enqueued. false if the queue was full;
+ *      the task is counted as rejected but left to the caller.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+tryEnqueue(Task task)
+{
+    if (backend == QUEUE_RING)
+    {
+        if (!ringPush(task))
+        {
+            rejected.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        enqueued.fetch_add(1, memory_order_relaxed);
+        notEmpty.notify();
+        return true;
+    }
+
+    smutex_lock(&mutex);
+    bool admitted = capacity == 0 || (size_t)queueSize < capacity;
+    if (admitted)
+    {
+        queue.push_back(task);
+        queueSize++;
+        enqueued.fetch_add(1, memory_order_relaxed);
+        wakeConsumers(1);
+    }
+    else
+    {
+        rejected.fetch_add(1, memory_order_relaxed);
+    }
     smutex_unlock(&mutex);
+    return admitted;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * monitorAdmit --
+ *
+ *      Make room for the task in the monitor queue, per the
+ *      overflow policy: drop an older task, reject this one, or
+ *      wait. Must be called with the mutex held; *unannounced
+ *      tasks already queued by the caller are announced to
+ *      consumers before waiting.
+ *
+ * Results:
+ *      true if the caller may queue the task, false if it was
+ *      rejected (and disposed).
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+monitorAdmit(const Task& task, int* unannounced)
+{
+    while (capacity != 0 && (size_t)queueSize >= capacity)
+    {
+        if (task.kind != TASK_CONTROL)
+        {
+            if (policy == OVERFLOW_TRY
+                || (policy == OVERFLOW_SHED_CUSTOMERS && task.kind == TASK_CUSTOMER))
+            {
+                discard(task, &rejected);
+                return false;
+            }
+            if (policy == OVERFLOW_DROP_OLDEST || policy == OVERFLOW_SHED_CUSTOMERS)
+            {
+                // the oldest task this policy may drop; stops are never dropped
+                deque<Task>::iterator victim = queue.begin();
+                while (victim != queue.end()
+                       && (victim->kind == TASK_CONTROL
+                           || (policy == OVERFLOW_SHED_CUSTOMERS && victim->kind != TASK_CUSTOMER)))
+                {
+                    ++victim;
+                }
+                if (victim != queue.end())
+                {
+                    Task old = *victim;
+                    queue.erase(victim);
+                    queueSize--;
+                    discard(old, &dropped);
+                    continue;
+                }
+            }
+        }
+
+        // wait for a consumer to make room
+        wakeConsumers(*unannounced);
+        *unannounced = 0;
+        producersWaiting++;
+        producerWaits.fetch_add(1, memory_order_relaxed);
+        scond_wait(&notFullCond, &mutex);
+        producersWaiting--;
+    }
+    enqueued.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ringAdmit --
+ *
+ *      Push the task onto the ring, applying the overflow policy
+ *      while the ring is full. The ring cannot remove from the
+ *      middle, so dropping always takes the oldest task; a stop
+ *      task taken that way is pushed back at the tail. *unannounced
+ *      tasks already pushed by the caller are announced before the
+ *      producer parks.
+ *
+ * Results:
+ *      true if the task was pushed, false if it was rejected (and
+ *      disposed).
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+ringAdmit(const Task& task, int* unannounced)
+{
+    for (;;)
+    {
+        if (ringPush(task))
+        {
+            enqueued.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+
+        if (task.kind != TASK_CONTROL)
+        {
+            if (policy == OVERFLOW_TRY
+                || (policy == OVERFLOW_SHED_CUSTOMERS && task.kind == TASK_CUSTOMER))
+            {
+                discard(task, &rejected);
+                return false;
+            }
+            if (policy == OVERFLOW_DROP_OLDEST)
+            {
+                Task old;
+                if (ringPop(&old))
+                {
+                    if (old.kind == TASK_CONTROL)
+                    {
+                        // already counted as enqueued once
+                        ringAdmit(old, unannounced);
+                        enqueued.fetch_sub(1, memory_order_relaxed);
+                    }
+                    else
+                    {
+                        discard(old, &dropped);
+                    }
+                }
+                continue;
+            }
+        }
+
+        // full: consumers must hear about our tasks before we sleep
+        if (*unannounced > 0)
+        {
+            notEmpty.notify(*unannounced);
+            *unannounced = 0;
+        }
+        producerWaits.fetch_add(1, memory_order_relaxed);
+        uint32_t key = notFull.prepareWait();
+        if (ringPush(task))
+        {
+            notFull.cancelWait(key);
+            enqueued.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+        notFull.commitWait(key);
+    }
+}
+
+// wake one blocked consumer per task, up to all of them
+void TaskQueue::
+wakeConsumers(int count)
+{
+    signal_waiters(&cond, &mutex, waiting, count);
 }
 
 /*
@@ -102,22 +516,170 @@ enqueue(Task task)
 Task TaskQueue::
 dequeue()
 {
+    Task task;
+    dequeueBatch(&task, 1);
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeueBatch --
+ *
+ *      Remove up to max tasks from the front of the queue into out,
+ *      in order. Blocks only while the queue is empty. The monitor
+ *      backend also leaves an even share of the queued tasks to
+ *      each consumer still blocked, so one caller cannot hoard a
+ *      burst while others idle.
+ *
+ * Results:
+ *      The number of tasks removed, at least 1.
+ *
+ * ------------------------------------------------------------------
+ */
+size_t TaskQueue::
+dequeueBatch(Task* out, size_t max)
+{
+    assert(max > 0);
+    if (backend == QUEUE_RING)
+    {
+        size_t count = 0;
+        for (;;)
+        {
+            while (count < max && ringPop(&out[count]))
+            {
+                count++;
+            }
+            if (count > 0)
+            {
+                break;
+            }
+            // empty: park until a producer fills a cell
+            uint32_t key = notEmpty.prepareWait();
+            if (ringPop(&out[0]))
+            {
+                notEmpty.cancelWait(key);
+                count = 1;
+                continue;
+            }
+            notEmpty.commitWait(key);
+        }
+        notFull.notify((int)count);
+        return count;
+    }
+
     smutex_lock(&mutex);
     while (queueSize == 0)
     {
         // wait until there is a task to dequeue
+        waiting++;
         scond_wait(&cond, &mutex);
+        waiting--;
     }
-    // dequeue the task and return it
-    Task task = queue.front();
-    queue.pop();
-    // decrease the size
-    queueSize--;
-    
-    // wake any waiters
-    scond_broadcast(&cond, &mutex);
+    // take no more than our share, leaving the rest to blocked consumers
+    size_t share = (queueSize + waiting) / (waiting + 1);
+    max = min(max, share);
+
+    // dequeue the tasks and return them
+    size_t count = 0;
+    while (count < max && queueSize > 0)
+    {
+        out[count++] = queue.front();
+        queue.pop_front();
+        queueSize--;
+    }
+    // one producer waiting for room per slot freed
+    signal_waiters(&notFullCond, &mutex, producersWaiting, (int)count);
     smutex_unlock(&mutex);
-    return task; // Keep compiler happy until routine done.
+    return count;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * ringPush --
+ *
+ *      Try to claim the next enqueue position and fill its cell.
+ *      A cell is free for position pos when its sequence is pos;
+ *      publishing the task sets it to pos + 1.
+ *
+ * Results:
+ *      true if the task was enqueued, false if the ring is full.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+ringPush(const Task& task)
+{
+    size_t pos = enqueuePos.load(memory_order_relaxed);
+    RingCell* cell;
+    for (;;)
+    {
+        cell = &cells[pos & mask];
+        size_t sequence = cell->sequence.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // the cell still holds the task from one lap ago
+            return false;
+        }
+        else
+        {
+            pos = enqueuePos.load(memory_order_relaxed);
+        }
+    }
+    cell->task = task;
+    cell->sequence.store(pos + 1, memory_order_release);
+    return true;
+}
 
+/*
+ * ------------------------------------------------------------------
+ * ringPop --
+ *
+ *      Try to claim the next dequeue position and take its task. A
+ *      cell is full for position pos when its sequence is pos + 1;
+ *      emptying it sets the sequence to pos + capacity, the
+ *      position that will next use it.
+ *
+ * Results:
+ *      true if *task was filled, false if the ring is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+ringPop(Task* task)
+{
+    size_t pos = dequeuePos.load(memory_order_relaxed);
+    RingCell* cell;
+    for (;;)
+    {
+        cell = &cells[pos & mask];
+        size_t sequence = cell->sequence.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // not yet filled for this lap
+            return false;
+        }
+        else
+        {
+            pos = dequeuePos.load(memory_order_relaxed);
+        }
+    }
+    *task = cell->task;
+    cell->sequence.store(pos + mask + 1, memory_order_release);
+    return true;
+}
@@ -1,34 +1,263 @@
 #pragma once
 
+#include "EventCount.h"
+#include "Request.h"
 #include "sthread.h"
-#include <queue>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <span>
+#include <type_traits>
+
+#define DEFAULT_RING_CAPACITY 1024
 
 
 typedef void (*handler_t) (void *); 
 
-struct Task {
+// what a task is, for admission control (see OverflowPolicy)
+enum TaskKind {
+    TASK_OTHER = 0,
+    TASK_SUPPLIER,
+    TASK_CUSTOMER,
+    TASK_CONTROL            // stop tasks: never rejected or dropped
+};
+
+/*
+ * ------------------------------------------------------------------
+ * TaskPriority --
+ *
+ *      Scheduling classes, most urgent first, for executors that
+ *      order tasks (see PriorityScheduler); the others run tasks in
+ *      the order they were enqueued.
+ *
+ *      PRIORITY_UNBLOCK    changes that can let waiting buyers
+ *                          through: new items, restocks, price
+ *                          drops, and resumed coroutine buyers.
+ *      PRIORITY_PURCHASE   customer requests.
+ *      PRIORITY_DEFAULT    everything else, e.g. price raises.
+ *
+ * ------------------------------------------------------------------
+ */
+enum TaskPriority {
+    PRIORITY_UNBLOCK = 0,
+    PRIORITY_PURCHASE,
+    PRIORITY_DEFAULT,
+    NUM_TASK_PRIORITIES
+};
+
+const char* task_priority_name(TaskPriority priority);
+
+// the payload of a REQ_CALL task: handler(arg)
+struct CallReq {
     handler_t handler;
     void* arg;
 };
 
+/*
+ * ------------------------------------------------------------------
+ * TaskPayload --
+ *
+ *      The request a task carries, held in the task itself so that
+ *      handing a request to an executor allocates nothing. The
+ *      member in use is the one of the task's RequestType. Small
+ *      requests are held by value; supplier batches and carts are
+ *      held by pointer to an object from their SlabPool, which the
+ *      task owns (see dispose_task).
+ *
+ *      Tasks are copied by value between queues, so every member
+ *      must stay trivially copyable.
+ *
+ * ------------------------------------------------------------------
+ */
+union TaskPayload {
+    CallReq call;
+    AddItemReq addItem;
+    RemoveItemReq removeItem;
+    AddStockReq addStock;
+    ChangeItemPriceReq changeItemPrice;
+    ChangeItemDiscountReq changeItemDiscount;
+    SetShippingCostReq setShippingCost;
+    SetStoreDiscountReq setStoreDiscount;
+    BuyItemReq buyItem;
+    SupplierBatchReq* supplierBatch;
+    BuyManyItemsReq* buyManyItems;
+    CheckoutReq* checkout;
+};
+
+static_assert(std::is_trivially_copyable_v<TaskPayload>, "tasks are copied by value");
+
+struct Task {
+    RequestType type = REQ_CALL;
+    TaskKind kind = TASK_OTHER;
+    int affinity = -1;          // item the task works on, for executors that
+                                // route by item (see ShardedPool); -1 for none
+    TaskPriority priority = PRIORITY_DEFAULT;
+    double deadline = 0;        // when the task should start by, in sutil_now
+                                // seconds, for executors that order by it; 0 for none
+    TaskPayload payload = {};
+};
+
+static_assert(sizeof(Task) <= CACHE_LINE_SIZE, "a task fits in a cache line");
+
+// a REQ_CALL task that runs handler(arg)
+inline Task
+call_task(handler_t handler, void* arg)
+{
+    Task task;
+    task.payload.call = CallReq{ handler, arg };
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * QueueBackend --
+ *
+ *      How a TaskQueue stores its tasks.
+ *
+ *      QUEUE_MONITOR   a std::deque behind a mutex and condition
+ *                      variables, unbounded by default.
+ *      QUEUE_RING      a fixed-capacity lock-free ring (see
+ *                      TaskQueue), DEFAULT_RING_CAPACITY by default.
+ *
+ * ------------------------------------------------------------------
+ */
+enum QueueBackend {
+    QUEUE_MONITOR = 0,
+    QUEUE_RING,
+    NUM_QUEUE_BACKENDS
+};
+
+/*
+ * ------------------------------------------------------------------
+ * TaskSink --
+ *
+ *      Anything that tasks can be handed to: a TaskQueue, or an
+ *      Executor that distributes them among its workers.
+ *      enqueueBatch hands over several tasks in order; sinks that
+ *      can do it with less synchronization than one enqueue per
+ *      task override it.
+ *
+ * ------------------------------------------------------------------
+ */
+class TaskSink {
+    public:
+    virtual ~TaskSink() { }
+    virtual void enqueue(Task task) = 0;
+    virtual void enqueueBatch(std::span<const Task> tasks);
+};
+
+const char* queue_backend_name(QueueBackend backend);
+bool queue_backend_parse(const char* name, QueueBackend* backend);
+
+/*
+ * ------------------------------------------------------------------
+ * OverflowPolicy --
+ *
+ *      What enqueue does with a task when a bounded TaskQueue is
+ *      full. TASK_CONTROL tasks always wait for room instead.
+ *
+ *      OVERFLOW_BLOCK          wait for a consumer to make room.
+ *      OVERFLOW_TRY            reject the new task.
+ *      OVERFLOW_DROP_OLDEST    drop the oldest queued task to make
+ *                              room for the new one.
+ *      OVERFLOW_SHED_CUSTOMERS reject a new TASK_CUSTOMER task;
+ *                              make room for any other by dropping
+ *                              the oldest queued customer task, or
+ *                              wait if there is none.
+ *
+ *      Rejected and dropped tasks are never run: dispose_task
+ *      frees whatever their payload owns.
+ *
+ * ------------------------------------------------------------------
+ */
+enum OverflowPolicy {
+    OVERFLOW_BLOCK = 0,
+    OVERFLOW_TRY,
+    OVERFLOW_DROP_OLDEST,
+    OVERFLOW_SHED_CUSTOMERS,
+    NUM_OVERFLOW_POLICIES
+};
+
+const char* overflow_policy_name(OverflowPolicy policy);
+bool overflow_policy_parse(const char* name, OverflowPolicy* policy);
+
+// a TaskQueue's admission counters
+struct QueueStats {
+    long enqueued;          // tasks admitted
+    long rejected;          // new tasks turned away (including tryEnqueue failures)
+    long dropped;           // queued tasks evicted to admit newer ones
+    long producerWaits;     // times a producer waited for room
+};
+
+// one ring slot; sequence says whose turn it is to use the slot
+struct alignas(CACHE_LINE_SIZE) RingCell {
+    std::atomic<size_t> sequence;
+    Task task;
+};
+
 /*
  * ------------------------------------------------------------------
  * TaskQueue --
  * 
- *      A thread-safe task queue. This queue should be implemented
- *      as a monitor.
+ *      A thread-safe task queue, with the backend chosen at
+ *      construction.
+ *
+ *      The monitor backend is the original one. It wakes one
+ *      blocked consumer per task enqueued, and none if nobody is
+ *      blocked. It is unbounded unless given a capacity. Its mutex
+ *      is of the LockKind given at construction.
+ *
+ *      The ring backend is a bounded multi-producer multi-consumer
+ *      queue in the style of Dmitry Vyukov's: each cell carries a
+ *      sequence number, and producers and consumers claim positions
+ *      with a CAS on their own (cache line padded) counter, so an
+ *      enqueue or dequeue touches no lock. A consumer that finds
+ *      the ring empty parks on the notEmpty EventCount, and a
+ *      producer that finds it full parks on notFull; each side
+ *      notifies the other only if someone is parked.
+ *
+ *      enqueueBatch and dequeueBatch move several tasks for the
+ *      synchronization cost of about one: one lock acquisition and
+ *      wakeup pass with the monitor, and one notify with the ring.
+ *
+ *      When a bounded queue is full, enqueue applies the queue's
+ *      OverflowPolicy. tryEnqueue never waits and never disposes:
+ *      it returns false and the caller keeps the task.
  *
  * ------------------------------------------------------------------
  */
-class TaskQueue {
+class TaskQueue final : public TaskSink {
     private:
+    const QueueBackend backend;
+
+    const OverflowPolicy policy;
+    size_t capacity;        // 0: unbounded (monitor only)
+
+    // QUEUE_MONITOR
     int queueSize;
-    std::queue<Task> queue;
+    int waiting;            // consumers blocked in cond
+    int producersWaiting;   // producers blocked in notFullCond
+    std::deque<Task> queue;
     smutex_t mutex;
     scond_t cond;
+    scond_t notFullCond;
+
+    // QUEUE_RING
+    RingCell* cells;
+    size_t mask;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> enqueuePos;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> dequeuePos;
+    alignas(CACHE_LINE_SIZE) EventCount notEmpty;
+    EventCount notFull;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<long> enqueued;
+    std::atomic<long> rejected;
+    std::atomic<long> dropped;
+    std::atomic<long> producerWaits;
 
     public:
-    TaskQueue();
+    explicit TaskQueue(QueueBackend queueBackend = QUEUE_MONITOR, size_t maxTasks = 0,
+                       OverflowPolicy overflow = OVERFLOW_BLOCK, LockKind lockKind = LOCK_BLOCKING);
     ~TaskQueue();
     
     // no default copy constructor and assignment operators. this will prevent some
@@ -36,12 +265,26 @@ class TaskQueue {
     TaskQueue(const TaskQueue&) = delete;
     TaskQueue& operator=(const TaskQueue &) = delete;
 
-    void enqueue(Task task);
+    void enqueue(Task task) override;
+    void enqueueBatch(std::span<const Task> tasks) override;
+    bool tryEnqueue(Task task);
     Task dequeue();
+    size_t dequeueBatch(Task* out, size_t max);
+
+    QueueBackend queueBackend() const { return backend; }
+    OverflowPolicy overflowPolicy() const { return policy; }
+    size_t maxSize() const { return capacity; }
+    QueueStats stats() const;
 
     private:
     int size();
     bool empty();
+    bool ringPush(const Task& task);
+    bool ringPop(Task* task);
+    bool ringAdmit(const Task& task, int* unannounced);
+    bool monitorAdmit(const Task& task, int* unannounced);
+    void wakeConsumers(int count);
+    void discard(const Task& task, std::atomic<long>* counter);
 };
 
 
@@ -0,0 +1,149 @@
+#include <cassert>
+#include <cstdio>
+
+#include "RequestHandlers.h"
+#include "WorkerPool.h"
+#include "sthread.h"
+
+WorkerPool::
+WorkerPool(const char* poolName, TaskQueue* taskQueue, int workers)
+    : name(poolName), queue(taskQueue), numWorkers(workers), nextWorker(0), running(false)
+{
+    assert(numWorkers > 0);
+    threads = new sthread_t[numWorkers];
+    stats = new WorkerStats[numWorkers]();
+    smutex_init(&lock);
+}
+
+WorkerPool::
+~WorkerPool()
+{
+    assert(!running);
+    smutex_destroy(&lock);
+    delete[] threads;
+    delete[] stats;
+}
+
+void* WorkerPool::
+workerMain(void* arg)
+{
+    WorkerPool* pool = (WorkerPool*)arg;
+
+    smutex_lock(&pool->lock);
+    int worker = pool->nextWorker++;
+    smutex_unlock(&pool->lock);
+
+    sthread_pin(pool->cpuOf(worker));
+    pool->work(worker);
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * work --
+ *
+ *      The loop of one worker: run tasks from the queue, a batch at
+ *      a time, until a batch holds a stop task. The rest of that
+ *      batch is still run, except other stops, which go back.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkerPool::
+work(int worker)
+{
+    WorkerStats& mine = stats[worker];
+    mine.started = sutil_now();
+    Task batch[WORKER_DEQUEUE_BATCH];
+    Task stop;
+    int stops = 0;
+    while (stops == 0)
+    {
+        size_t count = queue->dequeueBatch(batch, WORKER_DEQUEUE_BATCH);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (task_is_stop(batch[i]))
+            {
+                stop = batch[i];
+                stops++;
+                continue;
+            }
+            double begin = sutil_now();
+            run_task(batch[i]);
+            mine.busySeconds += sutil_now() - begin;
+            mine.tasks++;
+        }
+    }
+    // stops beyond our own belong to other workers
+    for (int i = 1; i < stops; i++)
+    {
+        queue->enqueue(stop);
+    }
+    run_task(stop);
+    mine.stopped = sutil_now();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * start --
+ *
+ *      Create the worker threads.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkerPool::
+start()
+{
+    assert(!running);
+    running = true;
+    for (int i = 0; i < numWorkers; i++)
+    {
+        sthread_create(&threads[i], workerMain, this);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * join --
+ *
+ *      Wait until every worker has run its stop task and exited.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkerPool::
+join()
+{
+    assert(running);
+    for (int i = 0; i < numWorkers; i++)
+    {
+        sthread_join(threads[i]);
+    }
+    running = false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * report --
+ *
+ *      Print the pool's per-worker throughput (see report_workers).
+ *      Must be called after join.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkerPool::
+report(FILE* out) const
+{
+    assert(!running);
+    report_workers(out, name, stats, numWorkers, false);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "Executor.h"
+#include "TaskQueue.h"
+#include "sthread.h"
+#include <cstdio>
+
+// most tasks a worker takes from the queue at once
+#define WORKER_DEQUEUE_BATCH 8
+
+/*
+ * ------------------------------------------------------------------
+ * WorkerPool --
+ *
+ *      A fixed set of threads serving one TaskQueue. Each worker
+ *      dequeues and runs tasks until it dequeues a stop task (see
+ *      RequestGenerator::enqueueStops), then returns normally.
+ *      Stop tasks queue behind the work already enqueued, so a pool
+ *      stopped that way drains its queue before it exits.
+ *
+ *      Tasks enqueued to the pool go straight to its queue.
+ *      Workers take up to WORKER_DEQUEUE_BATCH tasks per dequeue
+ *      (see TaskQueue::dequeueBatch for how a burst is shared).
+ *
+ * ------------------------------------------------------------------
+ */
+class WorkerPool final : public Executor {
+    private:
+    const char* name;
+    TaskQueue* queue;
+    int numWorkers;
+    sthread_t* threads;
+    WorkerStats* stats;
+    int nextWorker;
+    smutex_t lock;
+    bool running;
+
+    static void* workerMain(void* arg);
+    void work(int worker);
+
+    public:
+    WorkerPool(const char* poolName, TaskQueue* taskQueue, int workers);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool &) = delete;
+
+    void enqueue(Task task) override { queue->enqueue(task); }
+    void enqueueBatch(std::span<const Task> tasks) override { queue->enqueueBatch(tasks); }
+    void start() override;
+    void join() override;
+
+    int size() const override { return numWorkers; }
+    void report(FILE* out) const override;
+};
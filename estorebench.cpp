@@ -0,0 +1,1880 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <new>
+#include <span>
+#include <vector>
+#include <unistd.h>
+
+#include "EStore.h"
+#include "PriorityPool.h"
+#include "RequestGenerator.h"
+#include "RequestHandlers.h"
+#include "ShardedPool.h"
+#include "StealingPool.h"
+#include "TaskQueue.h"
+#include "WorkerPool.h"
+#include "sthread.h"
+
+
+// heap allocations made so far, counted by the operator new below
+static std::atomic<long> allocations;
+static std::atomic<long> allocatedBytes;
+
+void*
+operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    void* block = malloc(size > 0 ? size : 1);
+    if (block == NULL)
+        throw std::bad_alloc();
+    return block;
+}
+
+void
+operator delete(void* block) noexcept
+{
+    free(block);
+}
+
+void
+operator delete(void* block, size_t size) noexcept
+{
+    free(block);
+}
+
+static double
+nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+residentMB()
+{
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL)
+    {
+        if (fscanf(statm, "%*s %ld", &pages) != 1)
+            pages = 0;
+        fclose(statm);
+    }
+    return pages * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * waitForParked --
+ *
+ *      Spin (with short sleeps) until exactly "count" buyers are
+ *      blocked in the store.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+waitForParked(EStore* store, long count)
+{
+    while (store->wakeupStats().parked != count)
+    {
+        sthread_sleep(0, 1000000);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * WakeupBench --
+ *
+ *      Shared state for the wakeup benchmarks. Buyer thread number
+ *      i blocks in buyItem on item (i % DEFAULT_INVENTORY_SIZE) with a
+ *      budget of budgets[i / DEFAULT_INVENTORY_SIZE].
+ *
+ * ------------------------------------------------------------------
+ */
+struct WakeupBench {
+    EStore* store;
+    int nextBuyer;
+    smutex_t lock;
+    std::vector<double> budgets;
+};
+
+static void*
+wakeupBuyer(void* arg)
+{
+    WakeupBench* bench = (WakeupBench*)arg;
+
+    smutex_lock(&bench->lock);
+    int index = bench->nextBuyer++;
+    smutex_unlock(&bench->lock);
+
+    bench->store->buyItem(index % DEFAULT_INVENTORY_SIZE, bench->budgets[index / DEFAULT_INVENTORY_SIZE]);
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * startBuyers --
+ *
+ *      Start one buyer thread per entry of bench->budgets per item
+ *      and wait until all of them are blocked.
+ *
+ * Results:
+ *      The buyer threads, to be passed to joinBuyers.
+ *
+ * ------------------------------------------------------------------
+ */
+static sthread_t*
+startBuyers(WakeupBench* bench)
+{
+    int buyers = bench->budgets.size() * DEFAULT_INVENTORY_SIZE;
+    sthread_t* threads = new sthread_t[buyers];
+
+    bench->nextBuyer = 0;
+    for (int i = 0; i < buyers; i++)
+    {
+        sthread_create(&threads[i], wakeupBuyer, bench);
+    }
+    waitForParked(bench->store, buyers);
+    return threads;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * joinBuyers --
+ *
+ *      Remove every item to release the remaining buyers, then
+ *      join all buyer threads.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+joinBuyers(WakeupBench* bench, sthread_t* threads)
+{
+    int buyers = bench->budgets.size() * DEFAULT_INVENTORY_SIZE;
+
+    for (int i = 0; i < DEFAULT_INVENTORY_SIZE; i++)
+    {
+        bench->store->removeItem(i);
+    }
+    for (int i = 0; i < buyers; i++)
+    {
+        sthread_join(threads[i]);
+    }
+    delete[] threads;
+}
+
+static void
+printWakeups(const WakeupStats& before, const WakeupStats& after)
+{
+    long count = after.mutations - before.mutations;
+    printf("  store-wide condvar:  %8.2f wakeups/mutation\n",
+           (double)(after.herd - before.herd) / count);
+    printf("  per-item condvars:   %8.2f wakeups/mutation\n",
+           (double)(after.itemHerd - before.itemHerd) / count);
+    printf("  budget-ordered list: %8.2f wakeups/mutation\n",
+           (double)(after.wakeups - before.wakeups) / count);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchWakeups --
+ *
+ *      Park "buyers" coarse mode buyers spread evenly over the
+ *      inventory, then restock one unit of an item at a time and
+ *      count how many buyers each restock wakes. The herd column
+ *      is what a single store-wide condition variable would have
+ *      woken for the same mutations.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchWakeups(int buyers, int mutations)
+{
+    EStore store(false);
+    WakeupBench bench;
+    bench.store = &store;
+    smutex_init(&bench.lock);
+    bench.budgets.assign((buyers + DEFAULT_INVENTORY_SIZE - 1) / DEFAULT_INVENTORY_SIZE, 1000.0);
+    buyers = bench.budgets.size() * DEFAULT_INVENTORY_SIZE;
+    if (mutations > buyers)
+    {
+        mutations = buyers;
+    }
+
+    // every item is carried, affordable, and out of stock
+    for (int i = 0; i < DEFAULT_INVENTORY_SIZE; i++)
+    {
+        store.addItem(i, 0, 100.0, 0.0);
+    }
+    sthread_t* threads = startBuyers(&bench);
+    WakeupStats before = store.wakeupStats();
+
+    // each restock satisfies exactly one parked buyer
+    for (int i = 0; i < mutations; i++)
+    {
+        store.addStock(i % DEFAULT_INVENTORY_SIZE, 1);
+        waitForParked(&store, buyers - i - 1);
+    }
+    WakeupStats after = store.wakeupStats();
+    joinBuyers(&bench, threads);
+    smutex_destroy(&bench.lock);
+
+    printf("wakeups: %d buyers over %d items, %d single-unit restocks\n",
+           buyers, DEFAULT_INVENTORY_SIZE, mutations);
+    printWakeups(before, after);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchReprice --
+ *
+ *      Park "levels" buyers per item with budgets spread evenly
+ *      below 1000 on well stocked items priced at 1000, then drop
+ *      every item's price by 1000 / levels per round. Each drop
+ *      makes exactly one more buyer of that item able to afford it.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchReprice(int levels)
+{
+    EStore store(false);
+    WakeupBench bench;
+    bench.store = &store;
+    smutex_init(&bench.lock);
+    for (int j = 1; j <= levels; j++)
+    {
+        bench.budgets.push_back(1000.0 * j / levels - 50.0);
+    }
+    int buyers = levels * DEFAULT_INVENTORY_SIZE;
+
+    for (int i = 0; i < DEFAULT_INVENTORY_SIZE; i++)
+    {
+        store.addItem(i, buyers, 1000.0, 0.0);
+    }
+    sthread_t* threads = startBuyers(&bench);
+    WakeupStats before = store.wakeupStats();
+
+    int remaining = buyers;
+    for (int round = 1; round < levels; round++)
+    {
+        for (int i = 0; i < DEFAULT_INVENTORY_SIZE; i++)
+        {
+            store.priceItem(i, 1000.0 - 1000.0 * round / levels);
+            waitForParked(&store, --remaining);
+        }
+    }
+    WakeupStats after = store.wakeupStats();
+    joinBuyers(&bench, threads);
+    smutex_destroy(&bench.lock);
+
+    printf("reprice: %d buyers over %d items, %d price drops\n",
+           buyers, DEFAULT_INVENTORY_SIZE, (levels - 1) * DEFAULT_INVENTORY_SIZE);
+    printWakeups(before, after);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * CatalogBench --
+ *
+ *      Shared state for the catalog benchmark. Each worker runs
+ *      "ops" fine mode operations on random ids: three carts of up
+ *      to MAX_BUY_ITEM items for every restock and every reprice.
+ *
+ * ------------------------------------------------------------------
+ */
+struct CatalogBench {
+    EStore* store;
+    int ops;
+    smutex_t lock;
+    unsigned nextSeed;
+};
+
+static void*
+catalogWorker(void* arg)
+{
+    CatalogBench* bench = (CatalogBench*)arg;
+    EStore* store = bench->store;
+    int size = store->inventorySize();
+
+    smutex_lock(&bench->lock);
+    unsigned seed = bench->nextSeed++;
+    smutex_unlock(&bench->lock);
+
+    std::vector<CartLine> cart;
+    for (int i = 0; i < bench->ops; i++)
+    {
+        switch (i % 5)
+        {
+            case 0:
+                store->addStock(rand_r(&seed) % size, 1);
+                break;
+            case 1:
+                store->priceItem(rand_r(&seed) % size, rand_r(&seed) % 1000);
+                break;
+            default:
+            {
+                cart.clear();
+                int count = rand_r(&seed) % MAX_BUY_ITEM + 1;
+                for (int j = 0; j < count; j++)
+                {
+                    CartLine line = { (int)(rand_r(&seed) % size), 1 };
+                    cart.push_back(line);
+                }
+                store->buyManyItems(cart, MAX_BUDGET);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * fillStore --
+ *
+ *      Add every item of the store, in stock at a price of 100.
+ *
+ * Results:
+ *      The time taken, in seconds.
+ *
+ * ------------------------------------------------------------------
+ */
+static double
+fillStore(EStore* store)
+{
+    double start = nowSeconds();
+    for (int i = 0; i < store->inventorySize(); i++)
+    {
+        store->addItem(i, MAX_QUANTITY, 100.0, 0.0);
+    }
+    return nowSeconds() - start;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * runCatalogWorkers --
+ *
+ *      Run "threads" catalogWorker threads of "ops" operations each
+ *      against the store.
+ *
+ * Results:
+ *      Operations per second over all threads.
+ *
+ * ------------------------------------------------------------------
+ */
+static double
+runCatalogWorkers(EStore* store, int threads, int ops)
+{
+    CatalogBench bench;
+    bench.store = store;
+    bench.ops = ops;
+    bench.nextSeed = 1;
+    smutex_init(&bench.lock);
+
+    std::vector<sthread_t> workers(threads);
+    double start = nowSeconds();
+    for (int i = 0; i < threads; i++)
+    {
+        sthread_create(&workers[i], catalogWorker, &bench);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        sthread_join(workers[i]);
+    }
+    double seconds = nowSeconds() - start;
+    smutex_destroy(&bench.lock);
+    return (double)threads * ops / seconds;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchCatalog --
+ *
+ *      Build a fine mode store with the given catalog options, fill
+ *      it, and run "threads" workers against it. Reports the
+ *      catalog footprint, the growth in resident memory, and
+ *      operations per second.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchCatalog(const CatalogOptions& options, int threads, int ops)
+{
+    double rssBefore = residentMB();
+    EStore store(true, options);
+    double fillSeconds = fillStore(&store);
+    double rate = runCatalogWorkers(&store, threads, ops);
+
+    int size = options.inventorySize;
+    double perItemMB = (double)size * (sizeof(ItemRecord) + sizeof(smutex_t)) / (1 << 20);
+    printf("%10d items  %8.1f MB catalog  %8.1f MB rss  (%8.1f MB with a mutex per item)"
+           "  fill %6.2fs  %10.0f ops/s\n",
+           size, store.memoryUsage() / (double)(1 << 20), residentMB() - rssBefore,
+           perItemMB, fillSeconds, rate);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchLayout --
+ *
+ *      For each item layout and 8, 16 and 32 threads, run the
+ *      catalog workers against a fine mode store of "size" items,
+ *      then time full-catalog report scans.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchLayout(int size, int ops)
+{
+    static const int threadCounts[] = { 8, 16, 32 };
+
+    printf("layout: %d items, %d ops/thread\n", size, ops);
+    printf("  %-8s %10s %12s %12s %12s %14s\n",
+           "layout", "MB", "8 thr ops/s", "16 thr ops/s", "32 thr ops/s", "scan ns/item");
+    for (int layout = 0; layout < NUM_ITEM_LAYOUTS; layout++)
+    {
+        CatalogOptions options;
+        options.inventorySize = size;
+        options.stripesPerShard = size;
+        options.layout = (ItemLayout)layout;
+
+        double rates[3];
+        double scanNs = 0;
+        size_t bytes = 0;
+        for (int t = 0; t < 3; t++)
+        {
+            EStore store(true, options);
+            fillStore(&store);
+            rates[t] = runCatalogWorkers(&store, threadCounts[t], ops);
+            bytes = store.memoryUsage();
+
+            if (t == 0)
+            {
+                const int scans = 20;
+                double start = nowSeconds();
+                for (int i = 0; i < scans; i++)
+                {
+                    store.report();
+                }
+                scanNs = (nowSeconds() - start) * 1e9 / scans / size;
+            }
+        }
+        printf("  %-8s %10.1f %12.0f %12.0f %12.0f %14.2f\n",
+               item_layout_name((ItemLayout)layout), bytes / (double)(1 << 20),
+               rates[0], rates[1], rates[2], scanNs);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * supplierRows --
+ *
+ *      Build "count" random restock, reprice and rediscount rows on
+ *      ids below "items". Prices stay between 900 and 1000.
+ *
+ * Results:
+ *      The rows.
+ *
+ * ------------------------------------------------------------------
+ */
+static std::vector<SupplierMutation>
+supplierRows(int count, int items, unsigned seed)
+{
+    std::vector<SupplierMutation> rows(count);
+    for (int i = 0; i < count; i++)
+    {
+        SupplierMutation& row = rows[i];
+        row.item_id = rand_r(&seed) % items;
+        switch (rand_r(&seed) % 3)
+        {
+            case 0:
+                row.type = ADD_STOCK;
+                row.quantity = 1;
+                break;
+            case 1:
+                row.type = CHANGE_ITEM_PRICE;
+                row.price = 900 + rand_r(&seed) % 100;
+                break;
+            default:
+                row.type = CHANGE_ITEM_DISCOUNT;
+                row.discount = (rand_r(&seed) % 5) / 100.0;
+                break;
+        }
+    }
+    return rows;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * applyRows --
+ *
+ *      Apply the rows to the store, one call per row when "batch"
+ *      is 0, otherwise "batch" rows per applyBatch call.
+ *
+ * Results:
+ *      The time taken, in seconds.
+ *
+ * ------------------------------------------------------------------
+ */
+static double
+applyRows(EStore* store, const std::vector<SupplierMutation>& rows, int batch)
+{
+    double start = nowSeconds();
+    if (batch > 0)
+    {
+        for (size_t i = 0; i < rows.size(); i += batch)
+        {
+            size_t count = std::min(rows.size() - i, (size_t)batch);
+            store->applyBatch(std::span<const SupplierMutation>(rows.data() + i, count));
+        }
+        return nowSeconds() - start;
+    }
+
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        const SupplierMutation& row = rows[i];
+        switch (row.type)
+        {
+            case ADD_STOCK:
+                store->addStock(row.item_id, row.quantity);
+                break;
+            case CHANGE_ITEM_PRICE:
+                store->priceItem(row.item_id, row.price);
+                break;
+            default:
+                store->discountItem(row.item_id, row.discount);
+                break;
+        }
+    }
+    return nowSeconds() - start;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchBatch --
+ *
+ *      Apply the same "rows" supplier rows one call at a time and
+ *      through applyBatch, "batch" rows per call. Throughput is
+ *      measured in both modes on a 10000 item catalog. Then, with
+ *      one coarse mode buyer parked on every item but priced out,
+ *      count the wakeup passes each path makes over the waiter
+ *      lists.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchBatch(int rows, int batch)
+{
+    printf("batch: %d rows, %d rows per batch\n", rows, batch);
+
+    CatalogOptions options;
+    options.inventorySize = 10000;
+    std::vector<SupplierMutation> bulk = supplierRows(rows, options.inventorySize, 1);
+    for (int fine = 0; fine < 2; fine++)
+    {
+        EStore single(fine, options);
+        EStore batched(fine, options);
+        fillStore(&single);
+        fillStore(&batched);
+        double singleRate = rows / applyRows(&single, bulk, 0);
+        double batchRate = rows / applyRows(&batched, bulk, batch);
+        printf("  %-6s mode:   %10.0f rows/s per request  %10.0f rows/s batched  (x%.2f)\n",
+               fine ? "fine" : "coarse", singleRate, batchRate, batchRate / singleRate);
+    }
+
+    // the rows only touch the parked buyers' items, always above their budget
+    std::vector<SupplierMutation> parkedRows = supplierRows(rows, DEFAULT_INVENTORY_SIZE, 2);
+    long passes[2];
+    long wakeups[2];
+    for (int path = 0; path < 2; path++)
+    {
+        EStore store(false);
+        WakeupBench bench;
+        bench.store = &store;
+        smutex_init(&bench.lock);
+        bench.budgets.assign(1, 500.0);
+        for (int i = 0; i < DEFAULT_INVENTORY_SIZE; i++)
+        {
+            store.addItem(i, 0, 1000.0, 0.0);
+        }
+        sthread_t* threads = startBuyers(&bench);
+        WakeupStats before = store.wakeupStats();
+        applyRows(&store, parkedRows, path == 0 ? 0 : batch);
+        WakeupStats after = store.wakeupStats();
+        joinBuyers(&bench, threads);
+        smutex_destroy(&bench.lock);
+        passes[path] = after.mutations - before.mutations;
+        wakeups[path] = after.wakeups - before.wakeups;
+    }
+    printf("  wakeup passes with %d parked buyers: %ld per request, %ld batched"
+           " (wakeups %ld / %ld)\n",
+           DEFAULT_INVENTORY_SIZE, passes[0], passes[1], wakeups[0], wakeups[1]);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ReserveBench --
+ *
+ *      Shared state for the reservation benchmark. Each worker
+ *      reserves "ops" random carts; of every four it commits two,
+ *      aborts one and leaves one to expire after "ttl" seconds.
+ *      Workers add up the units of the carts they committed.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ReserveBench {
+    EStore* store;
+    int ops;
+    double ttl;
+    smutex_t lock;
+    unsigned nextSeed;
+    long unitsSold;
+};
+
+static void*
+reserveWorker(void* arg)
+{
+    ReserveBench* bench = (ReserveBench*)arg;
+    EStore* store = bench->store;
+    int size = store->inventorySize();
+
+    smutex_lock(&bench->lock);
+    unsigned seed = bench->nextSeed++;
+    smutex_unlock(&bench->lock);
+
+    long sold = 0;
+    std::vector<CartLine> cart;
+    for (int i = 0; i < bench->ops; i++)
+    {
+        cart.clear();
+        int count = rand_r(&seed) % MAX_BUY_ITEM + 1;
+        long units = 0;
+        for (int j = 0; j < count; j++)
+        {
+            CartLine line = { (int)(rand_r(&seed) % size), (int)(rand_r(&seed) % MAX_CART_QUANTITY) + 1 };
+            cart.push_back(line);
+            units += line.quantity;
+        }
+        unsigned long id = store->reserveItems(cart, MAX_BUDGET, bench->ttl);
+        if (id == 0)
+        {
+            continue;
+        }
+        switch (i % 4)
+        {
+            case 0:
+                store->abortReservation(id);
+                break;
+            case 1:
+                // left for the sweeper
+                break;
+            default:
+                if (store->commitReservation(id))
+                {
+                    sold += units;
+                }
+                break;
+        }
+    }
+
+    smutex_lock(&bench->lock);
+    bench->unitsSold += sold;
+    smutex_unlock(&bench->lock);
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchReserve --
+ *
+ *      Run "threads" reserveWorkers against a filled fine mode
+ *      store, wait for the sweeper to expire what they left, and
+ *      check that the units still in stock plus the units sold
+ *      add up to the units the store started with.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchReserve(int threads, int ops)
+{
+    CatalogOptions options;
+    options.inventorySize = 10000;
+    EStore store(true, options);
+    fillStore(&store);
+    long unitsBefore = store.report().unitsInStock;
+
+    ReserveBench bench;
+    bench.store = &store;
+    bench.ops = ops;
+    bench.ttl = 0.05;
+    bench.nextSeed = 1;
+    bench.unitsSold = 0;
+    smutex_init(&bench.lock);
+
+    std::vector<sthread_t> workers(threads);
+    double start = nowSeconds();
+    for (int i = 0; i < threads; i++)
+    {
+        sthread_create(&workers[i], reserveWorker, &bench);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        sthread_join(workers[i]);
+    }
+    double seconds = nowSeconds() - start;
+    while (store.reservationStats().held > 0)
+    {
+        sthread_sleep(0, 10000000);
+    }
+    smutex_destroy(&bench.lock);
+
+    ReservationStats stats = store.reservationStats();
+    long unitsAfter = store.report().unitsInStock;
+    printf("reserve: %d threads, %d carts each\n", threads, ops);
+    printf("  %10.0f reservations/s  (%ld committed, %ld aborted, %ld expired)\n",
+           stats.reserved / seconds, stats.committed, stats.aborted, stats.expired);
+    printf("  stock %ld before, %ld after, %ld sold: %s\n",
+           unitsBefore, unitsAfter, bench.unitsSold,
+           unitsBefore - bench.unitsSold == unitsAfter ? "conserved" : "MISMATCH");
+}
+
+/*
+ * ------------------------------------------------------------------
+ * BlockBench --
+ *
+ *      Shared state for the blocking purchase benchmark. Buyer i
+ *      waits for a cart of items i and 7i + 1 (modulo the inventory
+ *      size) in fine mode, or for item i in coarse mode, under the
+ *      given policy and deadline. Each buyer records how late it
+ *      returned relative to the deadline, and its result.
+ *
+ * ------------------------------------------------------------------
+ */
+struct BlockBench {
+    EStore* store;
+    PurchasePolicy policy;
+    double deadline;
+    int nextBuyer;
+    smutex_t lock;
+    double maxLateness;
+    double totalLateness;
+    int results[3];
+};
+
+static void*
+blockBuyer(void* arg)
+{
+    BlockBench* bench = (BlockBench*)arg;
+    EStore* store = bench->store;
+    int size = store->inventorySize();
+
+    smutex_lock(&bench->lock);
+    int index = bench->nextBuyer++;
+    smutex_unlock(&bench->lock);
+
+    PurchaseResult result;
+    if (store->fineModeEnabled())
+    {
+        std::vector<CartLine> cart;
+        CartLine first = { index % size, 1 };
+        CartLine second = { (7 * index + 1) % size, 1 };
+        cart.push_back(first);
+        cart.push_back(second);
+        result = store->buyManyItems(cart, MAX_BUDGET, bench->policy, bench->deadline);
+    }
+    else
+    {
+        result = store->buyItem(index % size, MAX_BUDGET, bench->policy, bench->deadline);
+    }
+    double lateness = sutil_now() - bench->deadline;
+
+    smutex_lock(&bench->lock);
+    bench->results[result]++;
+    if (bench->policy == PURCHASE_DEADLINE)
+    {
+        bench->totalLateness += lateness;
+        bench->maxLateness = std::max(bench->maxLateness, lateness);
+    }
+    smutex_unlock(&bench->lock);
+    return NULL;
+}
+
+static long
+parkedBuyers(EStore* store)
+{
+    return store->fineModeEnabled() ? store->cartWaitStats().parked : store->wakeupStats().parked;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchBlocking --
+ *
+ *      Park "buyers" fine mode carts of two out of stock items with
+ *      PURCHASE_BLOCK, then restock one unit at a time until every
+ *      cart is bought, counting how many carts each restock wakes
+ *      against how many a wake-everyone scheme would. Then, in
+ *      both modes, park "buyers" PURCHASE_DEADLINE buyers on items
+ *      that never come back in stock and measure how long after
+ *      their deadline they return.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchBlocking(int buyers)
+{
+    printf("blocking: %d buyers over %d items\n", buyers, DEFAULT_INVENTORY_SIZE);
+
+    {
+        EStore store(true);
+        for (int i = 0; i < DEFAULT_INVENTORY_SIZE; i++)
+        {
+            store.addItem(i, 0, 100.0, 0.0);
+        }
+        BlockBench bench = BlockBench();
+        bench.store = &store;
+        bench.policy = PURCHASE_BLOCK;
+        smutex_init(&bench.lock);
+
+        std::vector<sthread_t> threads(buyers);
+        for (int i = 0; i < buyers; i++)
+        {
+            sthread_create(&threads[i], blockBuyer, &bench);
+        }
+        while (parkedBuyers(&store) != buyers)
+        {
+            sthread_sleep(0, 1000000);
+        }
+
+        // restock exactly what the carts need, one unit at a time
+        std::vector<int> demand(DEFAULT_INVENTORY_SIZE, 0);
+        for (int i = 0; i < buyers; i++)
+        {
+            demand[i % DEFAULT_INVENTORY_SIZE]++;
+            demand[(7 * i + 1) % DEFAULT_INVENTORY_SIZE]++;
+        }
+        long restocks = 0;
+        long herd = 0;
+        long wakeupsBefore = store.cartWaitStats().wakeups;
+        for (bool more = true; more; )
+        {
+            more = false;
+            for (int i = 0; i < DEFAULT_INVENTORY_SIZE; i++)
+            {
+                if (demand[i] > 0)
+                {
+                    herd += store.cartWaitStats().parked;
+                    store.addStock(i, 1);
+                    demand[i]--;
+                    restocks++;
+                    more = true;
+                }
+            }
+        }
+        for (int i = 0; i < buyers; i++)
+        {
+            sthread_join(threads[i]);
+        }
+        long wakeups = store.cartWaitStats().wakeups - wakeupsBefore;
+        smutex_destroy(&bench.lock);
+        printf("  fine block:      %d of %d carts bought after %ld restocks,"
+               " %.2f wakeups/restock (%.2f waking every cart)\n",
+               bench.results[PURCHASE_OK], buyers, restocks,
+               (double)wakeups / restocks, (double)herd / restocks);
+    }
+
+    for (int fine = 1; fine >= 0; fine--)
+    {
+        EStore store(fine);
+        for (int i = 0; i < DEFAULT_INVENTORY_SIZE; i++)
+        {
+            store.addItem(i, 0, 100.0, 0.0);
+        }
+        BlockBench bench = BlockBench();
+        bench.store = &store;
+        bench.policy = PURCHASE_DEADLINE;
+        bench.deadline = sutil_now() + 0.2;
+        smutex_init(&bench.lock);
+
+        std::vector<sthread_t> threads(buyers);
+        for (int i = 0; i < buyers; i++)
+        {
+            sthread_create(&threads[i], blockBuyer, &bench);
+        }
+        for (int i = 0; i < buyers; i++)
+        {
+            sthread_join(threads[i]);
+        }
+        smutex_destroy(&bench.lock);
+        printf("  %-6s deadline: %d of %d timed out, %ld still parked,"
+               " returned %.2f ms late on average (max %.2f ms)\n",
+               fine ? "fine" : "coarse", bench.results[PURCHASE_TIMED_OUT], buyers,
+               parkedBuyers(&store), bench.totalLateness * 1000 / buyers, bench.maxLateness * 1000);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * QueueBench --
+ *
+ *      Shared state for the task queue benchmark. Producers enqueue
+ *      "tasks" no-op tasks each; consumers run tasks until they
+ *      dequeue a stop task.
+ *
+ * ------------------------------------------------------------------
+ */
+struct QueueBench {
+    TaskQueue* queue;
+    int tasks;
+    int batch;
+    std::atomic<long> handled;
+};
+
+static void
+countTask(void* arg)
+{
+    ((QueueBench*)arg)->handled.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void
+stopTask(void* arg)
+{ }
+
+static void*
+queueProducer(void* arg)
+{
+    QueueBench* bench = (QueueBench*)arg;
+    Task task = call_task(countTask, bench);
+    if (bench->batch == 1)
+    {
+        for (int i = 0; i < bench->tasks; i++)
+        {
+            bench->queue->enqueue(task);
+        }
+        return NULL;
+    }
+
+    std::vector<Task> tasks(bench->batch, task);
+    for (int i = 0; i < bench->tasks; i += bench->batch)
+    {
+        int count = std::min(bench->batch, bench->tasks - i);
+        bench->queue->enqueueBatch(std::span<const Task>(tasks.data(), count));
+    }
+    return NULL;
+}
+
+static void*
+queueConsumer(void* arg)
+{
+    QueueBench* bench = (QueueBench*)arg;
+    if (bench->batch == 1)
+    {
+        for (;;)
+        {
+            Task task = bench->queue->dequeue();
+            if (task.payload.call.handler == stopTask)
+            {
+                break;
+            }
+            run_task(task);
+        }
+        return NULL;
+    }
+
+    std::vector<Task> tasks(bench->batch);
+    for (;;)
+    {
+        size_t count = bench->queue->dequeueBatch(tasks.data(), bench->batch);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (tasks[i].payload.call.handler == stopTask)
+            {
+                // leave the other consumers' stops in the queue
+                bench->queue->enqueueBatch(std::span<const Task>(tasks.data() + i + 1, count - i - 1));
+                return NULL;
+            }
+            run_task(tasks[i]);
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchQueue --
+ *
+ *      Move "tasks" tasks per producer through each TaskQueue
+ *      backend, for 1, 2 and 4 producers with as many consumers,
+ *      one task per call and then "batch" per enqueueBatch and
+ *      dequeueBatch.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchQueue(int tasks, int batch)
+{
+    static const int threadCounts[] = { 1, 2, 4 };
+
+    printf("queue: %d tasks per producer\n", tasks);
+    printf("  %-8s %6s %14s %14s %14s\n", "backend", "batch", "1x1 tasks/s", "2x2 tasks/s", "4x4 tasks/s");
+    for (int run = 0; run < 2 * NUM_QUEUE_BACKENDS; run++)
+    {
+        int backend = run % NUM_QUEUE_BACKENDS;
+        int perCall = run < NUM_QUEUE_BACKENDS ? 1 : batch;
+        double rates[3];
+        for (int t = 0; t < 3; t++)
+        {
+            int threads = threadCounts[t];
+            TaskQueue queue((QueueBackend)backend);
+            QueueBench bench;
+            bench.queue = &queue;
+            bench.tasks = tasks;
+            bench.batch = perCall;
+            bench.handled.store(0);
+
+            std::vector<sthread_t> producers(threads);
+            std::vector<sthread_t> consumers(threads);
+            double start = nowSeconds();
+            for (int i = 0; i < threads; i++)
+            {
+                sthread_create(&consumers[i], queueConsumer, &bench);
+                sthread_create(&producers[i], queueProducer, &bench);
+            }
+            for (int i = 0; i < threads; i++)
+            {
+                sthread_join(producers[i]);
+            }
+            Task stop = call_task(stopTask, NULL);
+            stop.kind = TASK_CONTROL;
+            for (int i = 0; i < threads; i++)
+            {
+                queue.enqueue(stop);
+            }
+            for (int i = 0; i < threads; i++)
+            {
+                sthread_join(consumers[i]);
+            }
+            double seconds = nowSeconds() - start;
+            assert(bench.handled.load() == (long)threads * tasks);
+            rates[t] = bench.handled.load() / seconds;
+        }
+        printf("  %-8s %6d %14.0f %14.0f %14.0f\n",
+               queue_backend_name((QueueBackend)backend), perCall, rates[0], rates[1], rates[2]);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * StealBench --
+ *
+ *      Shared state for the scheduler benchmark: every task burns
+ *      "spin" loop iterations, then counts itself.
+ *
+ * ------------------------------------------------------------------
+ */
+struct StealBench {
+    int spin;
+    std::atomic<long> handled;
+};
+
+static void
+spinTask(void* arg)
+{
+    StealBench* bench = (StealBench*)arg;
+    volatile int sink = 0;
+    for (int i = 0; i < bench->spin; i++)
+    {
+        sink = sink + i;
+    }
+    bench->handled.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchSteal --
+ *
+ *      Run "tasks" tasks through a pool of 1 to 16 workers, fed by
+ *      one producer, for each scheduler the simulator offers: a
+ *      WorkerPool on either TaskQueue backend, a StealingPool, and
+ *      a ShardedPool (the tasks have no affinity, so it deals them
+ *      round-robin).
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchSteal(int tasks, int spin)
+{
+    static const int workerCounts[] = { 1, 2, 4, 8, 16 };
+    static const int numCounts = sizeof(workerCounts) / sizeof(workerCounts[0]);
+    static const char* schedulers[] = { "monitor", "ring", "steal", "shard" };
+
+    printf("steal: %d tasks of %d spins, one producer\n", tasks, spin);
+    printf("  %-8s", "workers");
+    for (int w = 0; w < numCounts; w++)
+    {
+        printf(" %10d", workerCounts[w]);
+    }
+    printf("   (tasks/s)\n");
+    for (int kind = 0; kind < 4; kind++)
+    {
+        double rates[numCounts];
+        for (int w = 0; w < numCounts; w++)
+        {
+            StealBench bench;
+            bench.spin = spin;
+            bench.handled.store(0);
+
+            TaskQueue queue(kind == 1 ? QUEUE_RING : QUEUE_MONITOR);
+            Executor* pool;
+            if (kind == 2)
+            {
+                pool = new StealingPool("bench", workerCounts[w]);
+            }
+            else if (kind == 3)
+            {
+                pool = new ShardedPool("bench", workerCounts[w]);
+            }
+            else
+            {
+                pool = new WorkerPool("bench", &queue, workerCounts[w]);
+            }
+
+            Task task = call_task(spinTask, &bench);
+            double start = nowSeconds();
+            pool->start();
+            for (int i = 0; i < tasks; i++)
+            {
+                pool->enqueue(task);
+            }
+            pool->stop();
+            double seconds = nowSeconds() - start;
+            assert(bench.handled.load() == tasks);
+            rates[w] = tasks / seconds;
+            delete pool;
+        }
+        printf("  %-8s", schedulers[kind]);
+        for (int w = 0; w < numCounts; w++)
+        {
+            printf(" %10.0f", rates[w]);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ShardOp --
+ *
+ *      One supplier write of the shard benchmark: add a unit of
+ *      stock to an item, or reprice it.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ShardOp {
+    EStore* store;
+    int item_id;
+    bool reprice;
+    std::atomic<long>* handled;
+};
+
+static void
+shardOpTask(void* arg)
+{
+    ShardOp* op = (ShardOp*)arg;
+    if (op->reprice)
+    {
+        op->store->priceItem(op->item_id, 1 + op->item_id % 100);
+    }
+    else
+    {
+        op->store->addStock(op->item_id, 1);
+    }
+    op->handled->fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchShard --
+ *
+ *      Run "ops" fine mode item writes on random items of a
+ *      1000-item store, through a pool of 1 to 16 workers fed by
+ *      one producer: a WorkerPool on a monitor queue, whose workers
+ *      take the item locks, and a ShardedPool whose workers own
+ *      their items and skip them (EStore::setItemOwnership).
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchShard(int ops)
+{
+    static const int workerCounts[] = { 1, 2, 4, 8, 16 };
+    static const int numCounts = sizeof(workerCounts) / sizeof(workerCounts[0]);
+    static const char* schedulers[] = { "locked", "owned" };
+    const int items = 1000;
+
+    printf("shard: %d item writes on %d items, one producer\n", ops, items);
+    printf("  %-8s", "workers");
+    for (int w = 0; w < numCounts; w++)
+    {
+        printf(" %10d", workerCounts[w]);
+    }
+    printf("   (writes/s)\n");
+    for (int kind = 0; kind < 2; kind++)
+    {
+        double rates[numCounts];
+        for (int w = 0; w < numCounts; w++)
+        {
+            CatalogOptions options;
+            options.inventorySize = items;
+            EStore store(true, options);
+            for (int i = 0; i < items; i++)
+            {
+                store.addItem(i, 1, 10, 0);
+            }
+            std::atomic<long> handled(0);
+            std::vector<ShardOp> args(ops);
+            std::vector<Task> tasks(ops);
+            for (int i = 0; i < ops; i++)
+            {
+                args[i].store = &store;
+                args[i].item_id = rand() % items;
+                args[i].reprice = i % 2 == 1;
+                args[i].handled = &handled;
+                tasks[i] = call_task(shardOpTask, &args[i]);
+                tasks[i].affinity = args[i].item_id;
+            }
+
+            TaskQueue queue;
+            Executor* pool;
+            if (kind == 1)
+            {
+                store.setItemOwnership(true);
+                pool = new ShardedPool("bench", workerCounts[w]);
+            }
+            else
+            {
+                pool = new WorkerPool("bench", &queue, workerCounts[w]);
+            }
+
+            double start = nowSeconds();
+            pool->start();
+            for (int i = 0; i < ops; i++)
+            {
+                pool->enqueue(tasks[i]);
+            }
+            pool->stop();
+            double seconds = nowSeconds() - start;
+            assert(handled.load() == ops);
+            rates[w] = ops / seconds;
+            delete pool;
+        }
+        printf("  %-8s", schedulers[kind]);
+        for (int w = 0; w < numCounts; w++)
+        {
+            printf(" %10.0f", rates[w]);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * AsyncBuy --
+ *
+ *      One coroutine buyer of the coroutine benchmark, and the
+ *      counters its completion updates.
+ *
+ * ------------------------------------------------------------------
+ */
+struct AsyncBench {
+    std::atomic<long> done;
+    std::atomic<long> bought;
+};
+
+struct AsyncBuy {
+    EStore* store;
+    int item_id;
+    TaskSink* pool;
+    AsyncBench* bench;
+};
+
+static void
+asyncBuyDone(void* arg, int item_id, double budget, PurchaseResult result)
+{
+    AsyncBench* bench = (AsyncBench*)arg;
+    if (result == PURCHASE_OK)
+    {
+        bench->bought.fetch_add(1, std::memory_order_relaxed);
+    }
+    bench->done.fetch_add(1, std::memory_order_release);
+}
+
+static void
+asyncBuyTask(void* arg)
+{
+    AsyncBuy* buy = (AsyncBuy*)arg;
+    buy->store->buyItemAsync(buy->item_id, 100, PURCHASE_BLOCK, 0, buy->pool, asyncBuyDone,
+                             buy->bench);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchCoroutines --
+ *
+ *      Start "buyers" coarse mode buyItemAsync purchases of 100 out
+ *      of stock items on a pool of "threads" workers, and wait for
+ *      all of them to suspend. Report the coroutine frame memory
+ *      per suspended buyer, then restock every item and time until
+ *      each buyer has been resumed and has bought its unit.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchCoroutines(int buyers, int threads)
+{
+    const int items = 100;
+    EStore store(false);
+    for (int i = 0; i < items; i++)
+    {
+        store.addItem(i, 0, 10, 0);
+    }
+
+    AsyncBench bench;
+    bench.done.store(0);
+    bench.bought.store(0);
+    TaskQueue queue;
+    WorkerPool pool("bench", &queue, threads);
+    std::vector<AsyncBuy> args(buyers);
+    for (int i = 0; i < buyers; i++)
+    {
+        args[i].store = &store;
+        args[i].item_id = i % items;
+        args[i].pool = &pool;
+        args[i].bench = &bench;
+    }
+
+    double start = nowSeconds();
+    pool.start();
+    for (int i = 0; i < buyers; i++)
+    {
+        Task task = call_task(asyncBuyTask, &args[i]);
+        pool.enqueue(task);
+    }
+    while (store.wakeupStats().parked < buyers)
+    {
+        usleep(1000);
+    }
+    double parked = nowSeconds() - start;
+    CoroutineStats frames = coroutine_stats();
+
+    start = nowSeconds();
+    for (int i = 0; i < items; i++)
+    {
+        store.addStock(i, buyers / items + 1);
+    }
+    while (bench.done.load(std::memory_order_acquire) < buyers)
+    {
+        usleep(1000);
+    }
+    double resumed = nowSeconds() - start;
+    pool.stop();
+    assert(bench.bought.load() == buyers);
+
+    printf("coroutines: %d buyers on %d threads\n", buyers, threads);
+    printf("  suspended in %.3fs, %ld frames, %.0f bytes per buyer\n",
+           parked, frames.frames, frames.frames > 0 ? (double)frames.bytes / frames.frames : 0.0);
+    printf("  all resumed and bought in %.3fs (%.0f buyers/s)\n", resumed, buyers / resumed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * LockBench --
+ *
+ *      State shared by the threads of one lock benchmark run. A
+ *      thread either takes the bare lock around a few shared
+ *      counter updates, or (with store set) calls a coarse mode
+ *      store method, which holds the store mutex about as long.
+ *
+ * ------------------------------------------------------------------
+ */
+struct LockBench {
+    smutex_t lock;
+    EStore* store;
+    int ops;
+    long counters[8];
+    std::atomic<int> ready;
+};
+
+static void*
+lockWorker(void* arg)
+{
+    LockBench* bench = (LockBench*)arg;
+    bench->ready.fetch_sub(1);
+    while (bench->ready.load() > 0)
+    {
+    }
+    for (int i = 0; i < bench->ops; i++)
+    {
+        if (bench->store != NULL)
+        {
+            bench->store->priceItem(i % 100, 1 + i % 50);
+            continue;
+        }
+        smutex_lock(&bench->lock);
+        for (int c = 0; c < 8; c++)
+        {
+            bench->counters[c]++;
+        }
+        smutex_unlock(&bench->lock);
+    }
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchLocks --
+ *
+ *      Time 1 to 16 threads doing "ops" critical sections each on
+ *      one lock, for every LockKind (LOCK_BLOCKING being a plain
+ *      pthread mutex): first on the bare lock, then as coarse mode
+ *      priceItem calls on a store whose mutex is of that kind.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchLocks(int ops)
+{
+    static const int threadCounts[] = { 1, 2, 4, 8, 16 };
+    static const int numCounts = sizeof(threadCounts) / sizeof(threadCounts[0]);
+
+    printf("locks: %d critical sections per thread\n", ops);
+    for (int onStore = 0; onStore < 2; onStore++)
+    {
+        printf("  %-14s", onStore ? "store/threads" : "lock/threads");
+        for (int t = 0; t < numCounts; t++)
+        {
+            printf(" %10d", threadCounts[t]);
+        }
+        printf("   (sections/s)\n");
+        for (int kind = 0; kind < NUM_LOCK_KINDS; kind++)
+        {
+            double rates[numCounts];
+            for (int t = 0; t < numCounts; t++)
+            {
+                int threads = threadCounts[t];
+                StoreLocks locks;
+                locks.store = (LockKind)kind;
+                EStore store(false, CatalogOptions(), locks);
+                for (int i = 0; i < 100; i++)
+                {
+                    store.addItem(i, 1, 10, 0);
+                }
+
+                LockBench bench;
+                smutex_init_kind(&bench.lock, (LockKind)kind);
+                bench.store = onStore ? &store : NULL;
+                bench.ops = ops;
+                memset(bench.counters, 0, sizeof(bench.counters));
+                bench.ready.store(threads);
+
+                std::vector<sthread_t> workers(threads);
+                double start = nowSeconds();
+                for (int i = 0; i < threads; i++)
+                {
+                    sthread_create(&workers[i], lockWorker, &bench);
+                }
+                for (int i = 0; i < threads; i++)
+                {
+                    sthread_join(workers[i]);
+                }
+                double seconds = nowSeconds() - start;
+                assert(onStore || bench.counters[7] == (long)ops * threads);
+                rates[t] = (double)ops * threads / seconds;
+                smutex_destroy(&bench.lock);
+            }
+            printf("  %-14s", lock_kind_name((LockKind)kind));
+            for (int t = 0; t < numCounts; t++)
+            {
+                printf(" %10.0f", rates[t]);
+            }
+            printf("\n");
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * PriorityBench --
+ *
+ *      One task of the priority benchmark: it notes how long it
+ *      waited to start in the histogram of its kind, then spins.
+ *
+ * ------------------------------------------------------------------
+ */
+struct PriorityBench {
+    smutex_t lock;
+    LatencyHistogram waits[3];     // restocks, price raises, purchases
+};
+
+struct PriorityOp {
+    PriorityBench* bench;
+    int kind;
+    int spin;
+    double enqueued;
+};
+
+static void
+priorityTask(void* arg)
+{
+    PriorityOp* op = (PriorityOp*)arg;
+    double started = sutil_now();
+    smutex_lock(&op->bench->lock);
+    op->bench->waits[op->kind].record(started - op->enqueued);
+    smutex_unlock(&op->bench->lock);
+    volatile int sink = 0;
+    for (int i = 0; i < op->spin; i++)
+    {
+        sink = sink + i;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchPriority --
+ *
+ *      Feed 2 supplier workers a burst of "tasks" supplier tasks,
+ *      one restock per ten price raises, all spinning "spin" loop
+ *      iterations, while 4 customer workers get one purchase per
+ *      ten supplier tasks. Report how long restocks, raises and
+ *      purchases waited to start: with a FIFO TaskQueue per pool,
+ *      with a PriorityScheduler lane per pool, and with customer
+ *      workers also borrowing supplier work when idle.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchPriority(int tasks, int spin)
+{
+    static const char* schedulers[] = { "fifo", "priority", "borrow" };
+    static const char* kinds[] = { "restock", "raise", "purchase" };
+    const int suppliers = 2;
+    const int customers = 4;
+
+    printf("priority: %d supplier tasks of %d spins on %d workers, %d customer workers\n",
+           tasks, spin, suppliers, customers);
+    printf("  %-9s %-9s %10s %10s %10s %10s   (ms waited to start)\n",
+           "scheduler", "task", "mean", "p50", "p99", "max");
+    for (int s = 0; s < 3; s++)
+    {
+        PriorityBench bench;
+        smutex_init(&bench.lock);
+        int purchases = tasks / 10;
+        std::vector<PriorityOp> ops(tasks + purchases);
+        std::vector<Task> supplierTasks(tasks);
+        std::vector<Task> customerTasks(purchases);
+        for (int i = 0; i < tasks + purchases; i++)
+        {
+            PriorityOp& op = ops[i];
+            op.bench = &bench;
+            op.spin = spin;
+            op.kind = i >= tasks ? 2 : (i % 11 == 10 ? 0 : 1);
+            Task& task = i < tasks ? supplierTasks[i] : customerTasks[i - tasks];
+            task = call_task(priorityTask, &op);
+            task.priority = op.kind == 0 ? PRIORITY_UNBLOCK
+                : (op.kind == 1 ? PRIORITY_DEFAULT : PRIORITY_PURCHASE);
+        }
+
+        TaskQueue supplierQueue;
+        TaskQueue customerQueue;
+        PriorityScheduler scheduler(2);
+        scheduler.setBorrowing(1, s == 2);
+        Executor* supplierPool;
+        Executor* customerPool;
+        if (s == 0)
+        {
+            supplierPool = new WorkerPool("supplier", &supplierQueue, suppliers);
+            customerPool = new WorkerPool("customer", &customerQueue, customers);
+        }
+        else
+        {
+            supplierPool = new PriorityPool("supplier", &scheduler, 0, suppliers);
+            customerPool = new PriorityPool("customer", &scheduler, 1, customers);
+        }
+        supplierPool->start();
+        customerPool->start();
+        double now = sutil_now();
+        for (size_t i = 0; i < ops.size(); i++)
+        {
+            ops[i].enqueued = now;
+        }
+        supplierPool->enqueueBatch(supplierTasks);
+        customerPool->enqueueBatch(customerTasks);
+        supplierPool->stop();
+        customerPool->stop();
+        delete supplierPool;
+        delete customerPool;
+
+        for (int k = 0; k < 3; k++)
+        {
+            const LatencyHistogram& waits = bench.waits[k];
+            printf("  %-9s %-9s %10.3f %10.3f %10.3f %10.3f\n", k == 0 ? schedulers[s] : "",
+                   kinds[k], 1e3 * waits.mean(), 1e3 * waits.percentile(0.5),
+                   1e3 * waits.percentile(0.99), 1e3 * waits.max);
+        }
+        smutex_destroy(&bench.lock);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * AllocMode --
+ *
+ *      One request mix of the allocation benchmark: the generator
+ *      that makes it, and whether its store is in fine mode.
+ *
+ * ------------------------------------------------------------------
+ */
+struct AllocMode {
+    const char* name;
+    bool customers;
+    bool fineMode;
+    int batch;              // rows per supplier task
+};
+
+struct AllocDrain {
+    TaskQueue* queue;
+    int requests;
+};
+
+// take every request off the queue and free what its task owns
+static void*
+allocDrainer(void* arg)
+{
+    AllocDrain* drain = (AllocDrain*)arg;
+    Task drained[WORKER_DEQUEUE_BATCH];
+    for (int left = drain->requests; left > 0; )
+    {
+        size_t count = drain->queue->dequeueBatch(drained, WORKER_DEQUEUE_BATCH);
+        for (size_t i = 0; i < count; i++)
+        {
+            dispose_task(drained[i]);
+        }
+        left -= (int)count;
+    }
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * benchAlloc --
+ *
+ *      Count the heap allocations of each request mix per request,
+ *      from its generation through a ring TaskQueue to a consumer
+ *      thread that takes it off the queue and frees what the task
+ *      owns, as a dropped task would be. Objects from a SlabPool
+ *      count only through the slabs they are carved from. What
+ *      handlers allocate inside the store is not counted.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+benchAlloc(int requests)
+{
+    static const AllocMode modes[] = {
+        { "supplier", false, false, 1 },
+        { "supplier batch", false, false, 8 },
+        { "customer", true, false, 1 },
+        { "customer cart", true, true, 1 },
+    };
+
+    printf("alloc: heap allocations of %d requests, generation to dequeue\n", requests);
+    printf("  %-16s %12s %12s\n", "requests", "allocs/req", "bytes/req");
+    for (const AllocMode& mode : modes)
+    {
+        EStore store(mode.fineMode);
+        TaskQueue queue(QUEUE_RING, requests);
+        RequestGenerator* generator;
+        if (mode.customers)
+            generator = new CustomerRequestGenerator(&queue, mode.fineMode);
+        else
+            generator = new SupplierRequestGenerator(&queue, mode.batch);
+
+        long allocs = allocations.load(std::memory_order_relaxed);
+        long bytes = allocatedBytes.load(std::memory_order_relaxed);
+        AllocDrain drain = { &queue, requests };
+        sthread_t drainer;
+        sthread_create(&drainer, allocDrainer, &drain);
+        LoadProfile load;
+        load.process = ARRIVAL_UNTHROTTLED;
+        load.burst = requests;
+        generator->enqueueTasks(requests, &store, load);
+        sthread_join(drainer);
+        allocs = allocations.load(std::memory_order_relaxed) - allocs;
+        bytes = allocatedBytes.load(std::memory_order_relaxed) - bytes;
+        printf("  %-16s %12.2f %12.1f\n", mode.name, (double)allocs / requests,
+               (double)bytes / requests);
+        delete generator;
+    }
+}
+
+static void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s wakeups [buyers] [mutations]\n", prog);
+    fprintf(stderr, "       %s reprice [levels]\n", prog);
+    fprintf(stderr, "       %s catalog [shards] [stripes] [threads] [ops]\n", prog);
+    fprintf(stderr, "       %s layout [items] [ops]\n", prog);
+    fprintf(stderr, "       %s batch [rows] [batch]\n", prog);
+    fprintf(stderr, "       %s reserve [threads] [ops]\n", prog);
+    fprintf(stderr, "       %s blocking [buyers]\n", prog);
+    fprintf(stderr, "       %s queue [tasks] [batch]\n", prog);
+    fprintf(stderr, "       %s steal [tasks] [spin]\n", prog);
+    fprintf(stderr, "       %s shard [ops]\n", prog);
+    fprintf(stderr, "       %s coroutines [buyers] [threads]\n", prog);
+    fprintf(stderr, "       %s locks [ops]\n", prog);
+    fprintf(stderr, "       %s priority [tasks] [spin]\n", prog);
+    fprintf(stderr, "       %s alloc [requests]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+        usage(argv[0]);
+
+    if (strcmp(argv[1], "wakeups") == 0)
+    {
+        int buyers = argc > 2 ? atoi(argv[2]) : 400;
+        int mutations = argc > 3 ? atoi(argv[3]) : 200;
+        benchWakeups(buyers, mutations);
+    }
+    else if (strcmp(argv[1], "reprice") == 0)
+    {
+        benchReprice(argc > 2 ? atoi(argv[2]) : 10);
+    }
+    else if (strcmp(argv[1], "catalog") == 0)
+    {
+        CatalogOptions options;
+        options.numShards = argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_SHARDS;
+        options.stripesPerShard = argc > 3 ? atoi(argv[3]) : DEFAULT_LOCK_STRIPES;
+        int threads = argc > 4 ? atoi(argv[4]) : 4;
+        int ops = argc > 5 ? atoi(argv[5]) : 200000;
+        printf("catalog: %d shards, %d stripes/shard, %d threads\n",
+               options.numShards, options.stripesPerShard, threads);
+        options.inventorySize = 1000;
+        benchCatalog(options, threads, ops);
+        options.inventorySize = 1000000;
+        benchCatalog(options, threads, ops);
+        options.inventorySize = 10000000;
+        benchCatalog(options, threads, ops);
+    }
+    else if (strcmp(argv[1], "layout") == 0)
+    {
+        int size = argc > 2 ? atoi(argv[2]) : 100000;
+        int ops = argc > 3 ? atoi(argv[3]) : 50000;
+        benchLayout(size, ops);
+    }
+    else if (strcmp(argv[1], "batch") == 0)
+    {
+        int rows = argc > 2 ? atoi(argv[2]) : 200000;
+        int batch = argc > 3 ? atoi(argv[3]) : 1000;
+        benchBatch(rows, batch);
+    }
+    else if (strcmp(argv[1], "reserve") == 0)
+    {
+        int threads = argc > 2 ? atoi(argv[2]) : 4;
+        int ops = argc > 3 ? atoi(argv[3]) : 20000;
+        benchReserve(threads, ops);
+    }
+    else if (strcmp(argv[1], "blocking") == 0)
+    {
+        benchBlocking(argc > 2 ? atoi(argv[2]) : 200);
+    }
+    else if (strcmp(argv[1], "queue") == 0)
+    {
+        benchQueue(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 64);
+    }
+    else if (strcmp(argv[1], "steal") == 0)
+    {
+        benchSteal(argc > 2 ? atoi(argv[2]) : 200000, argc > 3 ? atoi(argv[3]) : 200);
+    }
+    else if (strcmp(argv[1], "shard") == 0)
+    {
+        benchShard(argc > 2 ? atoi(argv[2]) : 200000);
+    }
+    else if (strcmp(argv[1], "coroutines") == 0)
+    {
+        benchCoroutines(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 4);
+    }
+    else if (strcmp(argv[1], "locks") == 0)
+    {
+        benchLocks(argc > 2 ? atoi(argv[2]) : 20000);
+    }
+    else if (strcmp(argv[1], "priority") == 0)
+    {
+        benchPriority(argc > 2 ? atoi(argv[2]) : 20000, argc > 3 ? atoi(argv[3]) : 5000);
+    }
+    else if (strcmp(argv[1], "alloc") == 0)
+    {
+        benchAlloc(argc > 2 ? atoi(argv[2]) : 20000);
+    }
+    else
+    {
+        usage(argv[0]);
+    }
+    return 0;
+}
@@ -1,37 +1,165 @@
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
+#include <getopt.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
 
 #include "EStore.h"
+#include "EventLog.h"
 #include "TaskQueue.h"
 #include "sthread.h"
+#include "PriorityPool.h"
 #include "RequestGenerator.h"
+#include "ShardedPool.h"
+#include "StealingPool.h"
+#include "WorkerPool.h"
 
 
+// how each pool's workers get their tasks
+enum Scheduler {
+    SCHED_QUEUE = 0,        // one shared TaskQueue per pool (WorkerPool)
+    SCHED_STEAL,            // a deque per worker, with stealing (StealingPool)
+    SCHED_SHARD,            // a queue per worker, routed by item (ShardedPool)
+    SCHED_PRIORITY          // a lane per pool, by priority and deadline (PriorityPool)
+};
+
+// the lanes of the PriorityScheduler shared by both pools
+enum SimLane {
+    LANE_SUPPLIER = 0,
+    LANE_CUSTOMER,
+    NUM_SIM_LANES
+};
+
+/*
+ * ------------------------------------------------------------------
+ * SimOptions --
+ *
+ *      Parameters of a simulation run, set from the command line.
+ *
+ * ------------------------------------------------------------------
+ */
+struct SimOptions {
+    int numSuppliers;
+    int numCustomers;
+    int maxTasks;
+    int supplierBatch;
+    int generators;
+    LoadProfile load;           // of each pool; rate 0 for a burst every 100ms
+    unsigned long long seed;    // of every generator's random numbers
+    bool fineMode;
+    bool waiting;
+    bool coroutines;
+    QueueBackend queueBackend;
+    size_t queueCapacity;
+    OverflowPolicy overflow;
+    Scheduler scheduler;
+    std::vector<int> supplierCpus;
+    std::vector<int> customerCpus;
+    bool placeShards;
+    CatalogOptions catalog;
+    StoreLocks storeLocks;
+    LockKind queueLocks;
+    bool borrows[NUM_SIM_LANES];
+    double taskDeadline;
+    const char* logSink;
+    EventLevel logLevel;
+
+    SimOptions()
+        : numSuppliers(10), numCustomers(10), maxTasks(100), supplierBatch(1), generators(1), seed(1),
+          fineMode(false), waiting(false), coroutines(false),
+          queueBackend(QUEUE_MONITOR), queueCapacity(0), overflow(OVERFLOW_BLOCK),
+          scheduler(SCHED_QUEUE), placeShards(false), queueLocks(LOCK_BLOCKING),
+          borrows{ false, true }, taskDeadline(0), logSink("text"), logLevel(EVENT_INFO)
+    {
+        load.rate = 0;
+    }
+};
+
 class Simulation {
 public:
     TaskQueue supplierTasks;
     TaskQueue customerTasks;
     EStore store;
 
+    // where the generators send their requests
+    Executor* suppliers;
+    Executor* customers;
+
     int maxTasks;
+    int supplierBatch;
+    int generators;             // per pool
+    LoadProfile load;           // of each pool
+    unsigned long long seed;
     int numSuppliers;
     int numCustomers;
+    int itemOwners;
     bool fineMode;
+    bool waiting;
+    bool coroutines;
+    double taskDeadline;
+
+    // generators still running, and how each kept to its load
+    std::atomic<int> supplierGenerators;
+    std::atomic<int> customerGenerators;
+    std::vector<LoadStats> supplierLoads;
+    std::vector<LoadStats> customerLoads;
 
-    explicit Simulation(bool useFineMode) : store(useFineMode) { }
+    explicit Simulation(const SimOptions& opts)
+        : supplierTasks(opts.queueBackend, opts.queueCapacity, opts.overflow, opts.queueLocks),
+          customerTasks(opts.queueBackend, opts.queueCapacity, opts.overflow, opts.queueLocks),
+          store(opts.fineMode, opts.catalog, opts.storeLocks), suppliers(NULL), customers(NULL),
+          itemOwners(0), supplierGenerators(opts.generators), customerGenerators(opts.generators),
+          supplierLoads(opts.generators), customerLoads(opts.generators)
+    { }
+};
+
+// one of a pool's generator threads
+struct GeneratorThread {
+    Simulation* sim;
+    int index;                  // among the pool's sim->generators
 };
 
+/*
+ * ------------------------------------------------------------------
+ * generatorShare --
+ *
+ *      Split a pool's requests and load between its generators.
+ *      Each gets an equal part of the rate; constant arrivals are
+ *      staggered so that the pool's arrivals stay evenly spaced.
+ *
+ * Results:
+ *      The number of requests the thread generates, and its
+ *      LoadProfile in *load.
+ *
+ * ------------------------------------------------------------------
+ */
+static int
+generatorShare(const GeneratorThread* thread, LoadProfile* load)
+{
+    Simulation* sim = thread->sim;
+    *load = sim->load;
+    load->rate /= sim->generators;
+    if (load->process == ARRIVAL_CONSTANT)
+    {
+        load->start += thread->index * (load->burst / load->rate) / sim->generators;
+    }
+    return sim->maxTasks / sim->generators + (thread->index < sim->maxTasks % sim->generators);
+}
+
 /*
  * ------------------------------------------------------------------
  * supplierGenerator --
  *
- *      The supplier generator thread. The argument is a pointer to
- *      the shared Simulation object.
+ *      A supplier generator thread. The argument is a pointer to
+ *      its GeneratorThread.
  *
- *      Enqueue arg->maxTasks requests to the supplier queue, then
- *      stop all supplier threads by enqueuing arg->numSuppliers
- *      stop requests.
+ *      Enqueue this thread's share of sim->maxTasks requests to the
+ *      supplier pool, at its share of the load. The last of the
+ *      pool's generators to finish then stops all supplier threads
+ *      by enqueuing sim->numSuppliers stop requests.
  *
  *      Use a SupplierRequestGenerator to generate and enqueue
  *      requests.
@@ -47,12 +175,21 @@ static void*
 supplierGenerator(void* arg)
 {
     // create a new supplier request generator from the provided simulator
-    Simulation* sim = ((Simulation*)arg);
-    SupplierRequestGenerator supplyGen(&(sim->supplierTasks));
+    GeneratorThread* thread = (GeneratorThread*)arg;
+    Simulation* sim = thread->sim;
+    SupplierRequestGenerator supplyGen(sim->suppliers, sim->supplierBatch, sim->itemOwners);
+    supplyGen.setDeadline(sim->taskDeadline);
+    supplyGen.setSeed(sim->seed, 2 * thread->index);
 
-    // enqueue the max amount of tasks and thread stoppers
-    supplyGen.enqueueTasks(sim->maxTasks, &(sim->store));
-    supplyGen.enqueueStops(sim->numSuppliers);
+    // enqueue this thread's tasks, and the thread stoppers once every generator is done
+    LoadProfile load;
+    int tasks = generatorShare(thread, &load);
+    supplyGen.enqueueTasks(tasks, &(sim->store), load);
+    sim->supplierLoads[thread->index] = supplyGen.loadStats();
+    if (sim->supplierGenerators.fetch_sub(1) == 1)
+    {
+        supplyGen.enqueueStops(sim->numSuppliers);
+    }
     sthread_exit();
     return NULL; // Keep compiler happy.
 }
@@ -61,12 +198,13 @@ supplierGenerator(void* arg)
  * ------------------------------------------------------------------
  * customerGenerator --
  *
- *      The customer generator thread. The argument is a pointer to
- *      the shared Simulation object.
+ *      A customer generator thread. The argument is a pointer to
+ *      its GeneratorThread.
  *
- *      Enqueue arg->maxTasks requests to the customer queue, then
- *      stop all customer threads by enqueuing arg->numCustomers
- *      stop requests.
+ *      Enqueue this thread's share of sim->maxTasks requests to the
+ *      customer pool, at its share of the load. The last of the
+ *      pool's generators to finish then stops all customer threads
+ *      by enqueuing sim->numCustomers stop requests.
  *
  *      Use a CustomerRequestGenerator to generate and enqueue
  *      requests.  For the fineMode argument to the constructor
@@ -74,6 +212,11 @@ supplierGenerator(void* arg)
  *      store.fineModeEnabled() method, where store is a field
  *      in the Simulation class.
  *
+ *      With coroutines, purchases that wait are suspended rather
+ *      than holding a worker, so the stops are only enqueued once
+ *      every purchase has finished: a stopped pool could not
+ *      resume the rest.
+ *
  *      This thread should exit when done.
  *
  * Results:
@@ -85,11 +228,27 @@ static void*
 customerGenerator(void* arg)
 {
     // create a new customer request generator object from the provided simulation
-    Simulation* sim = ((Simulation*)arg);
-    CustomerRequestGenerator customerGen(&(sim->customerTasks), sim->store.fineModeEnabled());
+    GeneratorThread* thread = (GeneratorThread*)arg;
+    Simulation* sim = thread->sim;
+    CustomerRequestGenerator customerGen(sim->customers, sim->store.fineModeEnabled(),
+                                         sim->coroutines);
+    customerGen.setDeadline(sim->taskDeadline);
+    customerGen.setWaiting(sim->waiting);
+    customerGen.setSeed(sim->seed, 2 * thread->index + 1);
 
-    // enqueue the max amounts of tasks and thread stoppers
-    customerGen.enqueueTasks(sim->maxTasks, &(sim->store));
+    // enqueue this thread's tasks, and the thread stoppers once every generator is done
+    LoadProfile load;
+    int tasks = generatorShare(thread, &load);
+    customerGen.enqueueTasks(tasks, &(sim->store), load);
+    sim->customerLoads[thread->index] = customerGen.loadStats();
+    if (sim->customerGenerators.fetch_sub(1) != 1)
+    {
+        sthread_exit();
+    }
+    while (sim->coroutines && sim->store.asyncPurchasesDone() < sim->maxTasks)
+    {
+        sthread_sleep(0, 10000000);
+    }
     customerGen.enqueueStops(sim->numCustomers);
     sthread_exit();
     return NULL; // Keep compiler happy.
@@ -97,54 +256,185 @@ customerGenerator(void* arg)
 
 /*
  * ------------------------------------------------------------------
- * supplier --
- *
- *      The main supplier thread. The argument is a pointer to the
- *      shared Simulation object.
+ * parseCpus --
  *
- *      Dequeue Tasks from the supplier queue and execute them.
+ *      Parse a CPU list such as "0-3,8,10-11". An element "nodeN"
+ *      stands for every CPU of NUMA node N, as listed in sysfs.
  *
  * Results:
- *      Does not return.
+ *      true, with the CPUs appended to *cpus, if the list is valid
+ *      and names only CPUs this system has.
  *
  * ------------------------------------------------------------------
  */
-static void*
-supplier(void* arg)
+static bool
+parseCpus(const char* spec, std::vector<int>* cpus)
 {
-    Simulation* sim = ((Simulation*)arg);
+    long configured = sysconf(_SC_NPROCESSORS_CONF);
+    std::string list(spec);
+    size_t begin = 0;
+    while (begin <= list.size())
+    {
+        size_t end = list.find(',', begin);
+        end = end == std::string::npos ? list.size() : end;
+        std::string item = list.substr(begin, end - begin);
+        begin = end + 1;
 
-    // for each of these supplier threads dequeue a task and handle it
-    Task task = sim->supplierTasks.dequeue();
-    task.handler(task.arg);
-    sthread_exit();
-    return NULL; // Keep compiler happy.
+        int first, last, node;
+        char extra;
+        if (sscanf(item.c_str(), "node%d%c", &node, &extra) == 1)
+        {
+            char path[64];
+            char nodeList[256];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            FILE* file = fopen(path, "r");
+            if (file == NULL)
+            {
+                return false;
+            }
+            bool read = fgets(nodeList, sizeof(nodeList), file) != NULL;
+            fclose(file);
+            nodeList[strcspn(nodeList, "\n")] = '\0';
+            if (!read || !parseCpus(nodeList, cpus))
+            {
+                return false;
+            }
+            continue;
+        }
+        if (sscanf(item.c_str(), "%d-%d%c", &first, &last, &extra) != 2)
+        {
+            if (sscanf(item.c_str(), "%d%c", &first, &extra) != 1)
+            {
+                return false;
+            }
+            last = first;
+        }
+        if (first < 0 || last < first || last >= configured)
+        {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++)
+        {
+            cpus->push_back(cpu);
+        }
+    }
+    return true;
 }
 
 /*
  * ------------------------------------------------------------------
- * customer --
+ * parseLocks --
  *
- *      The main customer thread. The argument is a pointer to the
- *      shared Simulation object.
- *
- *      Dequeue Tasks from the customer queue and execute them.
+ *      Parse a lock kind list: either one kind for every lock class,
+ *      or class=kind pairs such as "store=adaptive,items=mcs", where
+ *      a class is store, items, pricing or queue. Classes not named
+ *      keep their kind.
  *
  * Results:
- *      Does not return.
+ *      true, with the kinds set in *opts, if the list is valid.
  *
  * ------------------------------------------------------------------
  */
-static void*
-customer(void* arg)
+static bool
+parseLocks(const char* spec, SimOptions* opts)
 {
-    Simulation* sim = ((Simulation*)arg);
+    LockKind kind;
+    if (lock_kind_parse(spec, &kind))
+    {
+        opts->storeLocks.store = kind;
+        opts->storeLocks.pricing = kind;
+        opts->catalog.itemLocks = kind;
+        opts->queueLocks = kind;
+        return true;
+    }
 
-    // for each of these customer threads dequeue a task and handle it
-    Task task = sim->customerTasks.dequeue();
-    task.handler(task.arg);
-    sthread_exit();
-    return NULL; // Keep compiler happy.
+    std::string list(spec);
+    size_t begin = 0;
+    while (begin <= list.size())
+    {
+        size_t end = list.find(',', begin);
+        end = end == std::string::npos ? list.size() : end;
+        std::string item = list.substr(begin, end - begin);
+        begin = end + 1;
+
+        size_t equals = item.find('=');
+        if (equals == std::string::npos || !lock_kind_parse(item.c_str() + equals + 1, &kind))
+        {
+            return false;
+        }
+        std::string lockClass = item.substr(0, equals);
+        if (lockClass == "store")
+            opts->storeLocks.store = kind;
+        else if (lockClass == "items")
+            opts->catalog.itemLocks = kind;
+        else if (lockClass == "pricing")
+            opts->storeLocks.pricing = kind;
+        else if (lockClass == "queue")
+            opts->queueLocks = kind;
+        else
+            return false;
+    }
+    return true;
+}
+
+// print which CPUs, and which of their nodes, a pool was pinned to
+static void
+reportPlacement(const char* name, const std::vector<int>& cpus)
+{
+    if (cpus.empty())
+    {
+        return;
+    }
+    printf("%s cpus:", name);
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+        printf(" %d (node %d)", cpus[i], sutil_cpu_node(cpus[i]));
+    }
+    printf("\n");
+}
+
+// print the load a pool's generators offered, and how late they were
+static void
+reportLoad(const char* name, const LoadProfile& load, const std::vector<LoadStats>& stats)
+{
+    LoadStats total = LoadStats();
+    for (const LoadStats& generator : stats)
+    {
+        total.requests += generator.requests;
+        total.arrivals += generator.arrivals;
+        total.elapsed = std::max(total.elapsed, generator.elapsed);
+        total.lagTotal += generator.lagTotal;
+        total.lagMax = std::max(total.lagMax, generator.lagMax);
+    }
+    printf("%s load: %s", name, arrival_process_name(load.process));
+    if (load.process != ARRIVAL_UNTHROTTLED)
+    {
+        printf(" at %.1f req/s", load.rate);
+    }
+    printf(", %zu generator%s: %ld requests in %.2fs (%.1f req/s), lag mean %.3fms, max %.3fms\n",
+           stats.size(), stats.size() == 1 ? "" : "s", total.requests, total.elapsed,
+           total.elapsed > 0 ? total.requests / total.elapsed : 0.0,
+           total.arrivals > 0 ? total.lagTotal / total.arrivals * 1000 : 0.0, total.lagMax * 1000);
+}
+
+// print a queue's admission counters
+static void
+reportQueue(const char* name, const TaskQueue& queue)
+{
+    QueueStats stats = queue.stats();
+    printf("%s queue: %s, %s, capacity %zu: %ld enqueued, %ld rejected, %ld dropped, "
+           "%ld producer waits\n",
+           name, queue_backend_name(queue.queueBackend()), overflow_policy_name(queue.overflowPolicy()),
+           queue.maxSize(), stats.enqueued, stats.rejected, stats.dropped, stats.producerWaits);
+}
+
+// print the admission counters of a sharded pool's queues, summed
+static void
+reportShards(const char* name, const ShardedPool& pool)
+{
+    QueueStats stats = pool.queueStats();
+    printf("%s queues: %d shards: %ld enqueued, %ld rejected, %ld dropped, %ld producer waits\n",
+           name, pool.size(), stats.enqueued, stats.rejected, stats.dropped, stats.producerWaits);
 }
 
 /*
@@ -154,15 +444,25 @@ customer(void* arg)
  *      the shared state for the simulation.
  *
  *      Create the following threads:
- *          - 1 supplier generator thread.
- *          - 1 customer generator thread.
- *          - numSuppliers supplier threads.
- *          - numCustomers customer threads.
- *
- *      After creating the worker threads, the main thread
- *      should wait until all of them exit, at which point it
- *      should return.
+ *          - opts.generators supplier generator threads.
+ *          - opts.generators customer generator threads.
+ *          - a pool of numSuppliers supplier workers.
+ *          - a pool of numCustomers customer workers.
  *
+ *      With SCHED_QUEUE each pool is a WorkerPool serving one of
+ *      the simulation's TaskQueues; with SCHED_STEAL it is a
+ *      StealingPool, and with SCHED_SHARD a ShardedPool. In fine
+ *      mode the supplier shards then own their items, so the
+ *      store's item writers skip their locks and supplier batches
+ *      are built one shard at a time. With SCHED_PRIORITY both
+ *      pools are PriorityPools on lanes of one PriorityScheduler,
+ *      borrowing each other's work as opts.borrows says. Either
+ *      way the workers stop on the stop tasks each generator
+ *      enqueues after its last request, and every request is
+ *      handled before the pools exit. The main thread waits for
+ *      the generators, both pools and any checkout payments still
+ *      settling, stops the event log the handlers wrote to, then
+ *      prints each pool's per-worker throughput.
  *
  * Results:
  *      None.
@@ -170,60 +470,374 @@ customer(void* arg)
  * ------------------------------------------------------------------
  */
 static void
-startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMode)
+startSimulation(const SimOptions& opts)
 {
+    int numSuppliers = opts.numSuppliers;
+    int numCustomers = opts.numCustomers;
+
+    // start the event log before anything can log to it
+    event_log_start(event_sink_create(opts.logSink), opts.logLevel);
+
     // initialize the simulation
-    Simulation sharedSim(useFineMode);
+    Simulation sharedSim(opts);
     sharedSim.numSuppliers = numSuppliers;
     sharedSim.numCustomers = numCustomers;
-    sharedSim.maxTasks = maxTasks;
-    sharedSim.fineMode = useFineMode;
+    sharedSim.maxTasks = opts.maxTasks;
+    sharedSim.supplierBatch = opts.supplierBatch;
+    sharedSim.generators = opts.generators;
+    sharedSim.load = opts.load;
+    sharedSim.seed = opts.seed;
+    sharedSim.fineMode = opts.fineMode;
+    sharedSim.waiting = opts.waiting;
+    sharedSim.coroutines = opts.coroutines;
+    sharedSim.taskDeadline = opts.taskDeadline;
 
-    // create generator threads
-    sthread_t supplierGen;
-    sthread_t customerGen;
-    sthread_create(&supplierGen, supplierGenerator, &sharedSim);
-    sthread_create(&customerGen, customerGenerator, &sharedSim);
-
-    // create worker threads
-    sthread_t supplierArr[numSuppliers];
-    sthread_t customerArr[numCustomers];
-    for (int i = 0; i < numSuppliers; i++)
+    // create the worker pools
+    Executor* suppliers;
+    Executor* customers;
+    PriorityScheduler* scheduler = NULL;
+    if (opts.scheduler == SCHED_STEAL)
+    {
+        suppliers = new StealingPool("supplier", numSuppliers);
+        customers = new StealingPool("customer", numCustomers);
+    }
+    else if (opts.scheduler == SCHED_SHARD)
+    {
+        suppliers = new ShardedPool("supplier", numSuppliers, opts.queueBackend, opts.queueCapacity,
+                                    opts.overflow, opts.queueLocks);
+        customers = new ShardedPool("customer", numCustomers, opts.queueBackend, opts.queueCapacity,
+                                    opts.overflow, opts.queueLocks);
+        if (opts.fineMode)
+        {
+            sharedSim.itemOwners = numSuppliers;
+            sharedSim.store.setItemOwnership(true);
+        }
+    }
+    else if (opts.scheduler == SCHED_PRIORITY)
     {
-        sthread_t supplierThread;
-        sthread_create(&supplierThread, supplier, &sharedSim);
-        supplierArr[i] = supplierThread;
+        scheduler = new PriorityScheduler(NUM_SIM_LANES);
+        for (int lane = 0; lane < NUM_SIM_LANES; lane++)
+        {
+            scheduler->setBorrowing(lane, opts.borrows[lane]);
+        }
+        suppliers = new PriorityPool("supplier", scheduler, LANE_SUPPLIER, numSuppliers);
+        customers = new PriorityPool("customer", scheduler, LANE_CUSTOMER, numCustomers);
     }
-    for (int i = 0; i < numCustomers; i++)
+    else
     {
-        sthread_t customerThread;
-        sthread_create(&customerThread, customer, &sharedSim);
-        customerArr[i] = customerThread;
+        suppliers = new WorkerPool("supplier", &sharedSim.supplierTasks, numSuppliers);
+        customers = new WorkerPool("customer", &sharedSim.customerTasks, numCustomers);
+    }
+    sharedSim.suppliers = suppliers;
+    sharedSim.customers = customers;
+    suppliers->pinTo(opts.supplierCpus);
+    customers->pinTo(opts.customerCpus);
+    suppliers->start();
+    customers->start();
+
+    // create generator threads, on one schedule
+    sharedSim.load.start = sutil_now();
+    std::vector<GeneratorThread> threads(opts.generators);
+    std::vector<sthread_t> supplierGens(opts.generators);
+    std::vector<sthread_t> customerGens(opts.generators);
+    for (int i = 0; i < opts.generators; i++)
+    {
+        threads[i].sim = &sharedSim;
+        threads[i].index = i;
+        sthread_create(&supplierGens[i], supplierGenerator, &threads[i]);
+        sthread_create(&customerGens[i], customerGenerator, &threads[i]);
     }
 
     // join the threads to wait for their completions
-    sthread_join(supplierGen);
-    sthread_join(customerGen);
-    for (int i = 0; i < numSuppliers; i++)
+    for (int i = 0; i < opts.generators; i++)
     {
-        sthread_join(supplierArr[i]);
+        sthread_join(supplierGens[i]);
+        sthread_join(customerGens[i]);
     }
-    for (int i = 0; i < numCustomers; i++)
+    suppliers->join();
+    customers->join();
+    // checkouts still paying are settled by the store, after their workers are gone
+    while (sharedSim.store.pendingSettlements() > 0)
     {
-        sthread_join(customerArr[i]);
+        sthread_sleep(0, 10000000);
     }
+    event_log_stop();
 
+    suppliers->report(stdout);
+    customers->report(stdout);
+    reportLoad("supplier", sharedSim.load, sharedSim.supplierLoads);
+    reportLoad("customer", sharedSim.load, sharedSim.customerLoads);
+    if (opts.scheduler == SCHED_QUEUE)
+    {
+        reportQueue("supplier", sharedSim.supplierTasks);
+        reportQueue("customer", sharedSim.customerTasks);
+    }
+    else if (opts.scheduler == SCHED_SHARD)
+    {
+        reportShards("supplier", *(ShardedPool*)suppliers);
+        reportShards("customer", *(ShardedPool*)customers);
+    }
+    else if (opts.scheduler == SCHED_PRIORITY)
+    {
+        static const char* laneNames[NUM_SIM_LANES] = { "supplier", "customer" };
+        scheduler->report(stdout, laneNames);
+    }
+    reportPlacement("supplier", opts.supplierCpus);
+    reportPlacement("customer", opts.customerCpus);
+    printf("locks: store %s, items %s, pricing %s, queue %s\n",
+           lock_kind_name(opts.storeLocks.store), lock_kind_name(opts.catalog.itemLocks),
+           lock_kind_name(opts.storeLocks.pricing), lock_kind_name(opts.queueLocks));
+    printf("seed: %llu\n", opts.seed);
+    EventLogStats events = event_log_stats();
+    printf("log: %s, %s: %ld events, %ld dropped\n", opts.logSink, event_level_name(opts.logLevel),
+           events.logged, events.dropped);
+    delete suppliers;
+    delete customers;
+    delete scheduler;
+}
+
+static void
+usage(const char* prog)
+{
+    SimOptions defaults;
+    fprintf(stderr,
+            "usage: %s [--fine] [--suppliers N] [--customers N] [--tasks N]\n"
+            "          [--items N] [--shards N] [--stripes N] [--layout L]\n"
+            "          [--supplier-batch N] [--burst N] [--arrivals A] [--rate R]\n"
+            "          [--on-off ON,OFF] [--generators N] [--queue Q] [--scheduler S]\n"
+            "          [--queue-capacity N] [--overflow P] [--waiting] [--coroutines]\n"
+            "          [--supplier-cpus L] [--customer-cpus L] [--place-shards]\n"
+            "          [--locks K] [--borrow B] [--deadline MS]\n"
+            "          [--log SINK] [--log-level L] [--decode-log PATH] [--seed N]\n"
+            "  --fine       fine-grained locking (buyManyItems) instead of a monitor\n"
+            "  --suppliers N, --customers N\n"
+            "               worker pool sizes (default %d and %d)\n"
+            "  --tasks N    requests to each pool (default %d)\n"
+            "  --items N    number of item ids in the catalog (default %d)\n"
+            "  --shards N   number of catalog shards (default %d)\n"
+            "  --stripes N  lock stripes per shard (default %d)\n"
+            "  --layout L   item layout: packed, padded or soa (default packed)\n"
+            "  --supplier-batch N\n"
+            "               supplier mutations per task, applied with applyBatch\n"
+            "               when above 1; at most %d (default 1)\n"
+            "  --burst N    requests a generator enqueues at once, per arrival\n"
+            "               (default 1)\n"
+            "  --arrivals A how arrivals are spaced: constant, poisson, onoff\n"
+            "               (poisson during on periods only) or unthrottled (as\n"
+            "               fast as the pool takes them) (default constant)\n"
+            "  --rate R     requests a second to each pool, on average (default\n"
+            "               a burst every 100ms)\n"
+            "  --on-off ON,OFF\n"
+            "               seconds of each on and off period of onoff arrivals\n"
+            "               (default 1,1)\n"
+            "  --generators N\n"
+            "               generator threads per pool, sharing its requests\n"
+            "               and rate (default 1)\n"
+            "  --queue Q    task queue backend: monitor or ring (default monitor)\n"
+            "  --queue-capacity N\n"
+            "               most tasks each queue holds; 0 for unbounded (the\n"
+            "               monitor default; the ring defaults to %d)\n"
+            "  --overflow P what a full queue does with a new task: block, try,\n"
+            "               drop-oldest or shed-customers (default block)\n"
+            "  --scheduler S\n"
+            "               queue (one task queue per pool), steal (per-worker\n"
+            "               deques with work stealing; --queue is then unused) or\n"
+            "               shard (a queue per worker, requests routed by item;\n"
+            "               --queue-capacity is then per worker) or priority\n"
+            "               (unbounded queues ordered by priority class, then\n"
+            "               deadline; --queue is then unused)\n"
+            "  --waiting    customers that cannot buy yet may wait, for up to %g\n"
+            "               seconds: every coarse buyer and half the fine carts\n"
+            "               (default: every customer gives up at once)\n"
+            "  --coroutines customers that wait suspend as coroutines instead of\n"
+            "               blocking a worker; implies --waiting (not with --fine\n"
+            "               or a bounded queue: a ring, or --queue-capacity)\n"
+            "  --supplier-cpus L, --customer-cpus L\n"
+            "               pin each pool's workers round-robin to the CPUs of\n"
+            "               list L, e.g. 0-3,8 or node1 (default: not pinned)\n"
+            "  --place-shards\n"
+            "               allocate catalog shard i on the NUMA node of supplier\n"
+            "               CPU i (round-robin; needs --supplier-cpus)\n"
+            "  --locks K    lock kind, blocking, adaptive, ticket or mcs, for\n"
+            "               every lock class, or per class as a list such as\n"
+            "               store=adaptive,items=mcs (classes: store, items,\n"
+            "               pricing, queue; default blocking)\n"
+            "  --borrow B   with --scheduler priority, which pools' idle workers\n"
+            "               run the other pool's requests: none, customers,\n"
+            "               suppliers or both (default customers)\n"
+            "  --deadline MS\n"
+            "               requests are due to start MS milliseconds after\n"
+            "               they are generated; --scheduler priority runs them\n"
+            "               earliest deadline first within a class (default none)\n"
+            "  --log SINK   where handled requests are logged: text (standard\n"
+            "               output), null, or binary:PATH (default text)\n"
+            "  --log-level L\n"
+            "               off, info (every request) or debug (also every task\n"
+            "               a full queue rejects or drops) (default info)\n"
+            "  --decode-log PATH\n"
+            "               print a log written with --log binary:PATH as text,\n"
+            "               then exit\n"
+            "  --seed N     seed of the generated requests; a run with the seed\n"
+            "               of an earlier one generates the same requests\n"
+            "               (default: the time)\n",
+            prog, defaults.numSuppliers, defaults.numCustomers, defaults.maxTasks,
+            DEFAULT_INVENTORY_SIZE, DEFAULT_NUM_SHARDS, DEFAULT_LOCK_STRIPES, MAX_SUPPLIER_BATCH,
+            DEFAULT_RING_CAPACITY, CUSTOMER_TIMEOUT);
+    exit(1);
 }
 
 int main(int argc, char** argv)
 {
-    bool useFineMode = false;
+    static const struct option longOpts[] = {
+        { "fine",    no_argument,       NULL, 'f' },
+        { "suppliers", required_argument, NULL, 'S' },
+        { "customers", required_argument, NULL, 'C' },
+        { "tasks",   required_argument, NULL, 't' },
+        { "items",   required_argument, NULL, 'i' },
+        { "shards",  required_argument, NULL, 's' },
+        { "stripes", required_argument, NULL, 'l' },
+        { "layout",  required_argument, NULL, 'L' },
+        { "supplier-batch", required_argument, NULL, 'b' },
+        { "burst",   required_argument, NULL, 'B' },
+        { "arrivals", required_argument, NULL, 'a' },
+        { "rate",    required_argument, NULL, 'r' },
+        { "on-off",  required_argument, NULL, 'O' },
+        { "generators", required_argument, NULL, 'G' },
+        { "queue-capacity", required_argument, NULL, 'c' },
+        { "overflow", required_argument, NULL, 'o' },
+        { "queue",   required_argument, NULL, 'q' },
+        { "scheduler", required_argument, NULL, 'x' },
+        { "waiting", no_argument,        NULL, 'W' },
+        { "coroutines", no_argument,     NULL, 'k' },
+        { "supplier-cpus", required_argument, NULL, 'P' },
+        { "customer-cpus", required_argument, NULL, 'Q' },
+        { "place-shards", no_argument,   NULL, 'p' },
+        { "locks",   required_argument, NULL, 'K' },
+        { "borrow",  required_argument, NULL, 'w' },
+        { "deadline", required_argument, NULL, 'd' },
+        { "log",     required_argument, NULL, 'g' },
+        { "log-level", required_argument, NULL, 'v' },
+        { "decode-log", required_argument, NULL, 'D' },
+        { "seed",    required_argument, NULL, 'e' },
+        { NULL, 0, NULL, 0 }
+    };
+    SimOptions opts;
+
+    // seed the generators from the time, unless a seed is given
+    opts.seed = time(NULL);
 
-    // Seed the random number generator.
-    srand(time(NULL));
+    int c;
+    while ((c = getopt_long(argc, argv, "", longOpts, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'f': opts.fineMode = true; break;
+            case 'W': opts.waiting = true; break;
+            case 'k': opts.coroutines = opts.waiting = true; break;
+            case 'p': opts.placeShards = true; break;
+            case 'P':
+                if (!parseCpus(optarg, &opts.supplierCpus))
+                    usage(argv[0]);
+                break;
+            case 'Q':
+                if (!parseCpus(optarg, &opts.customerCpus))
+                    usage(argv[0]);
+                break;
+            case 'K':
+                if (!parseLocks(optarg, &opts))
+                    usage(argv[0]);
+                break;
+            case 'w':
+                if (strcmp(optarg, "none") != 0 && strcmp(optarg, "customers") != 0
+                    && strcmp(optarg, "suppliers") != 0 && strcmp(optarg, "both") != 0)
+                    usage(argv[0]);
+                opts.borrows[LANE_SUPPLIER] = strcmp(optarg, "suppliers") == 0
+                    || strcmp(optarg, "both") == 0;
+                opts.borrows[LANE_CUSTOMER] = strcmp(optarg, "customers") == 0
+                    || strcmp(optarg, "both") == 0;
+                break;
+            case 'd': opts.taskDeadline = atof(optarg) / 1000; break;
+            case 'g':
+                opts.logSink = optarg;
+                if (strcmp(optarg, "text") != 0 && strcmp(optarg, "null") != 0
+                    && (strncmp(optarg, "binary:", 7) != 0 || optarg[7] == '\0'))
+                    usage(argv[0]);
+                break;
+            case 'v':
+                if (!event_level_parse(optarg, &opts.logLevel))
+                    usage(argv[0]);
+                break;
+            case 'D': return event_log_decode(optarg, stdout) ? 0 : 1;
+            case 'S': opts.numSuppliers = atoi(optarg); break;
+            case 'C': opts.numCustomers = atoi(optarg); break;
+            case 't': opts.maxTasks = atoi(optarg); break;
+            case 'i': opts.catalog.inventorySize = atoi(optarg); break;
+            case 's': opts.catalog.numShards = atoi(optarg); break;
+            case 'l': opts.catalog.stripesPerShard = atoi(optarg); break;
+            case 'b': opts.supplierBatch = atoi(optarg); break;
+            case 'B': opts.load.burst = atoi(optarg); break;
+            case 'r': opts.load.rate = atof(optarg); break;
+            case 'G': opts.generators = atoi(optarg); break;
+            case 'e': opts.seed = strtoull(optarg, NULL, 0); break;
+            case 'a':
+                if (!arrival_process_parse(optarg, &opts.load.process))
+                    usage(argv[0]);
+                break;
+            case 'O':
+                if (sscanf(optarg, "%lf,%lf", &opts.load.onTime, &opts.load.offTime) != 2
+                    || opts.load.onTime <= 0 || opts.load.offTime < 0)
+                    usage(argv[0]);
+                break;
+            case 'c': opts.queueCapacity = atoi(optarg); break;
+            case 'o':
+                if (!overflow_policy_parse(optarg, &opts.overflow))
+                    usage(argv[0]);
+                break;
+            case 'x':
+                if (strcmp(optarg, "queue") == 0)
+                    opts.scheduler = SCHED_QUEUE;
+                else if (strcmp(optarg, "steal") == 0)
+                    opts.scheduler = SCHED_STEAL;
+                else if (strcmp(optarg, "shard") == 0)
+                    opts.scheduler = SCHED_SHARD;
+                else if (strcmp(optarg, "priority") == 0)
+                    opts.scheduler = SCHED_PRIORITY;
+                else
+                    usage(argv[0]);
+                break;
+            case 'q':
+                if (!queue_backend_parse(optarg, &opts.queueBackend))
+                    usage(argv[0]);
+                break;
+            case 'L':
+                if (!item_layout_parse(optarg, &opts.catalog.layout))
+                    usage(argv[0]);
+                break;
+            default:  usage(argv[0]);
+        }
+    }
+    if (opts.catalog.inventorySize <= 0 || opts.catalog.numShards <= 0
+        || opts.catalog.stripesPerShard <= 0 || opts.supplierBatch <= 0
+        || opts.supplierBatch > MAX_SUPPLIER_BATCH || opts.load.burst <= 0
+        || opts.numSuppliers <= 0 || opts.numCustomers <= 0 || opts.maxTasks < 0
+        || opts.taskDeadline < 0 || opts.load.rate < 0 || opts.generators <= 0)
+        usage(argv[0]);
+    if (opts.load.rate == 0)
+    {
+        opts.load.rate = 10.0 * opts.load.burst;
+    }
+    // resumes are enqueued under the store mutex, so they must never wait for room
+    bool queues = opts.scheduler == SCHED_QUEUE || opts.scheduler == SCHED_SHARD;
+    bool bounded = queues && (opts.queueCapacity > 0 || opts.queueBackend == QUEUE_RING);
+    if (opts.coroutines && (opts.fineMode || bounded))
+        usage(argv[0]);
+    if (opts.placeShards)
+    {
+        if (opts.supplierCpus.empty())
+            usage(argv[0]);
+        opts.catalog.shardCpus = opts.supplierCpus;
+    }
 
-    if (argc > 1)
-        useFineMode = strcmp(argv[1], "--fine") == 0;
-    startSimulation(10, 10, 100, useFineMode);
+    startSimulation(opts);
     return 0;
 }
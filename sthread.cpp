@@ -2,95 +2,452 @@
 #define _POSIX_PTHREAD_SEMANTICS
 #endif
 #include "sthread.h"
+#include "Random.h"
 #include <assert.h>
+#include <dirent.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <atomic>
 #include <iostream>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 
 
+static const char* lockKindNames[NUM_LOCK_KINDS] = { "blocking", "adaptive", "ticket", "mcs" };
+
+const char* lock_kind_name(LockKind kind)
+{
+    return lockKindNames[kind];
+}
+
+bool lock_kind_parse(const char* name, LockKind* kind)
+{
+    for (int i = 0; i < NUM_LOCK_KINDS; i++)
+    {
+        if (strcmp(name, lockKindNames[i]) == 0)
+        {
+            *kind = (LockKind)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+/*
+ * How many times a waiter polls the lock before going to sleep.
+ * About a microsecond of pause instructions: longer than the
+ * critical sections of EStore, much shorter than a futex round trip
+ * through the scheduler.
+ */
+#define LOCK_SPINS 128
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline uint32_t load_acquire(uint32_t *addr)
+{
+    return __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * A sutil_now time as an absolute CLOCK_MONOTONIC timespec.
+ */
+static struct timespec monotonic_timespec(double time)
+{
+    struct timespec abstime;
+    abstime.tv_sec  = (time_t)time;
+    abstime.tv_nsec = (long)((time - abstime.tv_sec) * 1e9);
+    if (abstime.tv_nsec >= 1000000000)
+    {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+    }
+    return abstime;
+}
+
+/*
+ * Sleep as sfutex_wait, until the given sutil_now time at most.
+ * Returns 0 if that time passed, 1 otherwise.
+ */
+static int sfutex_wait_until(uint32_t *addr, uint32_t expected, double deadline)
+{
+    struct timespec abstime = monotonic_timespec(deadline);
+
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC time
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, expected, &abstime, NULL,
+                FUTEX_BITSET_MATCH_ANY) == -1)
+    {
+        if (errno == ETIMEDOUT)
+        {
+            return 0;
+        }
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            perror("futex wait failed");
+            exit(-1);
+        }
+    }
+    return 1;
+}
+
+
+// the kinds that are pthread mutexes, and wait on the pthread condvar
+static inline bool pthread_kind(const smutex_t *mutex)
+{
+    return mutex->kind == LOCK_BLOCKING || mutex->kind == LOCK_ADAPTIVE;
+}
+
+/*
+ * The ticket kind. A sleeping waiter cannot be told apart from the
+ * others, so an unlock that finds sleepers wakes all of them and
+ * those whose turn it is not go back to sleep.
+ */
+static void ticket_lock(smutex_t *mutex)
+{
+    uint32_t ticket = __atomic_fetch_add(&mutex->next, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < LOCK_SPINS; i++)
+    {
+        if (load_acquire(&mutex->serving) == ticket)
+        {
+            return;
+        }
+        cpu_relax();
+    }
+    for (;;)
+    {
+        __atomic_fetch_add(&mutex->sleepers, 1, __ATOMIC_SEQ_CST);
+        uint32_t serving = __atomic_load_n(&mutex->serving, __ATOMIC_SEQ_CST);
+        if (serving != ticket)
+        {
+            sfutex_wait(&mutex->serving, serving);
+        }
+        __atomic_fetch_sub(&mutex->sleepers, 1, __ATOMIC_RELAXED);
+        if (load_acquire(&mutex->serving) == ticket)
+        {
+            return;
+        }
+    }
+}
+
+static void ticket_unlock(smutex_t *mutex)
+{
+    // seq_cst: a waiter either sees the new value or is counted here
+    __atomic_fetch_add(&mutex->serving, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&mutex->sleepers, __ATOMIC_SEQ_CST) != 0)
+    {
+        sfutex_wake(&mutex->serving, INT_MAX);
+    }
+}
+
+/*
+ * The MCS kind (Mellor-Crummey and Scott, 1991). A waiter's node
+ * is in one of three states; the holder hands the lock over by
+ * swapping the successor's state to MCS_GRANTED, and makes a system
+ * call only if the successor had gone to sleep.
+ *
+ * By the time that wake is made, the successor may already have
+ * seen MCS_GRANTED (after a spurious wake-up), run its critical
+ * section and exited. So nodes are never freed: a thread's spare
+ * nodes go to a global free list when it exits, and a late wake
+ * lands at worst on a node some other waiter has since taken,
+ * which rechecks its state and sleeps again.
+ */
+#define MCS_WAITING 0
+#define MCS_SLEEPING 1
+#define MCS_GRANTED 2
+
+struct alignas(CACHE_LINE_SIZE) smcs_node {
+    struct smcs_node *next;
+    uint32_t state;
+};
+
+static pthread_mutex_t mcsFreeLock = PTHREAD_MUTEX_INITIALIZER;
+static struct smcs_node *mcsFree = NULL;
+
+// a thread's spare MCS nodes, one is taken for every lock it holds
+struct McsNodeCache {
+    struct smcs_node *spare = NULL;
+
+    ~McsNodeCache()
+    {
+        if (spare == NULL)
+        {
+            return;
+        }
+        struct smcs_node *last = spare;
+        while (last->next != NULL)
+        {
+            last = last->next;
+        }
+        pthread_mutex_lock(&mcsFreeLock);
+        last->next = mcsFree;
+        mcsFree = spare;
+        pthread_mutex_unlock(&mcsFreeLock);
+    }
+};
+
+static thread_local McsNodeCache mcsNodes;
+
+static struct smcs_node *mcs_node_get(void)
+{
+    struct smcs_node *node = mcsNodes.spare;
+    if (node != NULL)
+    {
+        mcsNodes.spare = node->next;
+        return node;
+    }
+    pthread_mutex_lock(&mcsFreeLock);
+    node = mcsFree;
+    if (node != NULL)
+    {
+        mcsFree = node->next;
+    }
+    pthread_mutex_unlock(&mcsFreeLock);
+    return node != NULL ? node : new smcs_node;
+}
+
+static void mcs_lock(smutex_t *mutex)
+{
+    struct smcs_node *node = mcs_node_get();
+    __atomic_store_n(&node->next, (struct smcs_node *)NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->state, MCS_WAITING, __ATOMIC_RELAXED);
+
+    struct smcs_node *pred = __atomic_exchange_n(&mutex->tail, node, __ATOMIC_ACQ_REL);
+    if (pred != NULL)
+    {
+        __atomic_store_n(&pred->next, node, __ATOMIC_RELEASE);
+        int i = 0;
+        while (load_acquire(&node->state) != MCS_GRANTED)
+        {
+            if (i++ < LOCK_SPINS)
+            {
+                cpu_relax();
+                continue;
+            }
+            uint32_t waiting = MCS_WAITING;
+            if (__atomic_compare_exchange_n(&node->state, &waiting, MCS_SLEEPING, false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+                || waiting == MCS_SLEEPING)
+            {
+                sfutex_wait(&node->state, MCS_SLEEPING);
+            }
+        }
+    }
+    mutex->holder = node;
+}
+
+static void mcs_unlock(smutex_t *mutex)
+{
+    struct smcs_node *node = mutex->holder;
+    struct smcs_node *succ = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (succ == NULL)
+    {
+        struct smcs_node *expected = node;
+        if (__atomic_compare_exchange_n(&mutex->tail, &expected, (struct smcs_node *)NULL, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+            node->next = mcsNodes.spare;
+            mcsNodes.spare = node;
+            return;
+        }
+        // a waiter has swapped itself in but not linked yet
+        for (int i = 0; (succ = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL; i++)
+        {
+            if (i < LOCK_SPINS)
+            {
+                cpu_relax();
+            }
+            else
+            {
+                sched_yield();
+            }
+        }
+    }
+    if (__atomic_exchange_n(&succ->state, MCS_GRANTED, __ATOMIC_RELEASE) == MCS_SLEEPING)
+    {
+        // succ may be back in a free list by now, but is never freed
+        sfutex_wake(&succ->state, 1);
+    }
+    node->next = mcsNodes.spare;
+    mcsNodes.spare = node;
+}
+
+
 void smutex_init(smutex_t *mutex)
 {
-    if (pthread_mutex_init(mutex, NULL))
+    smutex_init_kind(mutex, LOCK_BLOCKING);
+}
+
+void smutex_init_kind(smutex_t *mutex, LockKind kind)
+{
+    assert(kind >= 0 && kind < NUM_LOCK_KINDS);
+    mutex->kind = kind;
+    if (pthread_kind(mutex))
     {
-        perror("pthread_mutex_init failed");
-        exit(-1);
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        if (kind == LOCK_ADAPTIVE)
+        {
+            pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+        }
+        if (pthread_mutex_init(&mutex->pthread, &attr))
+        {
+            perror("pthread_mutex_init failed");
+            exit(-1);
+        }
+        pthread_mutexattr_destroy(&attr);
+        return;
     }
+    mutex->next = 0;
+    mutex->serving = 0;
+    mutex->sleepers = 0;
+    mutex->tail = NULL;
+    mutex->holder = NULL;
 }
 
 void smutex_destroy(smutex_t *mutex)
 {
-    if (pthread_mutex_destroy(mutex))
+    if (pthread_kind(mutex))
     {
-        perror("pthread_mutex_destroy failed");
-        exit(-1);
+        if (pthread_mutex_destroy(&mutex->pthread))
+        {
+            perror("pthread_mutex_destroy failed");
+            exit(-1);
+        }
+        return;
     }
+    assert(mutex->next == mutex->serving && mutex->tail == NULL);
 }
 
 void smutex_lock(smutex_t *mutex)
 {
-    if (pthread_mutex_lock(mutex))
+    switch (mutex->kind)
     {
-        perror("pthread_mutex_lock failed");
-        exit(-1);
+        case LOCK_TICKET:
+            ticket_lock(mutex);
+            break;
+        case LOCK_MCS:
+            mcs_lock(mutex);
+            break;
+        default:
+            if (pthread_mutex_lock(&mutex->pthread))
+            {
+                perror("pthread_mutex_lock failed");
+                exit(-1);
+            }
+            break;
     }
 }
 
 void smutex_unlock(smutex_t *mutex)
 {
-    if (pthread_mutex_unlock(mutex))
+    switch (mutex->kind)
     {
-        perror("pthread_mutex_unlock failed");
-        exit(-1);
+        case LOCK_TICKET:
+            ticket_unlock(mutex);
+            break;
+        case LOCK_MCS:
+            mcs_unlock(mutex);
+            break;
+        default:
+            if (pthread_mutex_unlock(&mutex->pthread))
+            {
+                perror("pthread_mutex_unlock failed");
+                exit(-1);
+            }
+            break;
     }
 }
 
 
 
+/*
+ * Waiters on a pthread mutex use the pthread condition variable.
+ * Waiters on the FIFO kinds sleep on a sequence number until it
+ * moves past the value they read while still holding the mutex, so
+ * a signal sent after they let go of the mutex is never lost.
+ * Either way, timed waits use the monotonic clock, like sutil_now.
+ */
 void scond_init(scond_t *cond)
 {
-    if (pthread_cond_init(cond, NULL))
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&cond->pthread, &attr))
     {
         perror("pthread_cond_init failed");
         exit(-1);
     }
+    pthread_condattr_destroy(&attr);
+    cond->seq = 0;
+    cond->waiters = 0;
 }
 
 void scond_destroy(scond_t *cond)
 {
-    if (pthread_cond_destroy(cond))
+    assert(cond->waiters == 0);
+    if (pthread_cond_destroy(&cond->pthread))
     {
         perror("pthread_cond_destroy failed");
         exit(-1);
     }
 }
 
-void scond_signal(scond_t *cond, smutex_t *mutex __attribute__((unused)))
+void scond_signal(scond_t *cond, smutex_t *mutex)
 {
     //
     // assert(mutex is held by this thread);
     //
 
-    if (pthread_cond_signal(cond))
+    if (pthread_kind(mutex))
     {
-        perror("pthread_cond_signal failed");
-        exit(-1);
+        if (pthread_cond_signal(&cond->pthread))
+        {
+            perror("pthread_cond_signal failed");
+            exit(-1);
+        }
+        return;
+    }
+    __atomic_fetch_add(&cond->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cond->waiters, __ATOMIC_SEQ_CST) != 0)
+    {
+        sfutex_wake(&cond->seq, 1);
     }
 }
 
-void scond_broadcast(scond_t *cond, smutex_t *mutex __attribute__((unused)))
+void scond_broadcast(scond_t *cond, smutex_t *mutex)
 {
     //
     // assert(mutex is held by this thread);
     //
 
-    if (pthread_cond_broadcast(cond))
+    if (pthread_kind(mutex))
     {
-        perror("pthread_cond_broadcast failed");
-        exit(-1);
+        if (pthread_cond_broadcast(&cond->pthread))
+        {
+            perror("pthread_cond_broadcast failed");
+            exit(-1);
+        }
+        return;
+    }
+    __atomic_fetch_add(&cond->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cond->waiters, __ATOMIC_SEQ_CST) != 0)
+    {
+        sfutex_wake(&cond->seq, INT_MAX);
     }
 }
 
@@ -100,9 +457,66 @@ void scond_wait(scond_t *cond, smutex_t *mutex)
     // assert(mutex is held by this thread);
     //
 
-    if (pthread_cond_wait(cond, mutex))
+    if (pthread_kind(mutex))
     {
-        perror("pthread_cond_wait failed");
+        if (pthread_cond_wait(&cond->pthread, &mutex->pthread))
+        {
+            perror("pthread_cond_wait failed");
+            exit(-1);
+        }
+        return;
+    }
+    __atomic_fetch_add(&cond->waiters, 1, __ATOMIC_SEQ_CST);
+    uint32_t seq = __atomic_load_n(&cond->seq, __ATOMIC_SEQ_CST);
+    smutex_unlock(mutex);
+    sfutex_wait(&cond->seq, seq);
+    smutex_lock(mutex);
+    __atomic_fetch_sub(&cond->waiters, 1, __ATOMIC_RELAXED);
+}
+
+int scond_timedwait(scond_t *cond, smutex_t *mutex, double deadline)
+{
+    if (pthread_kind(mutex))
+    {
+        struct timespec abstime = monotonic_timespec(deadline);
+        int err = pthread_cond_timedwait(&cond->pthread, &mutex->pthread, &abstime);
+        if (err == ETIMEDOUT)
+        {
+            return 0;
+        }
+        if (err)
+        {
+            perror("pthread_cond_timedwait failed");
+            exit(-1);
+        }
+        return 1;
+    }
+    __atomic_fetch_add(&cond->waiters, 1, __ATOMIC_SEQ_CST);
+    uint32_t seq = __atomic_load_n(&cond->seq, __ATOMIC_SEQ_CST);
+    smutex_unlock(mutex);
+    int woken = sfutex_wait_until(&cond->seq, seq, deadline);
+    smutex_lock(mutex);
+    __atomic_fetch_sub(&cond->waiters, 1, __ATOMIC_RELAXED);
+    return woken;
+}
+
+
+
+void sfutex_wait(uint32_t *addr, uint32_t expected)
+{
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0) == -1
+        && errno != EAGAIN && errno != EINTR)
+    {
+        perror("futex wait failed");
+        exit(-1);
+    }
+}
+
+void sfutex_wake(uint32_t *addr, int count)
+{
+    if (syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0) == -1)
+    {
+        perror("futex wake failed");
         exit(-1);
     }
 }
@@ -132,6 +546,57 @@ void sthread_create(sthread_t *thread,
     }
 }
 
+void sthread_create_on(sthread_t *thread,
+                       void *(start_routine(void*)),
+                       void *argToStartRoutine,
+                       int cpu)
+{
+    if (cpu < 0)
+    {
+        sthread_create(thread, start_routine, argToStartRoutine);
+        return;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus))
+    {
+        perror("pthread_attr_setaffinity_np failed");
+        exit(-1);
+    }
+
+    if (pthread_create(thread, &attr, start_routine, argToStartRoutine))
+    {
+        perror("pthread_create failed");
+        exit(-1);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void sthread_pin(int cpu)
+{
+    if (cpu < 0)
+    {
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err)
+    {
+        errno = err;
+        perror("pthread_setaffinity_np failed");
+        exit(-1);
+    }
+}
+
 void sthread_exit(void)
 {
     pthread_exit(NULL);
@@ -156,28 +621,64 @@ void sthread_sleep(unsigned int seconds, unsigned int nanoseconds)
     }
 }
 
+void sthread_sleep_until(double time)
+{
+    struct timespec abstime = monotonic_timespec(time);
+    int err;
+    while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &abstime, NULL)) == EINTR)
+    {
+        // a signal; the wake-up time is absolute, so sleep again as is
+    }
+    if (err != 0)
+    {
+        errno = err;
+        perror("sleep failed");
+        exit(-1);
+    }
+}
+
 
 
 /*
- * random() in stdlib.h is not MT-safe, so we need to lock
- * it.
+ * Each thread draws from a Random of its own, so no lock is needed;
+ * threads take streams in the order they first call sutil_random.
  */
-pthread_mutex_t sulock = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<uint64_t> randomStreams(0);
+static thread_local Random sutilRandom(1, randomStreams.fetch_add(1, std::memory_order_relaxed));
 
 long sutil_random()
 {
-    long val;
+    // 31 bits, the range of random()
+    return (long)(sutilRandom.next() >> 33);
+}
+
+double sutil_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    if (pthread_mutex_lock(&sulock))
+int sutil_cpu_node(int cpu)
+{
+    // /sys/devices/system/cpu/cpuN holds a nodeM link for its node
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
     {
-        perror("random lock");
-        exit(-1);
+        return 0;
     }
-    val = random();
-    if (pthread_mutex_unlock(&sulock))
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
     {
-        perror("random unlock");
-        exit(-1);
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+        {
+            break;
+        }
+        node = 0;
     }
-    return val;
+    closedir(dir);
+    return node;
 }
@@ -9,13 +9,88 @@ nanosleep}.
 */
 
 #include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 
-typedef pthread_mutex_t smutex_t;
-typedef pthread_cond_t scond_t;
+/*
+ * Size of a cache line, for padding data that different threads
+ * write so that it does not false-share.
+ */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Kinds of smutex_t. The blocking and adaptive kinds are pthread
+ * mutexes; the FIFO kinds are built here on a futex, and spin only
+ * for a bounded time before they sleep, so they stay usable with
+ * more threads than CPUs.
+ *
+ *      LOCK_BLOCKING   a default pthread mutex: sleep as soon as the
+ *                      lock is found held.
+ *      LOCK_ADAPTIVE   a PTHREAD_MUTEX_ADAPTIVE_NP mutex, which
+ *                      spins for a while first, since the holder of
+ *                      a short critical section is likely to be
+ *                      done by then.
+ *      LOCK_TICKET     first come, first served: take a ticket and
+ *                      spin, then sleep, until it is served. All
+ *                      waiters watch one word.
+ *      LOCK_MCS        first come, first served through a queue of
+ *                      per-waiter nodes; each waiter spins, then
+ *                      sleeps, on its own node, and unlock touches
+ *                      only the successor's.
+ */
+enum LockKind {
+    LOCK_BLOCKING = 0,
+    LOCK_ADAPTIVE,
+    LOCK_TICKET,
+    LOCK_MCS,
+    NUM_LOCK_KINDS
+};
+
+const char* lock_kind_name(LockKind kind);
+bool lock_kind_parse(const char* name, LockKind* kind);
+
+struct smcs_node;
+
+/*
+ * The state of the kind in use, then the kind, last: it is only
+ * read after init, so it may sit on another cache line than the
+ * words that are written (see PaddedItem).
+ */
+typedef struct {
+    union {
+        pthread_mutex_t pthread;        // blocking, adaptive
+        struct {
+            uint32_t next;              // ticket: next ticket to hand out
+            uint32_t serving;           // ticket: ticket that holds the lock
+            uint32_t sleepers;          // ticket: waiters asleep on serving
+            struct smcs_node *tail;     // mcs: last node in the queue
+            struct smcs_node *holder;   // mcs: node of the holder
+        };
+    };
+    uint32_t kind;
+} smutex_t;
+
+static_assert(sizeof(smutex_t) == sizeof(pthread_mutex_t) + 8, "a pthread mutex and its kind");
+
+/*
+ * A pthread condition variable for waiters on pthread mutexes, and
+ * a sequence number on a futex for waiters on the FIFO kinds;
+ * signal and broadcast wake both.
+ */
+typedef struct {
+    pthread_cond_t pthread;
+    uint32_t seq;               // bumped by every signal and broadcast
+    uint32_t waiters;           // futex waiters only
+} scond_t;
+
 typedef pthread_t sthread_t;
 
+/*
+ * smutex_init makes a LOCK_BLOCKING mutex; smutex_init_kind one of
+ * the given kind.
+ */
 void smutex_init(smutex_t *mutex);
+void smutex_init_kind(smutex_t *mutex, LockKind kind);
 void smutex_destroy(smutex_t *mutex);
 void smutex_lock(smutex_t *mutex);
 void smutex_unlock(smutex_t *mutex);
@@ -28,6 +103,21 @@ void scond_signal(scond_t *cond, smutex_t *mutex);
 void scond_broadcast(scond_t *cond, smutex_t *mutex);
 void scond_wait(scond_t *cond, smutex_t *mutex);
 
+/*
+ * Wait as scond_wait, but give up at the given deadline (in
+ * sutil_now seconds). Returns 0 if the deadline passed, 1 otherwise.
+ */
+int scond_timedwait(scond_t *cond, smutex_t *mutex, double deadline);
+
+
+
+/*
+ * Futex wrappers (Linux, process private). sfutex_wait sleeps only
+ * if *addr still holds expected, and may return spuriously.
+ * sfutex_wake wakes up to count sleepers on addr.
+ */
+void sfutex_wait(uint32_t *addr, uint32_t expected);
+void sfutex_wake(uint32_t *addr, int count);
 
 
 void sthread_create(sthread_t *thrd,
@@ -35,6 +125,23 @@ void sthread_create(sthread_t *thrd,
                     void *argToStartRoutine);
 void sthread_exit(void);
 
+/*
+ * Create a thread as sthread_create, but only allowed to run on the
+ * given CPU, from its first instruction on (so its first-touch
+ * allocations land on that CPU's NUMA node). A negative cpu means
+ * no pinning.
+ */
+void sthread_create_on(sthread_t *thrd,
+                       void *(start_routine(void*)),
+                       void *argToStartRoutine,
+                       int cpu);
+
+/*
+ * Pin the calling thread to the given CPU. Does nothing if cpu is
+ * negative.
+ */
+void sthread_pin(int cpu);
+
 /*
  * Block until the specified thread exits. If the thread has
  * already exited, this function returns immediately.
@@ -44,12 +151,30 @@ void sthread_join(sthread_t thrd);
 
 void sthread_sleep(unsigned int seconds, unsigned int nanoseconds);
 
+/*
+ * Sleep until the given sutil_now time; return at once if it has
+ * passed. Unlike sleeping for an interval, a loop that sleeps until
+ * times it computes from a fixed start does not drift.
+ */
+void sthread_sleep_until(double time);
+
 
 /*
- * The normal random() library is not thread safe,
- * so we add a wrapper with locks.
+ * A random number in [0, 2^31), like random(), from a per-thread
+ * generator that needs no lock. Code that must repeat its numbers
+ * from a seed should own a Random (Random.h) instead.
  */
 long sutil_random(void);
 
+/*
+ * Seconds on the monotonic clock, the clock used by scond_timedwait.
+ */
+double sutil_now(void);
+
+/*
+ * The NUMA node of a CPU, from sysfs; 0 if the system does not say.
+ */
+int sutil_cpu_node(int cpu);
+
 #endif
 